@@ -1,5 +1,6 @@
 // Copyright Epic Games, Inc. All Rights Reserved.
 
+using System.IO;
 using UnrealBuildTool;
 
 public class LLMConnector : ModuleRules
@@ -42,5 +43,22 @@ public class LLMConnector : ModuleRules
 				"DeveloperSettings"
 			}
 		);
+
+		//=== Embedded model ===
+		// llama.cpp is not shipped with the plugin. Build it as static CPU libraries and copy
+		// include/ and lib/<Platform>/ into Source/ThirdParty/llama to enable the Embedded profile
+		string LlamaPath = Path.Combine(PluginDirectory, "Source", "ThirdParty", "llama");
+		string LlamaLibPath = Path.Combine(LlamaPath, "lib", Target.Platform.ToString());
+		bool bWithEmbeddedInference = Directory.Exists(Path.Combine(LlamaPath, "include")) && Directory.Exists(LlamaLibPath);
+		PublicDefinitions.Add("WITH_LLM_EMBEDDED_INFERENCE=" + (bWithEmbeddedInference ? "1" : "0"));
+		if (bWithEmbeddedInference)
+		{
+			PrivateIncludePaths.Add(Path.Combine(LlamaPath, "include"));
+			string LibPattern = Target.Platform == UnrealTargetPlatform.Win64 ? "*.lib" : "*.a";
+			foreach (string Library in Directory.GetFiles(LlamaLibPath, LibPattern))
+			{
+				PublicAdditionalLibraries.Add(Library);
+			}
+		}
 	}
 }
\ No newline at end of file
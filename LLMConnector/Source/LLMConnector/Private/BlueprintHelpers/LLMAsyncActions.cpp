@@ -5,12 +5,16 @@
 
 
 //----------------------------------------------------------------------
-ULLMSendPromptAsyncAction* ULLMSendPromptAsyncAction::SendLLMPrompt(UObject* WorldContextObject, const FString& Message, ELLMRole Role)
+ULLMSendPromptAsyncAction* ULLMSendPromptAsyncAction::SendLLMPrompt(UObject* WorldContextObject, const FString& Message, ELLMRole Role, ULLMConversation* Conversation)
 {
   ULLMSendPromptAsyncAction* Action = NewObject<ULLMSendPromptAsyncAction>();
   Action->Message = Message;
   Action->Role = Role;
   Action->WorldContextObject = WorldContextObject;
+  Action->Conversation = Conversation;
+
+  // Keeps the action alive while it waits, SetReadyToDestroy releases it
+  Action->RegisterWithGameInstance(WorldContextObject);
   return Action;
 }
 
@@ -18,7 +22,10 @@ ULLMSendPromptAsyncAction* ULLMSendPromptAsyncAction::SendLLMPrompt(UObject* Wor
 void ULLMSendPromptAsyncAction::Activate()
 {
   // Get the LLM connector subsystem
-  ULLMConnectorSubsystem* LLMConnector = ULLMConnectorSubsystem::GetLLMConnector(WorldContextObject.Get());
+  ULLMConversation* TargetConversation = Conversation.Get();
+  ULLMConnectorSubsystem* LLMConnector = TargetConversation != nullptr
+    ? TargetConversation->GetConnector()
+    : ULLMConnectorSubsystem::GetLLMConnector(WorldContextObject.Get());
   if(!LLMConnector)
   {
     OnError.Broadcast("Failed to get LLM Connector subsystem");
@@ -26,53 +33,58 @@ void ULLMSendPromptAsyncAction::Activate()
     return;
   }
 
-  // Check if we can send a prompt now
-  if(!LLMConnector->CanSendLLMPrompt())
+  // Busy subsystem queues the prompt, the action waits for its own request
+  Connector = LLMConnector;
+  LLMConnector->OnRequestCompletedNative.AddUObject(this, &ULLMSendPromptAsyncAction::HandleRequestCompleted);
+  LLMConnector->OnRequestFailedNative.AddUObject(this, &ULLMSendPromptAsyncAction::HandleRequestFailed);
+
+  // Send the prompt
+  RequestId = TargetConversation != nullptr ? TargetConversation->SendLLMPrompt(Message, Role) : LLMConnector->SendLLMPrompt(Message, Role);
+  if(RequestId == 0)
+  {
+    Finish();
+    OnError.Broadcast("Failed to send the prompt, check the API key");
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMSendPromptAsyncAction::HandleRequestCompleted(int32 CompletedRequestId, const FLLMResponseBase& ResponseParams)
+{
+  if(CompletedRequestId != RequestId)
   {
-    OnError.Broadcast("Another request is already in progress");
-    SetReadyToDestroy();
     return;
   }
 
-  // Set up response delegates
-  FDelegateHandle ResponseHandle = LLMConnector->OnResponseReceivedNative.AddUObject(this, &ULLMSendPromptAsyncAction::HandleLLMResponse);
-  FScriptDelegate ErrorDelegate;
-  ErrorDelegate.BindUFunction(this, "HandleLLMError");
-  LLMConnector->OnError.Add(ErrorDelegate);
+  Finish();
 
-  // Send the prompt
-  LLMConnector->SendLLMPrompt(Message, Role);
+  // Broadcast the response
+  OnCompleted.Broadcast(ResponseParams);
 }
 
 //----------------------------------------------------------------------
-void ULLMSendPromptAsyncAction::HandleLLMResponse(const FLLMResponseBase& ResponseParams)
+void ULLMSendPromptAsyncAction::HandleRequestFailed(int32 FailedRequestId, ELLMErrorType ErrorType)
 {
-  // Remove delegate bindings
-  if(ULLMConnectorSubsystem* LLMConnector = ULLMConnectorSubsystem::GetLLMConnector(WorldContextObject.Get()))
+  if(FailedRequestId != RequestId)
   {
-    LLMConnector->OnResponseReceivedNative.RemoveAll(this);
-    LLMConnector->OnError.RemoveAll(this);
+    return;
   }
 
-  // Broadcast the response
-  OnCompleted.Broadcast(ResponseParams);
+  Finish();
 
-  // Mark for garbage collection
-  SetReadyToDestroy();
+  // Broadcast the error
+  OnError.Broadcast(StaticEnum<ELLMErrorType>()->GetNameStringByValue(static_cast<int64>(ErrorType)));
 }
 
 //----------------------------------------------------------------------
-void ULLMSendPromptAsyncAction::HandleLLMError(const FString& ErrorMessage)
+void ULLMSendPromptAsyncAction::Finish()
 {
   // Remove delegate bindings
-  if(ULLMConnectorSubsystem* LLMConnector = ULLMConnectorSubsystem::GetLLMConnector(WorldContextObject.Get()))
+  if(ULLMConnectorSubsystem* LLMConnector = Connector.Get())
   {
-    LLMConnector->OnResponseReceivedNative.RemoveAll(this);
-    LLMConnector->OnError.RemoveAll(this);
+    LLMConnector->OnRequestCompletedNative.RemoveAll(this);
+    LLMConnector->OnRequestFailedNative.RemoveAll(this);
   }
-
-  // Broadcast the error
-  OnError.Broadcast(ErrorMessage);
+  Connector.Reset();
 
   // Mark for garbage collection
   SetReadyToDestroy();
@@ -7,8 +7,14 @@
 
 
 
+class ULLMConnectorSubsystem;
+class ULLMConversation;
+
+
+
 /**
  * Async action to send a message to LLM and wait for response
+ * Completes only with the response to its own prompt, several actions can wait at once
  */
 UCLASS()
 class LLMCONNECTOR_API ULLMSendPromptAsyncAction : public UBlueprintAsyncActionBase
@@ -35,10 +41,11 @@ public:
    * @param WorldContextObject Object with world context (usually self)
    * @param Message Message to send to the LLM
    * @param Role Role of the sender (system, user, assistant)
+   * @param Conversation Conversation to send to, the default conversation if not set
    * @return Async action object for blueprint node
    */
-  UFUNCTION(BlueprintCallable, meta = (BlueprintInternalUseOnly = "true", WorldContext = "WorldContextObject", DisplayName = "Send LLM Message (Async)"), Category = "LLM|Async")
-  static ULLMSendPromptAsyncAction* SendLLMPrompt(UObject* WorldContextObject, const FString& Message, ELLMRole Role = ELLMRole::User);
+  UFUNCTION(BlueprintCallable, meta = (BlueprintInternalUseOnly = "true", WorldContext = "WorldContextObject", DisplayName = "Send LLM Message (Async)", AdvancedDisplay = "Conversation"), Category = "LLM|Async")
+  static ULLMSendPromptAsyncAction* SendLLMPrompt(UObject* WorldContextObject, const FString& Message, ELLMRole Role = ELLMRole::User, ULLMConversation* Conversation = nullptr);
 
   // UBlueprintAsyncActionBase interface
   virtual void Activate() override;
@@ -54,9 +61,21 @@ private:
   /** The world context */
   TWeakObjectPtr<UObject> WorldContextObject;
 
+  /** Optional conversation of the prompt */
+  TWeakObjectPtr<ULLMConversation> Conversation;
+
+  /** Subsystem the prompt was sent to */
+  TWeakObjectPtr<ULLMConnectorSubsystem> Connector;
+
+  /** Id of the prompt, responses to other requests are ignored */
+  int32 RequestId = 0;
+
   /** Callback for LLM response */
-  void HandleLLMResponse(const FLLMResponseBase& ResponseParams);
+  void HandleRequestCompleted(int32 CompletedRequestId, const FLLMResponseBase& ResponseParams);
 
   /** Callback for LLM error */
-  void HandleLLMError(const FString& ErrorMessage);
+  void HandleRequestFailed(int32 FailedRequestId, ELLMErrorType ErrorType);
+
+  /** Remove delegate bindings and mark for garbage collection */
+  void Finish();
 };
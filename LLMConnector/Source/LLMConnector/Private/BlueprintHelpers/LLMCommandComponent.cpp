@@ -35,7 +35,8 @@ void ULLMCommandComponent::RegisterWithLLM()
     {
       const FLLMCommandStruct& Struct = GetCommandStruct();
       CommandHandler->InitWithParams(Struct);
-      LLMConnector->RegisterCommandHandler(CommandHandler);
+      CommandHandlerHandle = LLMConnector->RegisterCommandHandler(CommandHandler);
+      RegisteredConnector = LLMConnector;
       UE_LOG(LLM, Log, TEXT("Registered command: %s for target: %s"), *Struct.Name, *Struct.Target);
     }
   }
@@ -44,6 +45,14 @@ void ULLMCommandComponent::RegisterWithLLM()
 //----------------------------------------------------------------------
 void ULLMCommandComponent::UnregisterFromLLM()
 {
+  // Remove the command from the subsystem and prompts
+  if(ULLMConnectorSubsystem* LLMConnector = RegisteredConnector.Get())
+  {
+    LLMConnector->UnregisterCommandHandler(CommandHandlerHandle);
+  }
+  RegisteredConnector.Reset();
+  CommandHandlerHandle = FLLMCommandHandlerHandle();
+
   // Clean up handler
   CommandHandler = nullptr;
 }
@@ -106,3 +115,9 @@ FString ULLMComponentCommandHandler::ExecuteCommand(const FLLMResponseBase& Resp
   }
   return TEXT("Error: Command component is no longer valid");
 }
+
+//----------------------------------------------------------------------
+AActor* ULLMComponentCommandHandler::GetCommandActor() const
+{
+  return OwnerComponent.IsValid() ? OwnerComponent->GetOwner() : nullptr;
+}
@@ -59,6 +59,10 @@ private:
   UPROPERTY()
   ULLMCommandHandlerBase* CommandHandler;
 
+  // Registration to remove on unregister, the subsystem may be gone first during shutdown
+  FLLMCommandHandlerHandle CommandHandlerHandle;
+  TWeakObjectPtr<class ULLMConnectorSubsystem> RegisteredConnector;
+
   // Create a command handler instance
   ULLMCommandHandlerBase* CreateCommandHandler();
 };
@@ -81,6 +85,7 @@ public:
   // ULLMCommandHandlerBase interface
   virtual bool CanExecuteCommand(const FLLMResponseBase& ResponseParams) override;
   virtual FString ExecuteCommand(const FLLMResponseBase& ResponseParams) override;
+  virtual AActor* GetCommandActor() const override;
   // End of ULLMCommandHandlerBase interface
 
 private:
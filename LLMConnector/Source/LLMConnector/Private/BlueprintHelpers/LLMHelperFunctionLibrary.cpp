@@ -1,5 +1,7 @@
 ﻿#include "LLMHelperFunctionLibrary.h"
 
+#include "LLMParameterParser.h"
+
 
 
 //----------------------------------------------------------------------
@@ -26,39 +28,8 @@ bool ULLMHelperFunctionLibrary::ExtractStringAndInt(const TArray<FString>& Parts
   // Get the string part
   OutString = Parts[0];
 
-  // Get the int part
-  if(Parts[1].IsNumeric())
-  {
-    OutInt = FCString::Atoi(*Parts[1]);
-  }
-  else
-  {
-    // Try to extract number from non-numeric string (like "5seconds")
-    FString NumericPart;
-    for(TCHAR Character : Parts[1])
-    {
-      if(FChar::IsDigit(Character))
-      {
-        NumericPart.AppendChar(Character);
-      }
-      else if(!NumericPart.IsEmpty())
-      {
-        // Stop at first non-digit after finding digits
-        break;
-      }
-    }
-
-    if(!NumericPart.IsEmpty())
-    {
-      OutInt = FCString::Atoi(*NumericPart);
-    }
-    else
-    {
-      return false;
-    }
-  }
-
-  return true;
+  // Get the int part, also from non-numeric strings like "5seconds"
+  return FLLMParameterParser::TryParseInt(Parts[1], OutInt);
 }
 
 //----------------------------------------------------------------------
@@ -0,0 +1,63 @@
+﻿#include "LLMCommandSpatialIndex.h"
+
+
+
+//----------------------------------------------------------------------
+void FLLMCommandSpatialIndex::Reset(float InCellSize)
+{
+  m_CellSize = FMath::Max(InCellSize, 1.0f);
+  m_Cells.Reset();
+  m_Num = 0;
+}
+
+//----------------------------------------------------------------------
+void FLLMCommandSpatialIndex::Add(int32 Id, const FVector& Location)
+{
+  m_Cells.FindOrAdd(GetCell(Location)).Add(Id);
+  ++m_Num;
+}
+
+//----------------------------------------------------------------------
+void FLLMCommandSpatialIndex::Query(const FVector& Center, float Radius, TArray<int32>& OutIds) const
+{
+  const FIntVector Min = GetCell(Center - FVector(Radius));
+  const FIntVector Max = GetCell(Center + FVector(Radius));
+  const int64 NumQueryCells = int64(Max.X - Min.X + 1) * (Max.Y - Min.Y + 1) * (Max.Z - Min.Z + 1);
+
+  // A radius covering most of the world is cheaper to answer from the occupied cells
+  if(NumQueryCells > m_Cells.Num())
+  {
+    for(const auto& Pair : m_Cells)
+    {
+      const FIntVector& Cell = Pair.Key;
+      if(Cell.X >= Min.X && Cell.X <= Max.X && Cell.Y >= Min.Y && Cell.Y <= Max.Y && Cell.Z >= Min.Z && Cell.Z <= Max.Z)
+      {
+        OutIds.Append(Pair.Value);
+      }
+    }
+    return;
+  }
+
+  for(int32 Z = Min.Z; Z <= Max.Z; ++Z)
+  {
+    for(int32 Y = Min.Y; Y <= Max.Y; ++Y)
+    {
+      for(int32 X = Min.X; X <= Max.X; ++X)
+      {
+        if(const TArray<int32>* Ids = m_Cells.Find(FIntVector(X, Y, Z)))
+        {
+          OutIds.Append(*Ids);
+        }
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+FIntVector FLLMCommandSpatialIndex::GetCell(const FVector& Location) const
+{
+  return FIntVector(
+    FMath::FloorToInt(Location.X / m_CellSize),
+    FMath::FloorToInt(Location.Y / m_CellSize),
+    FMath::FloorToInt(Location.Z / m_CellSize));
+}
@@ -0,0 +1,154 @@
+﻿#include "LLMConnectorStructs.h"
+
+#include "LLMPromptWriter.h"
+
+
+
+//----------------------------------------------------------------------
+void FLLMPromptNode::WriteTo(FStringBuilderBase& Out, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */) const
+{
+  FLLMPromptNodeView View;
+  TLLMPromptWriter<FLLMPromptNodeView> Writer(View, Out);
+  Writer.Write(this, Format);
+}
+
+//----------------------------------------------------------------------
+FString FLLMPromptNode::ToString(ELLMPromptFormat Format) const
+{
+  TStringBuilder<2048> Builder;
+  WriteTo(Builder, Format);
+  return FString(Builder.Len(), Builder.GetData());
+}
+
+//----------------------------------------------------------------------
+FString FLLMPromptNode::ToString(int32 Indent /*= 0 */) const
+{
+  TStringBuilder<2048> Builder;
+  FLLMPromptNodeView View;
+  TLLMPromptWriter<FLLMPromptNodeView> Writer(View, Builder);
+  Writer.Write(this, ELLMPromptFormat::Indented, Indent);
+  return FString(Builder.Len(), Builder.GetData());
+}
+
+//----------------------------------------------------------------------
+int32 FLLMPromptNode::EstimateTokenCount(const FString& Text)
+{
+  int32 Tokens = 0;
+  int32 Index = 0;
+  const int32 Len = Text.Len();
+
+  while(Index < Len)
+  {
+    const TCHAR Character = Text[Index];
+    const int32 Start = Index;
+
+    if(FChar::IsAlpha(Character))
+    {
+      const bool bAscii = Character < 128;
+      while(Index < Len && FChar::IsAlpha(Text[Index]) && (Text[Index] < 128) == bAscii)
+      {
+        ++Index;
+      }
+      // English words up to ~6 letters are usually one token, other scripts take ~3 characters per token
+      const int32 WordLen = Index - Start;
+      Tokens += bAscii ? 1 + (WordLen - 1) / 6 : 1 + WordLen / 3;
+    }
+    else if(FChar::IsDigit(Character))
+    {
+      while(Index < Len && FChar::IsDigit(Text[Index]))
+      {
+        ++Index;
+      }
+      // Numbers are split into groups of up to three digits
+      Tokens += 1 + (Index - Start - 1) / 3;
+    }
+    else if(Character == TEXT(' '))
+    {
+      // A single space is merged into the next word
+      while(Index < Len && Text[Index] == TEXT(' '))
+      {
+        ++Index;
+      }
+      if(Index - Start > 1 || Index == Len || !FChar::IsAlnum(Text[Index]))
+      {
+        ++Tokens;
+      }
+    }
+    else if(FChar::IsWhitespace(Character))
+    {
+      while(Index < Len && FChar::IsWhitespace(Text[Index]))
+      {
+        ++Index;
+      }
+      ++Tokens;
+    }
+    else
+    {
+      ++Index;
+      ++Tokens;
+    }
+  }
+
+  return Tokens;
+}
+
+
+
+//----------------------------------------------------------------------
+FString FLLMCommandParameter::ToPromptString() const
+{
+  switch(Type)
+  {
+  case ELLMParameterType::Enum:
+    return FString::Printf(TEXT("%s (%s)%s"), *Name, *FString::Join(EnumValues, TEXT("|")), bOptional ? TEXT(" optional") : TEXT(""));
+  case ELLMParameterType::Int:
+    return FString::Printf(TEXT("%s (int)%s"), *Name, bOptional ? TEXT(" optional") : TEXT(""));
+  case ELLMParameterType::Float:
+    return FString::Printf(TEXT("%s (float)%s"), *Name, bOptional ? TEXT(" optional") : TEXT(""));
+  case ELLMParameterType::Bool:
+    return FString::Printf(TEXT("%s (true|false)%s"), *Name, bOptional ? TEXT(" optional") : TEXT(""));
+  case ELLMParameterType::Vector:
+    return FString::Printf(TEXT("%s (x,y,z)%s"), *Name, bOptional ? TEXT(" optional") : TEXT(""));
+  default:
+    return FString::Printf(TEXT("%s%s"), *Name, bOptional ? TEXT(" (optional)") : TEXT(""));
+  }
+}
+
+
+
+//----------------------------------------------------------------------
+FLLMResponseBase FLLMResponseBase::GetCommandResponse(int32 Index) const
+{
+  FLLMResponseBase Result;
+  Result.Message = Message;
+  Result.Reasoning = Reasoning;
+  if(!Commands.IsValidIndex(Index))
+  {
+    return Result;
+  }
+
+  const FLLMCommandCall& Call = Commands[Index];
+  Result.Commands.Add(Call);
+  Result.UpdatePrimaryCommand();
+  for(const FLLMToolCall& ToolCall : ToolCalls)
+  {
+    if(!Call.ToolCallId.IsEmpty() && ToolCall.Id == Call.ToolCallId)
+    {
+      Result.ToolCalls.Add(ToolCall);
+    }
+  }
+  return Result;
+}
+
+//----------------------------------------------------------------------
+void FLLMResponseBase::UpdatePrimaryCommand()
+{
+  if(Commands.IsEmpty())
+  {
+    return;
+  }
+  Command = Commands[0].Command;
+  Target = Commands[0].Target;
+  Parameters = Commands[0].Parameters;
+  TypedParameters = Commands[0].TypedParameters;
+}
@@ -1,11 +1,80 @@
 ﻿#include "LLMConnectorSubsystem.h"
 
 #include "LLMConnectorSettings.h"
+#include "LLMContextRegistry.h"
+#include "LLMParameterParser.h"
+#include "LLMLenientJson.h"
+#include "LLMEmbeddedBackend.h"
+#include "LLMTokenizer.h"
+#include "Async/Async.h"
+#include "Misc/FileHelper.h"
+#include "Misc/CommandLine.h"
+#include "Misc/Paths.h"
+#include "Hash/CityHash.h"
+#include "Engine/World.h"
+#include "GameFramework/Actor.h"
 #include "HttpModule.h"
 #include "Interfaces/IHttpResponse.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonSerializer.h"
 
 DEFINE_LOG_CATEGORY(LLM);
 
+DECLARE_STATS_GROUP(TEXT("LLMConnector"), STATGROUP_LLMConnector, STATCAT_Advanced);
+DECLARE_CYCLE_STAT(TEXT("Execute Commands"), STAT_LLMExecuteCommands, STATGROUP_LLMConnector);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Executed Commands"), STAT_LLMExecutedCommands, STATGROUP_LLMConnector);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Deferred Commands"), STAT_LLMDeferredCommands, STATGROUP_LLMConnector);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Shared Requests"), STAT_LLMSharedRequests, STATGROUP_LLMConnector);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Queued Commands"), STAT_LLMQueuedCommands, STATGROUP_LLMConnector);
+
+namespace LLMConnectorSubsystem
+{
+  // Models send numbers and vectors as JSON values, AsString() would log a warning and lose them
+  FString JsonValueToParameterString(const TSharedPtr<FJsonValue>& Value)
+  {
+    FString Result;
+    if(Value.IsValid() && Value->TryGetString(Result))
+    {
+      return Result;
+    }
+
+    const TArray<TSharedPtr<FJsonValue>>* Elements = nullptr;
+    if(Value.IsValid() && Value->TryGetArray(Elements))
+    {
+      for(const TSharedPtr<FJsonValue>& Element : *Elements)
+      {
+        if(!Result.IsEmpty())
+        {
+          Result += TEXT(",");
+        }
+        Result += JsonValueToParameterString(Element);
+      }
+    }
+    return Result;
+  }
+
+  // "command", "target" and "parameters" of one command object
+  bool ParseCommandObject(const FJsonObject& Object, FLLMCommandCall& OutCall)
+  {
+    if(!Object.TryGetStringField(TEXT("command"), OutCall.Command))
+    {
+      return false;
+    }
+    Object.TryGetStringField(TEXT("target"), OutCall.Target);
+
+    const TArray<TSharedPtr<FJsonValue>>* ParamsArray;
+    if(Object.TryGetArrayField(TEXT("parameters"), ParamsArray))
+    {
+      for(const auto& Param : *ParamsArray)
+      {
+        OutCall.Parameters.Add(JsonValueToParameterString(Param));
+      }
+    }
+    return true;
+  }
+
+}
+
 
 
 //----------------------------------------------------------------------
@@ -25,137 +94,356 @@ ULLMConnectorSubsystem* ULLMConnectorSubsystem::GetLLMConnector(const UObject* W
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::SendLLMPrompt(const FString& Message, ELLMRole Role)
+ULLMConversation* ULLMConnectorSubsystem::CreateConversation(FName SaveId /*= NAME_None*/)
 {
-  // Get settings
-  if(m_Settings == nullptr || m_Settings->ApiKey.IsEmpty())
+  ULLMConversation* Conversation = NewObject<ULLMConversation>(this);
+  Conversation->Setup(this);
+  if(!SaveId.IsNone())
   {
-    UE_LOG(LLM, Error, TEXT("API Key not set in Project Settings"));
-    OnError.Broadcast(ELLMErrorType::InvalidAPIKey);
-    return;
+    Conversation->SetSaveId(SaveId);
   }
 
-  // Check if similar request is already in progress
-  if(m_ActiveRequests.Num() > 0)
+  m_Conversations.RemoveAll([](const TWeakObjectPtr<ULLMConversation>& Weak) { return !Weak.IsValid(); });
+  m_Conversations.Add(Conversation);
+  return Conversation;
+}
+
+//----------------------------------------------------------------------
+ULLMConversation* ULLMConnectorSubsystem::GetDefaultConversation() const
+{
+  return m_DefaultConversation;
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::GetNumActiveRequests() const
+{
+  return m_ActiveRequests.Num();
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::GetNumWaitingConversations() const
+{
+  return m_ScheduledConversations.Num();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::SaveConversations(TArray<uint8>& OutData) const
+{
+  TMap<FName, FLLMSavedConversation> States;
+  for(const TWeakObjectPtr<ULLMConversation>& Conversation : m_Conversations)
   {
-    UE_LOG(LLM, Warning, TEXT("Another request is already in progress, waiting..."));
-    return;
+    if(!Conversation.IsValid() || Conversation->GetSaveId().IsNone())
+    {
+      continue;
+    }
+    if(States.Contains(Conversation->GetSaveId()))
+    {
+      UE_LOG(LLM, Warning, TEXT("Several conversations have save id %s, only one is saved"), *Conversation->GetSaveId().ToString());
+    }
+    Conversation->SaveState(States.FindOrAdd(Conversation->GetSaveId()));
   }
 
-  // Create HTTP request
-  TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = FHttpModule::Get().CreateRequest();
+  // NPCs that did not spawn since the load keep their memories
+  if(m_LoadedConversations.IsValid())
+  {
+    TArray<FName> LoadedIds;
+    m_LoadedConversations->GetSaveIds(LoadedIds);
+    for(const FName SaveId : LoadedIds)
+    {
+      if(!States.Contains(SaveId))
+      {
+        m_LoadedConversations->Read(SaveId, States.Add(SaveId));
+      }
+    }
+  }
 
-  // Store request
-  m_ActiveRequests.Add(HttpRequest);
+  FLLMConversationArchive::Write(States, OutData);
+}
 
-  // Setup the request
-  HttpRequest->SetURL(m_Settings->ApiURL);
-  HttpRequest->SetVerb(TEXT("POST"));
-  HttpRequest->SetHeader(TEXT("Content-Type"), TEXT("application/json"));
-  HttpRequest->SetHeader(TEXT("Authorization"), FString::Printf(TEXT("Bearer %s"), *m_Settings->ApiKey));
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::LoadConversations(const TArray<uint8>& Data)
+{
+  return OnConversationsLoaded(FLLMConversationArchive::Open(TArray<uint8>(Data)));
+}
 
-  // Create JSON payload
-  TSharedPtr<FJsonObject> JsonObject = MakeShared<FJsonObject>();
-  JsonObject->SetStringField(TEXT("model"), m_Settings->ModelName);
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::SaveConversationsToFile(const FString& FileName) const
+{
+  TArray<uint8> Data;
+  SaveConversations(Data);
+  if(!FFileHelper::SaveArrayToFile(Data, *FileName))
+  {
+    UE_LOG(LLM, Error, TEXT("Can't write conversations to %s"), *FileName);
+    return false;
+  }
+  return true;
+}
 
-  // Create messages array
-  TArray<TSharedPtr<FJsonValue>> MessagesArray;
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::LoadConversationsFromFile(const FString& FileName)
+{
+  return OnConversationsLoaded(FLLMConversationArchive::OpenFile(FileName));
+}
 
-  // Add new user message
-  FLLMPromptBase UserMessage(Role, Message);
-  AddPromptHistory(UserMessage);
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::OnConversationsLoaded(const TSharedPtr<const FLLMConversationArchive>& Archive)
+{
+  if(!Archive.IsValid())
+  {
+    return false;
+  }
 
-  // Max history messages
-  if(m_PromptHistory.Num() > m_Settings->MaxHistoryMessages + m_ReservedMessages)// for context messages
+  m_LoadedConversations = Archive;
+  for(const TWeakObjectPtr<ULLMConversation>& Conversation : m_Conversations)
   {
-    int32 ToRemove = m_PromptHistory.Num() - m_Settings->MaxHistoryMessages - m_ReservedMessages;
-    m_PromptHistory.RemoveAt(m_ReservedMessages, ToRemove);
+    if(Conversation.IsValid())
+    {
+      AttachLoadedConversation(Conversation.Get());
+    }
   }
+  return true;
+}
 
-  // Add instructions to the response format at the end of the messages to avoid hallucinating llm
-  if(Role == ELLMRole::User)
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::AttachLoadedConversation(ULLMConversation* Conversation) const
+{
+  const FName SaveId = Conversation->GetSaveId();
+  if(m_LoadedConversations.IsValid() && !SaveId.IsNone() && m_LoadedConversations->Contains(SaveId))
   {
-    FLLMPromptBase FormatMessage(ELLMRole::System, GetInstructionsForResponseFormat().ToString());
-    RemovePromptHistory(FormatMessage);// Delete previous message to save context
-    AddPromptHistory(FormatMessage);
+    Conversation->SetPendingRestore(m_LoadedConversations);
   }
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::SendLLMPrompt(const FString& Message, ELLMRole Role)
+{
+  return m_DefaultConversation->SendLLMPrompt(Message, Role);
+}
+
+//----------------------------------------------------------------------
+TFuture<FLLMPromptResult> ULLMConnectorSubsystem::SendPromptAsync(const FString& Message, ELLMRole Role, const FLLMCancellationToken& Token /*= FLLMCancellationToken()*/)
+{
+  return m_DefaultConversation->SendPromptAsync(Message, Role, Token);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::SendLLMToolResult(const FString& ToolCallId, const FString& Result, bool bRequestResponse)
+{
+  m_DefaultConversation->SendLLMToolResult(ToolCallId, Result, bRequestResponse);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::QueueCommandResult(const FString& Result)
+{
+  m_DefaultConversation->QueueCommandResult(Result);
+}
 
-  // Add all messages from history
-  for(const FLLMPromptBase& HistoryMessage : m_PromptHistory)
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::BroadcastRequestsFailed(const TArray<int32>& RequestIds, ELLMErrorType ErrorType)
+{
+  for(const int32 RequestId : RequestIds)
   {
-    TSharedPtr<FJsonObject> MessageObject = MakeShared<FJsonObject>();
-    MessageObject->SetStringField(TEXT("role"), ConvertLLMRoleToString(HistoryMessage.Role));
-    MessageObject->SetStringField(TEXT("content"), HistoryMessage.Content);
-    MessagesArray.Add(MakeShared<FJsonValueObject>(MessageObject));
+    OnRequestFailedNative.Broadcast(RequestId, ErrorType);
+    CompletePromptWaiter(RequestId, ErrorType);
   }
+}
 
-  JsonObject->SetArrayField(TEXT("messages"), MessagesArray);
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::CompletePromptWaiter(int32 RequestId, ELLMErrorType ErrorType, const FLLMResponseBase& Response /*= FLLMResponseBase()*/)
+{
+  FLLMPromptWaiter Waiter;
+  if(!m_PromptWaiters.RemoveAndCopyValue(RequestId, Waiter))
+  {
+    return;
+  }
 
-  // Generation settings
-  if(m_Settings->GenerationSettings.bUseTemperature)
+  FLLMPromptResult Result;
+  Result.RequestId = RequestId;
+  Result.Error = Waiter.Token.IsCancelled() ? ELLMErrorType::Cancelled : ErrorType;
+  if(Result.Error == ELLMErrorType::None)
   {
-    JsonObject->SetNumberField(TEXT("temperature"), m_Settings->GenerationSettings.Temperature);
+    Result.Response = Response;
   }
-  if(m_Settings->GenerationSettings.bUseFrequencyPenalty)
+  Waiter.Promise->SetValue(MoveTemp(Result));
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::IsPromptCancelled(int32 RequestId) const
+{
+  const FLLMPromptWaiter* Waiter = m_PromptWaiters.Find(RequestId);
+  return Waiter != nullptr && Waiter->Token.IsCancelled();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ScheduleRequest(ULLMConversation* Conversation)
+{
+  m_ScheduledConversations.Add(Conversation);
+  StartScheduledRequests();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::StartScheduledRequests()
+{
+  // Conversations get the slots in the order they asked, so a chatty one cannot starve the rest
+  const int32 MaxRequests = m_Settings != nullptr ? m_Settings->MaxConcurrentRequests : 0;
+  while(!m_ScheduledConversations.IsEmpty() && (MaxRequests <= 0 || m_ActiveRequests.Num() < MaxRequests))
   {
-    JsonObject->SetNumberField(TEXT("frequency_penalty"), m_Settings->GenerationSettings.FrequencyPenalty);
+    ULLMConversation* Conversation = m_ScheduledConversations[0].Get();
+    if(Conversation == nullptr || !Conversation->m_bWaitingForRequestSlot)
+    {
+      m_ScheduledConversations.RemoveAt(0);
+      continue;
+    }
+
+    // The first in line waits for the provider limits, the rest keep their places behind it
+    if(WaitForRateLimit(Conversation->EstimateRequestTokens()))
+    {
+      return;
+    }
+
+    m_ScheduledConversations.RemoveAt(0);
+    Conversation->StartRequest();
   }
-  if(m_Settings->GenerationSettings.bUsePresencePenalty)
+
+  // Warm-ups only use what the prompts leave, a conversation with its own request warms the prefix anyway
+  while(m_ScheduledConversations.IsEmpty() && !m_ScheduledWarmUps.IsEmpty() && (MaxRequests <= 0 || m_ActiveRequests.Num() < MaxRequests))
   {
-    JsonObject->SetNumberField(TEXT("presence_penalty"), m_Settings->GenerationSettings.PresencePenalty);
+    ULLMConversation* Conversation = m_ScheduledWarmUps[0].Get();
+    if(Conversation == nullptr || Conversation->m_ActiveRequest.IsValid() || Conversation->m_bWaitingForRequestSlot)
+    {
+      m_ScheduledWarmUps.RemoveAt(0);
+      continue;
+    }
+
+    if(WaitForRateLimit(Conversation->EstimateWarmUpTokens()))
+    {
+      return;
+    }
+
+    m_ScheduledWarmUps.RemoveAt(0);
+    Conversation->DispatchWarmUp();
   }
-  if(m_Settings->GenerationSettings.bUseRepetitionPenalty)
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ScheduleWarmUp(ULLMConversation* Conversation)
+{
+  m_ScheduledWarmUps.AddUnique(Conversation);
+  StartScheduledRequests();
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::WaitForRateLimit(int32 Tokens)
+{
+  const double WaitSeconds = IsRateLimited() ? m_RateLimiter.GetWaitSeconds(Tokens, FPlatformTime::Seconds()) : 0.0;
+  if(WaitSeconds <= 0.0)
   {
-    JsonObject->SetNumberField(TEXT("repetition_penalty"), m_Settings->GenerationSettings.RepetitionPenalty);
+    return false;
   }
-  if(m_Settings->GenerationSettings.bUseMinP)
+
+  if(!m_RateLimitTickerHandle.IsValid())
   {
-    JsonObject->SetNumberField(TEXT("min_p"), m_Settings->GenerationSettings.MinP);
+    m_RateLimitTickerHandle = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateWeakLambda(this, [this](float)
+    {
+      m_RateLimitTickerHandle.Reset();
+      StartScheduledRequests();
+      return false;
+    }), static_cast<float>(WaitSeconds));
   }
-  if(m_Settings->GenerationSettings.bUseTopA)
+  return true;
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::SendWarmUpRequest(FHttpRequestPtr Request, const FString& Payload, int32 Tokens)
+{
+  // Expired prefixes are cold again, and their entries would only grow the map
+  const double Now = FPlatformTime::Seconds();
+  for(auto It = m_WarmUpTimes.CreateIterator(); It; ++It)
   {
-    JsonObject->SetNumberField(TEXT("top_a"), m_Settings->GenerationSettings.TopA);
+    if(Now - It->Value >= m_Settings->WarmUpCacheSeconds)
+    {
+      It.RemoveCurrent();
+    }
   }
-  if(m_Settings->GenerationSettings.bUseTopK)
+
+  // Conversations with the same reserved messages share the cached prefix
+  const auto Utf8Payload = StringCast<UTF8CHAR>(*Payload, Payload.Len());
+  const uint64 Hash = CityHash64(reinterpret_cast<const char*>(Utf8Payload.Get()), Utf8Payload.Length());
+  if(m_WarmUpTimes.Contains(Hash))
   {
-    JsonObject->SetNumberField(TEXT("top_k"), m_Settings->GenerationSettings.TopK);
+    return;
   }
-  if(m_Settings->GenerationSettings.bUseTopP)
+  m_WarmUpTimes.Add(Hash, Now);
+
+  // Holds a slot like a prompt, no conversation handles its response
+  m_ActiveRequests.Add(Request, nullptr);
+  m_WarmUpRequests.Add(Request);
+  ChargeRateLimit(Tokens);
+
+  if(IsReplayingTraffic())
   {
-    JsonObject->SetNumberField(TEXT("top_p"), m_Settings->GenerationSettings.TopP);
+    ReplayRequest(Request, Payload);
   }
-  if(m_Settings->GenerationSettings.bUseMaxTokens)
+  else
   {
-    JsonObject->SetNumberField(TEXT("max_tokens"), m_Settings->GenerationSettings.MaxTokens);
+    Request->ProcessRequest();
   }
+}
 
-  // Add response_format as object
-  TSharedPtr<FJsonObject> ResponseFormatObject = MakeShared<FJsonObject>();
-  ResponseFormatObject->SetStringField(TEXT("type"), TEXT("json_object"));
-  JsonObject->SetObjectField(TEXT("response_format"), ResponseFormatObject);
+//----------------------------------------------------------------------
+FHttpRequestPtr ULLMConnectorSubsystem::ShareInFlightRequest(ULLMConversation* Conversation, const FHttpRequestPtr& Request, const FString& Payload)
+{
+  if(!m_Settings->bShareIdenticalRequests)
+  {
+    return nullptr;
+  }
 
-  // stop response as user
-  TArray<TSharedPtr<FJsonValue>> StopArray;
-  StopArray.Add(MakeShared<FJsonValueString>(TEXT("USER")));
-  JsonObject->SetArrayField(TEXT("stop"), StopArray);
+  const auto Utf8Payload = StringCast<UTF8CHAR>(*Payload, Payload.Len());
+  const uint64 Hash = CityHash64(reinterpret_cast<const char*>(Utf8Payload.Get()), Utf8Payload.Length());
+  FLLMInFlightPayload* InFlight = m_InFlightPayloads.Find(Hash);
+  if(InFlight == nullptr)
+  {
+    // Followers of an earlier attempt wait for this one
+    m_InFlightPayloads.Add(Hash, FLLMInFlightPayload{ Request, MoveTemp(Conversation->m_SharedFollowers) });
+    Conversation->m_SharedFollowers.Reset();
+    return nullptr;
+  }
 
-  // Convert JSON to string
-  FString JsonString;
-  TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&JsonString);
-  FJsonSerializer::Serialize(JsonObject.ToSharedRef(), Writer);
+  // The hash only finds the candidate
+  const TArray<uint8>& SharedContent = InFlight->Request->GetContent();
+  if(SharedContent.Num() != Utf8Payload.Length() || FMemory::Memcmp(SharedContent.GetData(), Utf8Payload.Get(), SharedContent.Num()) != 0)
+  {
+    return nullptr;
+  }
 
-  // Set request content
-  HttpRequest->SetContentAsString(JsonString);
+  // The new request is never sent, its slot is free again
+  m_ActiveRequests.Remove(Request);
+  InFlight->Followers.Add(Conversation);
+  InFlight->Followers.Append(MoveTemp(Conversation->m_SharedFollowers));
+  Conversation->m_SharedFollowers.Reset();
+  INC_DWORD_STAT(STAT_LLMSharedRequests);
+  return InFlight->Request;
+}
 
-  // Bind callback
-  HttpRequest->OnProcessRequestComplete().BindUObject(this, &ULLMConnectorSubsystem::OnHttpResponse);
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::IsRateLimited() const
+{
+  return !IsReplayingTraffic() && !IsUsingEmbeddedBackend();
+}
 
-  // Send request
-  HttpRequest->ProcessRequest();
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ChargeRateLimit(int32 Tokens)
+{
+  if(IsRateLimited())
+  {
+    m_RateLimiter.OnRequestSent(Tokens, FPlatformTime::Seconds());
+  }
+}
 
-  FString LogJsonString = JsonString;
-  LogJsonString.ReplaceInline(TEXT("\\n"), TEXT("\n"));
-  UE_LOG(LLM, Log, TEXT("Sending request: %s"), *LogJsonString);
+//----------------------------------------------------------------------
+FLLMRateLimitHeadroom ULLMConnectorSubsystem::GetRateLimitHeadroom() const
+{
+  return IsRateLimited() ? m_RateLimiter.GetHeadroom(FPlatformTime::Seconds()) : FLLMRateLimitHeadroom();
 }
 
 //----------------------------------------------------------------------
@@ -169,6 +457,8 @@ FString ULLMConnectorSubsystem::ConvertLLMRoleToString(ELLMRole Role)
     return TEXT("user");
   case ELLMRole::Assistant:
     return TEXT("assistant");
+  case ELLMRole::Tool:
+    return TEXT("tool");
   }
   return TEXT("user");
 }
@@ -185,164 +475,499 @@ FLLMResponseBase ULLMConnectorSubsystem::ProcessLLMResponse(const FString& Respo
   {
     ResponseParams.Message = Response;
   }
+  else
+  {
+    // Anything past the limit was not asked for, tool calls left without a command get an error answer
+    const int32 MaxCommands = FMath::Max(1, m_Settings->MaxCommandsPerResponse);
+    if(ResponseParams.Commands.Num() > MaxCommands)
+    {
+      UE_LOG(LLM, Warning, TEXT("Response has %d commands, only the first %d are used"), ResponseParams.Commands.Num(), MaxCommands);
+      ResponseParams.Commands.SetNum(MaxCommands);
+    }
+
+    ParseTypedParameters(ResponseParams);
+    ResponseParams.UpdatePrimaryCommand();
+  }
 
   // Successfully parsed command
   return ResponseParams;
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::TryProcessCommand(const FLLMResponseBase& ResponseParams)
+void ULLMConnectorSubsystem::QueueCommandBatch(ULLMConversation* Conversation, const FLLMResponseBase& ResponseParams)
 {
-  // Try to send system prompt
-  if(ULLMCommandHandlerBase* Command = FindCommandHandler(ResponseParams))
+  // Commands of a response keep their order, a higher priority response goes before queued ones
+  FLLMCommandBatch Batch;
+  Batch.Response = ResponseParams;
+  Batch.Sequence = m_NextCommandBatchSequence++;
+  Batch.Conversation = Conversation;
+  for(int32 Index = 0; Index < ResponseParams.Commands.Num(); ++Index)
   {
-    const FString& StringForLLM = Command->ExecuteCommand(ResponseParams);
-    if(!StringForLLM.IsEmpty())
+    if(ULLMCommandHandlerBase* Command = FindCommandHandler(ResponseParams.GetCommandResponse(Index)))
     {
-      SendLLMPrompt(StringForLLM, ELLMRole::System);
+      Batch.Priority = FMath::Max(Batch.Priority, Command->GetParams().Priority);
     }
   }
+
+  const int32 InsertIndex = m_CommandQueue.IndexOfByPredicate([&Batch](const FLLMCommandBatch& Queued) { return Queued.Priority < Batch.Priority; });
+  m_CommandQueue.Insert(MoveTemp(Batch), InsertIndex != INDEX_NONE ? InsertIndex : m_CommandQueue.Num());
+
+  ExecuteQueuedCommands();
 }
 
 //----------------------------------------------------------------------
-bool ULLMConnectorSubsystem::CanSendLLMPrompt() const
+bool ULLMConnectorSubsystem::HasQueuedToolCalls(const ULLMConversation* Conversation) const
 {
-  return m_ActiveRequests.Num() == 0;
+  return m_CommandQueue.ContainsByPredicate([Conversation](const FLLMCommandBatch& Batch)
+  {
+    return Batch.Conversation.Get() == Conversation && !Batch.Response.ToolCalls.IsEmpty();
+  });
 }
 
 //----------------------------------------------------------------------
-FLLMPromptNode ULLMConnectorSubsystem::GetInstructionsForResponseFormat() const
+void ULLMConnectorSubsystem::TryProcessCommand(const FLLMResponseBase& ResponseParams)
 {
-  FLLMPromptNode PromptNode;
-  
-  TArray<FString> CommandNames;
-  TArray<FString> Targets;
-  for(const FLLMCommandStruct& Command : GetParamsRegisterCommands())
+  m_DefaultConversation->TryProcessCommand(ResponseParams);
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::GetNumQueuedCommands() const
+{
+  int32 NumCommands = 0;
+  for(const FLLMCommandBatch& Batch : m_CommandQueue)
   {
-    CommandNames.AddUnique(Command.Name);
-    Targets.AddUnique(Command.Target);
+    NumCommands += Batch.Response.Commands.Num() - Batch.NextCommand;
   }
+  return NumCommands;
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ExecuteQueuedCommands()
+{
+  SCOPE_CYCLE_COUNTER(STAT_LLMExecuteCommands);
 
-  if(!m_OverrideInstructionsForResponseFormatTitle.IsEmpty())
+  // The budget is shared by every call within a frame
+  if(m_CommandBudgetFrame != GFrameCounter)
   {
-    PromptNode.ContentText = m_OverrideInstructionsForResponseFormatTitle;
+    m_CommandBudgetFrame = GFrameCounter;
+    m_CommandBudgetUsedSeconds = 0.0;
   }
-  else
+
+  const double BudgetSeconds = m_Settings != nullptr ? m_Settings->CommandExecutionBudgetMs / 1000.0 : 0.0;
+  bool bExecutedCommand = false;
+  while(!m_CommandQueue.IsEmpty())
   {
-    PromptNode.ContentText = m_Settings->ResponseFormatInstructionsText;
+    // At least one command per call, so a single heavy handler cannot stall the queue
+    if(BudgetSeconds > 0.0 && bExecutedCommand && m_CommandBudgetUsedSeconds >= BudgetSeconds)
+    {
+      break;
+    }
+
+    if(m_CommandQueue[0].NextCommand >= m_CommandQueue[0].Response.Commands.Num())
+    {
+      FLLMCommandBatch Batch = MoveTemp(m_CommandQueue[0]);
+      m_CommandQueue.RemoveAt(0);
+      FinishCommandBatch(Batch);
+      continue;
+    }
+
+    const double StartTime = FPlatformTime::Seconds();
+
+    // The handler may queue more commands, don't keep references into the queue
+    const int32 Index = m_CommandQueue[0].NextCommand++;
+    const FLLMResponseBase CommandParams = m_CommandQueue[0].Response.GetCommandResponse(Index);
+    const FString ToolCallId = m_CommandQueue[0].Response.Commands[Index].ToolCallId;
+    const uint64 Sequence = m_CommandQueue[0].Sequence;
+    const TWeakObjectPtr<ULLMConversation> Conversation = m_CommandQueue[0].Conversation;
+
+    ULLMCommandHandlerBase* Command = FindCommandHandler(CommandParams);
+    const FString StringForLLM = Command != nullptr ? Command->ExecuteCommand(CommandParams) : FString();
+    if(Command == nullptr)
+    {
+      UE_LOG(LLM, Warning, TEXT("No handler for command %s with target %s"), *CommandParams.Command, *CommandParams.Target);
+    }
+    INC_DWORD_STAT(STAT_LLMExecutedCommands);
+
+    FLLMCommandBatch* Batch = m_CommandQueue.FindByPredicate([Sequence](const FLLMCommandBatch& Queued) { return Queued.Sequence == Sequence; });
+    if(Batch != nullptr && !ToolCallId.IsEmpty())
+    {
+      const FString ToolResult = Command == nullptr ? TEXT("Error: no handler for this command") : StringForLLM.IsEmpty() ? TEXT("Done") : StringForLLM;
+      Batch->ToolResults.Emplace(ToolCallId, ToolResult);
+      Batch->bHasToolResultForLLM |= !StringForLLM.IsEmpty();
+    }
+    else if(!StringForLLM.IsEmpty() && Conversation.IsValid())
+    {
+      // Results wait for the window, so other handlers can add theirs to the same follow-up request
+      Conversation->QueueCommandResult(StringForLLM);
+    }
+
+    bExecutedCommand = true;
+    m_CommandBudgetUsedSeconds += FPlatformTime::Seconds() - StartTime;
   }
 
-  FLLMPromptNode JsonNode;
-  JsonNode.AddChild("{");
-  JsonNode.AddChild(" \"command\"", TEXT("\"") + FString::Join(CommandNames, TEXT("|")) + TEXT("\","));
-  JsonNode.AddChild(" \"target\"", TEXT("\"") + FString::Join(Targets, TEXT("|")) + TEXT("\","));
-  JsonNode.AddChild(" \"parameters\"", m_Settings->ParametersInstructionsText);
-  JsonNode.AddChild(" \"message\"", m_Settings->MessageInstructionsText);
-  
-#if !UE_BUILD_SHIPPING
-  JsonNode.AddChild(" \"reasoning\"", m_Settings->ReasoningInstructionsText);
-#endif
-  
-  JsonNode.AddChild("}");
-  
-  PromptNode.AddChild("Use this JSON object to give your answer", JsonNode);
+  const int32 NumQueuedCommands = GetNumQueuedCommands();
+  SET_DWORD_STAT(STAT_LLMQueuedCommands, NumQueuedCommands);
+  if(m_CommandQueue.IsEmpty() || m_CommandQueueTickerHandle.IsValid())
+  {
+    return;
+  }
 
-  return PromptNode;
+  // Continue on the next frames
+  INC_DWORD_STAT_BY(STAT_LLMDeferredCommands, NumQueuedCommands);
+  m_CommandQueueTickerHandle = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateWeakLambda(this, [this](float)
+  {
+    ExecuteQueuedCommands();
+    if(m_CommandQueue.IsEmpty())
+    {
+      m_CommandQueueTickerHandle.Reset();
+      return false;
+    }
+    INC_DWORD_STAT_BY(STAT_LLMDeferredCommands, GetNumQueuedCommands());
+    return true;
+  }));
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::SetOverrideInstructionsForResponseFormatTitle(const FString& Title)
+void ULLMConnectorSubsystem::FinishCommandBatch(FLLMCommandBatch& Batch)
 {
-  m_OverrideInstructionsForResponseFormatTitle = Title;
+  // Nobody to answer, the conversation is gone
+  ULLMConversation* Conversation = Batch.Conversation.Get();
+  if(Conversation == nullptr)
+  {
+    return;
+  }
+
+  // Tool calls are always answered, the provider rejects unanswered calls on the next request
+  for(const FLLMToolCall& ToolCall : Batch.Response.ToolCalls)
+  {
+    if(!Batch.ToolResults.ContainsByPredicate([&ToolCall](const TPair<FString, FString>& Result) { return Result.Key == ToolCall.Id; }))
+    {
+      Batch.ToolResults.Emplace(ToolCall.Id, TEXT("Error: this command was not executed"));
+    }
+  }
+
+  for(const TPair<FString, FString>& ToolResult : Batch.ToolResults)
+  {
+    Conversation->SendLLMToolResult(ToolResult.Key, ToolResult.Value, false);
+  }
+
+  if(Batch.bHasToolResultForLLM)
+  {
+    Conversation->m_bFollowUpRequested = true;
+    Conversation->ScheduleCommandResultsFlush();
+  }
+  else if(!Batch.ToolResults.IsEmpty())
+  {
+    // Prompts queued while the tool calls were unanswered
+    Conversation->SendQueuedPrompts();
+  }
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::AddPromptHistory(const FLLMPromptBase& Prompt)
+bool ULLMConnectorSubsystem::CanSendLLMPrompt() const
 {
-  m_PromptHistory.Add(Prompt);
+  return m_DefaultConversation->CanSendLLMPrompt();
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::RemovePromptHistory(const FLLMPromptBase& Prompt)
+ELLMResponseFormatMode ULLMConnectorSubsystem::GetActiveResponseFormatMode() const
 {
-  m_PromptHistory.Remove(Prompt);
+  // The embedded model is held to JSON by a grammar, the structure is described in the prompt
+  if(m_Settings == nullptr || m_bResponseFormatRejected || m_Settings->BackendProfile == ELLMBackendProfile::Embedded)
+  {
+    return ELLMResponseFormatMode::JsonObject;
+  }
+  return m_Settings->ResponseFormatMode;
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::ClearPromptHistory()
+void ULLMConnectorSubsystem::OnResponseFormatRejected()
 {
-  m_PromptHistory.Empty();
+  m_bResponseFormatRejected = true;
+
+  // Conversations that already sent instructions need the JSON format described
+  for(const TWeakObjectPtr<ULLMConversation>& Conversation : m_Conversations)
+  {
+    if(Conversation.IsValid() && !Conversation->m_FormatInstructionsContent.IsEmpty())
+    {
+      Conversation->UpdateFormatInstructionsMessage(false);
+    }
+  }
 }
 
 //----------------------------------------------------------------------
-const TArray<FLLMPromptBase>& ULLMConnectorSubsystem::GetPromptHistory() const
+void ULLMConnectorSubsystem::SetRelevantContext(TSharedPtr<const FLLMContextRegistry> Registry, int32 TopK /*= 8 */, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */)
 {
-  return m_PromptHistory;
+  m_DefaultConversation->SetRelevantContext(Registry, TopK, Format);
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::SetCountReservedMessages(int32 ReservedNum)
+void ULLMConnectorSubsystem::SetOverrideInstructionsForResponseFormatTitle(const FString& Title)
 {
-  m_ReservedMessages = ReservedNum;
+  m_DefaultConversation->SetOverrideInstructionsForResponseFormatTitle(Title);
 }
 
 //----------------------------------------------------------------------
-int32 ULLMConnectorSubsystem::GetCountReservedMessages() const
+void ULLMConnectorSubsystem::AddPromptHistory(const FLLMPromptBase& Prompt)
 {
-  return m_ReservedMessages;
+  m_DefaultConversation->AddPromptHistory(Prompt);
 }
 
 //----------------------------------------------------------------------
-void ULLMConnectorSubsystem::RegisterCommandHandler(ULLMCommandHandlerBase* Handler)
+void ULLMConnectorSubsystem::RemovePromptHistory(const FLLMPromptBase& Prompt)
 {
-  if(Handler != nullptr)
-  {
-    // Check if this handler is already registered
-    if(!m_CommandHandlers.Contains(Handler))
-    {
-      m_CommandHandlers.Add(Handler);
-      UE_LOG(LLM, Log, TEXT("Command handler registered: %s"), *Handler->GetClass()->GetName());
-    }
-  }
+  m_DefaultConversation->RemovePromptHistory(Prompt);
 }
 
 //----------------------------------------------------------------------
-TArray<FLLMCommandStruct> ULLMConnectorSubsystem::GetParamsRegisterCommands() const
+void ULLMConnectorSubsystem::ClearPromptHistory()
+{
+  m_DefaultConversation->ClearPromptHistory();
+}
+
+//----------------------------------------------------------------------
+TArray<FLLMPromptBase> ULLMConnectorSubsystem::GetPromptHistory() const
+{
+  return m_DefaultConversation->GetPromptHistory();
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::GetNumPromptHistory() const
+{
+  return m_DefaultConversation->GetNumPromptHistory();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::SetCountReservedMessages(int32 ReservedNum)
+{
+  m_DefaultConversation->SetCountReservedMessages(ReservedNum);
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::GetCountReservedMessages() const
+{
+  return m_DefaultConversation->GetCountReservedMessages();
+}
+
+//----------------------------------------------------------------------
+FLLMCommandHandlerHandle ULLMConnectorSubsystem::RegisterCommandHandler(ULLMCommandHandlerBase* Handler)
+{
+  FLLMCommandHandlerHandle Handle;
+  if(Handler == nullptr)
+  {
+    return Handle;
+  }
+
+  // Check if this handler is already registered
+  if(const int32* ExistingIndex = m_CommandHandlerIndices.Find(Handler))
+  {
+    Handle.Index = *ExistingIndex;
+    Handle.Serial = m_CommandHandlers[*ExistingIndex].Serial;
+    return Handle;
+  }
+
+  FLLMRegisteredCommandHandler Entry;
+  Entry.Handler = Handler;
+  Entry.Serial = m_NextCommandHandlerSerial++;
+  if(AActor* Actor = Handler->GetCommandActor())
+  {
+    Entry.Actor = Actor;
+    Entry.bSpatial = true;
+  }
+
+  Handle.Index = m_CommandHandlers.Add(Entry);
+  Handle.Serial = Entry.Serial;
+  m_CommandHandlerIndices.Add(Handler, Handle.Index);
+  m_CommandHandlerOrder.Add(Handle.Index);
+  OnCommandHandlersChanged();
+  UE_LOG(LLM, Log, TEXT("Command handler registered: %s"), *Handler->GetClass()->GetName());
+  return Handle;
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::UnregisterCommandHandler(FLLMCommandHandlerHandle Handle)
+{
+  if(!Handle.IsValid() || !m_CommandHandlers.IsValidIndex(Handle.Index) || m_CommandHandlers[Handle.Index].Serial != Handle.Serial)
+  {
+    return false;
+  }
+
+  const ULLMCommandHandlerBase* Handler = m_CommandHandlers[Handle.Index].Handler;
+  m_CommandHandlerIndices.Remove(Handler);
+  m_CommandHandlers.RemoveAt(Handle.Index);
+  m_CommandHandlerOrder.Remove(Handle.Index);
+  OnCommandHandlersChanged();
+  UE_LOG(LLM, Log, TEXT("Command handler unregistered: %s"), Handler != nullptr ? *Handler->GetClass()->GetName() : TEXT("None"));
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::UnregisterCommandHandlerObject(ULLMCommandHandlerBase* Handler)
+{
+  const int32* Index = m_CommandHandlerIndices.Find(Handler);
+  if(Index == nullptr)
+  {
+    return false;
+  }
+
+  FLLMCommandHandlerHandle Handle;
+  Handle.Index = *Index;
+  Handle.Serial = m_CommandHandlers[*Index].Serial;
+  return UnregisterCommandHandler(Handle);
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::GetNumCommandHandlers() const
+{
+  return m_CommandHandlers.Num();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::OnCommandHandlersChanged()
+{
+  m_bCommandSpatialIndexDirty = true;
+  for(const TWeakObjectPtr<ULLMConversation>& Conversation : m_Conversations)
+  {
+    if(Conversation.IsValid())
+    {
+      Conversation->ResetCommandFormats();
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::RemoveDestroyedCommandHandlers()
+{
+  // The collector cleared the references, the keys still hold the old addresses until now
+  for(auto It = m_CommandHandlerIndices.CreateIterator(); It; ++It)
+  {
+    if(m_CommandHandlers[It->Value].Handler == nullptr)
+    {
+      It.RemoveCurrent();
+    }
+  }
+
+  int32 NumRemoved = 0;
+  for(auto It = m_CommandHandlers.CreateIterator(); It; ++It)
+  {
+    if(It->Handler == nullptr)
+    {
+      It.RemoveCurrent();
+      ++NumRemoved;
+    }
+  }
+
+  if(NumRemoved > 0)
+  {
+    m_CommandHandlerOrder.RemoveAll([this](int32 Slot) { return !m_CommandHandlers.IsValidIndex(Slot); });
+    OnCommandHandlersChanged();
+    UE_LOG(LLM, Log, TEXT("Removed %d destroyed command handlers"), NumRemoved);
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::SetCommandScope(const FLLMCommandScope& Scope)
+{
+  m_DefaultConversation->SetCommandScope(Scope);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ClearCommandScope()
+{
+  m_DefaultConversation->ClearCommandScope();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::UpdateCommandScope()
+{
+  m_DefaultConversation->UpdateCommandScope();
+}
+
+//----------------------------------------------------------------------
+TArray<FLLMCommandStruct> ULLMConnectorSubsystem::GetAdvertisedCommands() const
+{
+  return m_DefaultConversation->GetAdvertisedCommands();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::RefreshCommandSpatialIndex()
+{
+  const double Now = FPlatformTime::Seconds();
+  if(!m_bCommandSpatialIndexDirty && Now - m_CommandSpatialIndexTime < m_Settings->CommandIndexRefreshSeconds)
+  {
+    return;
+  }
+
+  m_CommandSpatialIndex.Reset(m_Settings->CommandIndexCellSize);
+  for(auto It = m_CommandHandlers.CreateConstIterator(); It; ++It)
+  {
+    if(const AActor* Actor = It->Actor.Get())
+    {
+      m_CommandSpatialIndex.Add(It.GetIndex(), Actor->GetActorLocation());
+    }
+  }
+  m_CommandSpatialIndexTime = Now;
+  m_bCommandSpatialIndexDirty = false;
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::AddReferencedObjects(UObject* InThis, FReferenceCollector& Collector)
+{
+  ULLMConnectorSubsystem* This = CastChecked<ULLMConnectorSubsystem>(InThis);
+  for(FLLMRegisteredCommandHandler& Entry : This->m_CommandHandlers)
+  {
+    Collector.AddReferencedObject(Entry.Handler, This);
+  }
+  Super::AddReferencedObjects(InThis, Collector);
+}
+
+//----------------------------------------------------------------------
+TArray<FLLMCommandStruct> ULLMConnectorSubsystem::GetParamsRegisterCommands() const
 {
   TArray<FLLMCommandStruct> ArrParams;
-  for(ULLMCommandHandlerBase* CommandIt : m_CommandHandlers)
+  ArrParams.Reserve(m_CommandHandlerOrder.Num());
+  for(const int32 Slot : m_CommandHandlerOrder)
   {
-    if(CommandIt != nullptr)
+    if(ULLMCommandHandlerBase* Handler = m_CommandHandlers[Slot].Handler)
     {
-      ArrParams.Add(CommandIt->GetParams());
+      ArrParams.Add(Handler->GetParams());
     }
   }
   return ArrParams;
 }
 
 //----------------------------------------------------------------------
-FString ULLMConnectorSubsystem::GetContextCommands(const FString& InfoText /*= "Available Commands" */) const
+FString ULLMConnectorSubsystem::GetContextCommands(const FString& InfoText /*= "Available Commands" */, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */) const
+{
+  return m_DefaultConversation->GetContextCommands(InfoText, Format);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ParseTypedParameters(FLLMResponseBase& ResponseParams)
 {
-  FLLMPromptNode PromptNode;
-  PromptNode.ContentText = InfoText;
-  for(const FLLMCommandStruct& Command : GetParamsRegisterCommands())
+  for(FLLMCommandCall& Call : ResponseParams.Commands)
   {
-    FLLMPromptNode CommandNode;
-    CommandNode.AddChild("Target", Command.Target);
-    CommandNode.AddChild("Description", Command.Description);
-    if(!Command.Examples.IsEmpty())
+    for(const int32 Slot : m_CommandHandlerOrder)
     {
-      FLLMPromptNode ExampleContext;
-      for(auto& It : Command.Examples)
+      ULLMCommandHandlerBase* Handler = m_CommandHandlers[Slot].Handler;
+      if(Handler == nullptr)
       {
-        ExampleContext.AddChild(It);
+        continue;
+      }
+
+      const FLLMCommandStruct& Command = Handler->GetParams();
+      if(!Command.ParameterSchema.IsEmpty()
+        && Command.Name.Equals(Call.Command, ESearchCase::IgnoreCase)
+        && Command.Target.Equals(Call.Target, ESearchCase::IgnoreCase))
+      {
+        if(!FLLMParameterParser::ParseParameters(Command.ParameterSchema, Call.Parameters, Call.TypedParameters))
+        {
+          UE_LOG(LLM, Warning, TEXT("Invalid parameters for command %s: %s"), *Call.Command, *FString::Join(Call.Parameters, TEXT(", ")));
+        }
+        break;
       }
-      CommandNode.AddChild("Examples", ExampleContext);
     }
-    
-    PromptNode.AddChild(Command.Name, CommandNode);
   }
-  return PromptNode.ToString();
 }
 
 //----------------------------------------------------------------------
@@ -375,6 +1000,11 @@ ELLMErrorType ULLMConnectorSubsystem::TryParseParamsFromResponse(const FString&
   
   // Get message content
   const TSharedPtr<FJsonObject>& FirstChoice = (*Choices)[0]->AsObject();
+  if(!FirstChoice.IsValid())
+  {
+    UE_LOG(LLM, Warning, TEXT("Invalid choice in response"));
+    return ELLMErrorType::MissingFields;
+  }
 
   FString FinishReason;
   if(FirstChoice->TryGetStringField(TEXT("finish_reason"), FinishReason)
@@ -391,6 +1021,14 @@ ELLMErrorType ULLMConnectorSubsystem::TryParseParamsFromResponse(const FString&
     return ELLMErrorType::MissingFields;
   }
   
+  // Native tool calls come with empty or null content
+  const TArray<TSharedPtr<FJsonValue>>* ToolCalls = nullptr;
+  if((*Message)->TryGetArrayField(TEXT("tool_calls"), ToolCalls) && ToolCalls->Num() > 0)
+  {
+    (*Message)->TryGetStringField(TEXT("content"), OutParams.Message);
+    return TryParseParamsFromToolCalls(*ToolCalls, OutParams);
+  }
+
   FString Content;
   if (!(*Message)->TryGetStringField(TEXT("content"), Content))
   {
@@ -398,71 +1036,52 @@ ELLMErrorType ULLMConnectorSubsystem::TryParseParamsFromResponse(const FString&
     return ELLMErrorType::MissingFields;
   }
   
-  Content = Content.TrimStartAndEnd();
-
-  // Check if content is wrapped in code blocks and extract JSON
-  const FString JsonCodeBlockStart = TEXT("```json");
-  const FString CodeBlockEnd = TEXT("```");
-  if(Content.StartsWith(JsonCodeBlockStart))
+  // Fences, prose around the object and the usual syntax slips are handled in the same pass
+  FString ParseError;
+  TSharedPtr<FJsonObject> CommandJson = FLLMLenientJson::ParseObject(Content, &ParseError);
+  if(!CommandJson.IsValid())
   {
-    int32 StartPos = JsonCodeBlockStart.Len();
-    int32 EndPos = Content.Find(CodeBlockEnd, ESearchCase::IgnoreCase, ESearchDir::FromStart, StartPos);
+    UE_LOG(LLM, Warning, TEXT("Failed to parse command JSON (%s): %s"), *ParseError, *Content);
+    return ELLMErrorType::JsonParseError;
+  }
 
-    if(EndPos != INDEX_NONE)
-    {
-      // Extract only the JSON part between markers
-      Content = Content.Mid(StartPos, EndPos - StartPos).TrimStartAndEnd();
-    }
+  FString MessageStr;
+  if(!CommandJson->TryGetStringField(TEXT("message"), MessageStr))
+  {
+    UE_LOG(LLM, Warning, TEXT("Failed to get required fields from JSON"));
+    return ELLMErrorType::MissingFields;
   }
-  
-  // Fix common JSON issues
-  Content.ReplaceInline(TEXT(",\n}"), TEXT("\n}"));  // Remove trailing comma before closing brace
-  Content.ReplaceInline(TEXT(",\r\n}"), TEXT("\r\n}"));
+  OutParams.Message = MessageStr;
 
-  // Parse the cleaned content as JSON
-  TSharedPtr<FJsonObject> CommandJson;
-  TSharedRef<TJsonReader<TCHAR>> CommandReader = TJsonReaderFactory<TCHAR>::Create(Content);
-  
-  if(!FJsonSerializer::Deserialize(CommandReader, CommandJson) || !CommandJson.IsValid())
-  {
-    UE_LOG(LLM, Warning, TEXT("Failed to parse command JSON, trying to fix content: %s"), *Content);
-    
-    // Try to fix by joining lines and removing special characters
-    FString FixedContent = Content;
-    TArray<FString> ContentLines;
-    Content.ParseIntoArrayLines(ContentLines, false);
-    if(ContentLines.Num() > 1)
-    {
-      FixedContent = FString::Join(ContentLines, TEXT(" "));
-      CommandReader = TJsonReaderFactory<TCHAR>::Create(FixedContent);
-      
-      if(!FJsonSerializer::Deserialize(CommandReader, CommandJson) || !CommandJson.IsValid())
+  // Several commands come as an ordered "commands" array, a single one as top level fields
+  const TArray<TSharedPtr<FJsonValue>>* CommandsArray;
+  if(CommandJson->TryGetArrayField(TEXT("commands"), CommandsArray))
+  {
+    for(const TSharedPtr<FJsonValue>& CommandValue : *CommandsArray)
+    {
+      const TSharedPtr<FJsonObject>* CommandObject = nullptr;
+      FLLMCommandCall Call;
+      if(CommandValue->TryGetObject(CommandObject) && LLMConnectorSubsystem::ParseCommandObject(**CommandObject, Call))
       {
-        UE_LOG(LLM, Warning, TEXT("Failed to parse command JSON after fix attempt"));
-        return ELLMErrorType::JsonParseError;
+        OutParams.Commands.Add(MoveTemp(Call));
+      }
+      else
+      {
+        UE_LOG(LLM, Warning, TEXT("Skipping invalid command in commands array"));
       }
-    }
-    else
-    {
-      return ELLMErrorType::JsonParseError;
     }
   }
-
-  // Check if all required fields are present
-  FString CommandStr, TargetStr, MessageStr;
-  if(!CommandJson->TryGetStringField(TEXT("command"), CommandStr) ||
-    !CommandJson->TryGetStringField(TEXT("target"), TargetStr) ||
-    !CommandJson->TryGetStringField(TEXT("message"), MessageStr))
+  else
   {
-    UE_LOG(LLM, Warning, TEXT("Failed to get required fields from JSON"));
-    return ELLMErrorType::MissingFields;
+    FLLMCommandCall& Call = OutParams.Commands.AddDefaulted_GetRef();
+    if(!LLMConnectorSubsystem::ParseCommandObject(*CommandJson, Call) || !CommandJson->HasField(TEXT("target")))
+    {
+      UE_LOG(LLM, Warning, TEXT("Failed to get required fields from JSON"));
+      OutParams.Commands.Reset();
+      return ELLMErrorType::MissingFields;
+    }
   }
 
-  // Extract fields into FLLMResponseBase
-  OutParams.Command = CommandStr;
-  OutParams.Target = TargetStr;
-  OutParams.Message = MessageStr;
-  
 #if !UE_BUILD_SHIPPING
   FString ReasoningStr;
   if(CommandJson->TryGetStringField(TEXT("reasoning"), ReasoningStr))
@@ -470,18 +1089,101 @@ ELLMErrorType ULLMConnectorSubsystem::TryParseParamsFromResponse(const FString&
     OutParams.Reasoning = ReasoningStr;
   }
 #endif
-  
-  // Get parameters array
-  const TArray<TSharedPtr<FJsonValue>>* ParamsArray;
-  if(CommandJson->TryGetArrayField(TEXT("parameters"), ParamsArray))
+
+  return ELLMErrorType::None;
+}
+
+//----------------------------------------------------------------------
+ELLMErrorType ULLMConnectorSubsystem::TryParseParamsFromToolCalls(const TArray<TSharedPtr<FJsonValue>>& ToolCalls, FLLMResponseBase& OutParams) const
+{
+  for(const TSharedPtr<FJsonValue>& ToolCallValue : ToolCalls)
   {
-    for(const auto& Param : *ParamsArray)
+    const TSharedPtr<FJsonObject>* ToolCallObject = nullptr;
+    const TSharedPtr<FJsonObject>* FunctionObject = nullptr;
+    if(!ToolCallValue->TryGetObject(ToolCallObject)
+      || !(*ToolCallObject)->TryGetObjectField(TEXT("function"), FunctionObject))
     {
-      OutParams.Parameters.Add(Param->AsString());
+      UE_LOG(LLM, Warning, TEXT("Invalid tool call in response"));
+      return ELLMErrorType::MissingFields;
     }
+
+    FLLMToolCall& ToolCall = OutParams.ToolCalls.AddDefaulted_GetRef();
+    (*ToolCallObject)->TryGetStringField(TEXT("id"), ToolCall.Id);
+    (*FunctionObject)->TryGetStringField(TEXT("name"), ToolCall.Name);
+    (*FunctionObject)->TryGetStringField(TEXT("arguments"), ToolCall.Arguments);
   }
 
-  return ELLMErrorType::None;
+  // Each call is one command, in the order they were made
+  const bool bHasContentMessage = !OutParams.Message.IsEmpty();
+  for(const FLLMToolCall& ToolCall : OutParams.ToolCalls)
+  {
+    TSharedPtr<FJsonObject> ArgumentsJson = FLLMLenientJson::ParseObject(ToolCall.Arguments);
+    if(!ArgumentsJson.IsValid())
+    {
+      // Left without a command, the call is answered with an error
+      UE_LOG(LLM, Warning, TEXT("Failed to parse tool call arguments: %s"), *ToolCall.Arguments);
+      continue;
+    }
+
+    FLLMCommandCall& Call = OutParams.Commands.AddDefaulted_GetRef();
+    const FString* CommandName = m_ToolNameToCommand.Find(ToolCall.Name);
+    Call.Command = CommandName != nullptr ? *CommandName : ToolCall.Name;
+    Call.ToolCallId = ToolCall.Id;
+    ArgumentsJson->TryGetStringField(TEXT("target"), Call.Target);
+
+    const TArray<TSharedPtr<FJsonValue>>* ParamsArray;
+    if(ArgumentsJson->TryGetArrayField(TEXT("parameters"), ParamsArray))
+    {
+      for(const auto& Param : *ParamsArray)
+      {
+        Call.Parameters.Add(LLMConnectorSubsystem::JsonValueToParameterString(Param));
+      }
+    }
+
+    FString ArgumentsMessage;
+    if(!bHasContentMessage && ArgumentsJson->TryGetStringField(TEXT("message"), ArgumentsMessage) && !ArgumentsMessage.IsEmpty())
+    {
+      OutParams.Message += OutParams.Message.IsEmpty() ? ArgumentsMessage : TEXT(" ") + ArgumentsMessage;
+    }
+  }
+
+  return OutParams.Commands.IsEmpty() ? ELLMErrorType::JsonParseError : ELLMErrorType::None;
+}
+
+//----------------------------------------------------------------------
+FString ULLMConnectorSubsystem::GetToolName(const FString& CommandName) const
+{
+  if(const FString* Found = m_CommandToToolName.Find(CommandName))
+  {
+    return *Found;
+  }
+
+  // Function names are limited to [a-zA-Z0-9_-]{1,64}
+  FString BaseName = CommandName.Left(64);
+  for(TCHAR& Character : BaseName)
+  {
+    if(!FChar::IsAlnum(Character) && Character != TEXT('_') && Character != TEXT('-'))
+    {
+      Character = TEXT('_');
+    }
+  }
+  if(BaseName.IsEmpty())
+  {
+    return BaseName;
+  }
+
+  // "open door" and "open_door" would be the same function, providers reject duplicates
+  FString ToolName = BaseName;
+  for(int32 Suffix = 2; m_ToolNameToCommand.Contains(ToolName); ++Suffix)
+  {
+    const FString SuffixText = FString::Printf(TEXT("_%d"), Suffix);
+    ToolName = BaseName.Left(64 - SuffixText.Len()) + SuffixText;
+  }
+
+  // Kept for the session, so a name never moves to another command
+  m_ToolNameToCommand.Add(ToolName, CommandName);
+  m_CommandToToolName.Add(CommandName, ToolName);
+  return ToolName;
 }
 
 //----------------------------------------------------------------------
@@ -489,49 +1191,366 @@ void ULLMConnectorSubsystem::Initialize(FSubsystemCollectionBase& Collection)
 {
   Super::Initialize(Collection);
   m_Settings = GetDefault<ULLMSettings>();
+  OpenTrafficTrace();
+  StartKeepAlive();
+  Preconnect();
+  LoadTokenizer();
+  m_RateLimiter.Configure(m_Settings->RequestsPerMinute, m_Settings->TokensPerMinute, FPlatformTime::Seconds());
+  m_PostGarbageCollectHandle = FCoreUObjectDelegates::GetPostGarbageCollect().AddUObject(this, &ULLMConnectorSubsystem::RemoveDestroyedCommandHandlers);
+  if(IsUsingEmbeddedBackend())
+  {
+    m_EmbeddedBackend = FLLMEmbeddedBackend::Create(*m_Settings);
+  }
+  m_DefaultConversation = CreateConversation();
 }
 
 //----------------------------------------------------------------------
 void ULLMConnectorSubsystem::Deinitialize()
 {
+  FTSTicker::GetCoreTicker().RemoveTicker(m_CommandQueueTickerHandle);
+  m_CommandQueueTickerHandle.Reset();
+  m_CommandQueue.Empty();
+  FCoreUObjectDelegates::GetPostGarbageCollect().Remove(m_PostGarbageCollectHandle);
+  m_PostGarbageCollectHandle.Reset();
+  m_CommandHandlers.Empty();
+  m_CommandHandlerIndices.Empty();
+  m_CommandHandlerOrder.Empty();
+  for(const TWeakObjectPtr<ULLMConversation>& Conversation : m_Conversations)
+  {
+    if(Conversation.IsValid())
+    {
+      Conversation->Shutdown();
+    }
+  }
+  m_Conversations.Empty();
+  m_ScheduledConversations.Empty();
+  m_ScheduledWarmUps.Empty();
+  m_WarmUpRequests.Empty();
+  m_WarmUpTimes.Empty();
   m_ActiveRequests.Empty();
+  m_InFlightPayloads.Empty();
+  m_LoadedConversations.Reset();
+  m_TrafficTrace.Reset();
+  // Waits for the token being generated
+  m_EmbeddedBackend.Reset();
+  m_Tokenizer.Reset();
+  FTSTicker::GetCoreTicker().RemoveTicker(m_KeepAliveTickerHandle);
+  m_KeepAliveTickerHandle.Reset();
+  FTSTicker::GetCoreTicker().RemoveTicker(m_RateLimitTickerHandle);
+  m_RateLimitTickerHandle.Reset();
+  // Nobody is going to answer the waiting futures
+  TArray<int32> WaitingRequestIds;
+  m_PromptWaiters.GetKeys(WaitingRequestIds);
+  for(const int32 RequestId : WaitingRequestIds)
+  {
+    CompletePromptWaiter(RequestId, ELLMErrorType::Cancelled);
+  }
   Super::Deinitialize();
 }
 
 //----------------------------------------------------------------------
 void ULLMConnectorSubsystem::OnHttpResponse(FHttpRequestPtr Request, FHttpResponsePtr Response, bool bSuccess)
 {
+  const bool bReceived = bSuccess && Response.IsValid();
+  const int32 ResponseCode = bReceived ? Response->GetResponseCode() : 0;
+  const FString Content = bReceived ? Response->GetContentAsString() : FString();
+
+  if(m_TrafficTrace.IsValid() && !m_TrafficTrace->IsReplay() && Request.IsValid())
+  {
+    const TArray<uint8>& RequestContent = Request->GetContent();
+    const FUTF8ToTCHAR Payload(reinterpret_cast<const ANSICHAR*>(RequestContent.GetData()), RequestContent.Num());
+    m_TrafficTrace->Record(FString(Payload.Length(), Payload.Get()), bReceived, ResponseCode, Content, Request->GetElapsedTime());
+  }
+
+  if(bReceived)
+  {
+    m_RateLimiter.UpdateFromResponse(*Response, FPlatformTime::Seconds());
+  }
+
+  OnRequestFinished(Request, bReceived, ResponseCode, Content);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::OnRequestFinished(FHttpRequestPtr Request, bool bSuccess, int32 ResponseCode, const FString& Content)
+{
+  if(m_WarmUpRequests.Remove(Request) > 0)
+  {
+    UE_LOG(LLM, Log, TEXT("Reserved context warm-up %s in %.3f s"), bSuccess && EHttpResponseCodes::IsOk(ResponseCode) ? TEXT("finished") : TEXT("failed"),
+      Request.IsValid() ? Request->GetElapsedTime() : 0.0f);
+    m_ActiveRequests.Remove(Request);
+    StartScheduledRequests();
+    return;
+  }
+
+  if(m_FirstResponseSeconds < 0.0f && Request.IsValid())
+  {
+    m_FirstResponseSeconds = Request->GetElapsedTime();
+    UE_LOG(LLM, Log, TEXT("First response in %.3f s"), m_FirstResponseSeconds);
+  }
+
   // Remove request from active requests
-  m_ActiveRequests.Remove(Request);
-  
-  if(!bSuccess || !Response.IsValid())
+  TWeakObjectPtr<ULLMConversation> Conversation;
+  m_ActiveRequests.RemoveAndCopyValue(Request, Conversation);
+
+  // Before the responses are handled, a follow-up with the same payload is a new request
+  TArray<TWeakObjectPtr<ULLMConversation>> Followers;
+  for(auto It = m_InFlightPayloads.CreateIterator(); It; ++It)
   {
-    OnError.Broadcast(ELLMErrorType::InvalidAPIKey);
+    if(It->Value.Request == Request)
+    {
+      Followers = MoveTemp(It->Value.Followers);
+      It.RemoveCurrent();
+      break;
+    }
+  }
+
+  // The first follower takes over the response of a destroyed conversation, otherwise it is dropped
+  ULLMConversation* RequestConversation = Conversation.Get();
+  while(RequestConversation == nullptr && !Followers.IsEmpty())
+  {
+    RequestConversation = Followers[0].Get();
+    Followers.RemoveAt(0);
+  }
+
+  // Retries and the format fallback are handled once, the followers get the final answer
+  if(RequestConversation != nullptr)
+  {
+    RequestConversation->m_SharedFollowers.Append(MoveTemp(Followers));
+    RequestConversation->HandleResponse(bSuccess, ResponseCode, Content);
+  }
+
+  // The slot is free for the next conversation
+  StartScheduledRequests();
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::IsReplayingTraffic() const
+{
+  return m_TrafficTrace.IsValid() && m_TrafficTrace->IsReplay();
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::IsApiKeyRequired() const
+{
+  return !IsReplayingTraffic()
+    && m_Settings->BackendProfile != ELLMBackendProfile::LlamaCpp
+    && m_Settings->BackendProfile != ELLMBackendProfile::Embedded;
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::IsUsingEmbeddedBackend() const
+{
+  return m_Settings->BackendProfile == ELLMBackendProfile::Embedded && !IsReplayingTraffic();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::RunEmbeddedRequest(FHttpRequestPtr Request, const FString& Payload)
+{
+  // Built without llama.cpp, the request fails like an unreachable server
+  if(!m_EmbeddedBackend.IsValid())
+  {
+    FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateWeakLambda(this, [this, Request](float)
+    {
+      OnRequestFinished(Request, false, 0, FString());
+      return false;
+    }));
     return;
   }
-  
-  FString ResponseString = Response->GetContentAsString();
-  UE_LOG(LLM, Log, TEXT("Response received: %s"), *ResponseString);
-  
-  // Get the response structure
-  FLLMResponseBase ProcessedResponse = ProcessLLMResponse(ResponseString);
-  
-  // Add assistant's response to history
-  FLLMPromptBase AssistantMessage(ELLMRole::Assistant, ProcessedResponse.ToString());
-  AddPromptHistory(AssistantMessage);
-  
-  UE_LOG(LLM, Log, TEXT("%s\n"), *AssistantMessage.Content);
-  
-  OnResponseReceived.Broadcast(ProcessedResponse);
-  OnResponseReceivedNative.Broadcast(ProcessedResponse);
-  
-  // Process the command and, if necessary, send the message back to the llm  
-  if(OnHandleProceedCommandsResponse.IsBound())
+
+  const TWeakObjectPtr<ULLMConversation> Conversation = m_ActiveRequests.FindRef(Request);
+  const double StartSeconds = FPlatformTime::Seconds();
+
+  m_EmbeddedBackend->Generate(Payload,
+    FOnLLMEmbeddedToken::CreateWeakLambda(this, [Conversation](const FString& Text)
+    {
+      if(ULLMConversation* TokenConversation = Conversation.Get())
+      {
+        TokenConversation->OnTokenReceived.Broadcast(Text);
+        TokenConversation->OnTokenReceivedNative.Broadcast(Text);
+      }
+    }),
+    FOnLLMEmbeddedComplete::CreateWeakLambda(this, [this, Request, Payload, StartSeconds](bool bSuccess, int32 ResponseCode, const FString& Body)
+    {
+      if(m_TrafficTrace.IsValid() && !m_TrafficTrace->IsReplay())
+      {
+        m_TrafficTrace->Record(Payload, bSuccess, ResponseCode, Body, FPlatformTime::Seconds() - StartSeconds);
+      }
+      OnRequestFinished(Request, bSuccess, ResponseCode, Body);
+    }));
+}
+
+//----------------------------------------------------------------------
+FString ULLMConnectorSubsystem::GetServerURL(const FString& Path) const
+{
+  const int32 PathStart = m_Settings->ApiURL.Find(TEXT("/v1/"));
+  return PathStart == INDEX_NONE ? FString() : m_Settings->ApiURL.Left(PathStart) + Path;
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::AllocateServerSlot()
+{
+  if(m_Settings->BackendProfile != ELLMBackendProfile::LlamaCpp || m_Settings->LocalServerSlots <= 0)
   {
-    OnHandleProceedCommandsResponse.Broadcast(ProcessedResponse);
+    return INDEX_NONE;
   }
-  else
+  const int32 Slot = m_NextServerSlot % m_Settings->LocalServerSlots;
+  m_NextServerSlot = Slot + 1;
+  return Slot;
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::StartKeepAlive()
+{
+  const FString HealthURL = GetServerURL(TEXT("/health"));
+  if(m_Settings->BackendProfile != ELLMBackendProfile::LlamaCpp || m_Settings->LocalKeepAliveSeconds <= 0.0f || HealthURL.IsEmpty() || IsReplayingTraffic())
+  {
+    return;
+  }
+
+  m_KeepAliveTickerHandle = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateWeakLambda(this, [this, HealthURL](float)
+  {
+    // Requests in progress keep the connections open themselves
+    if(m_ActiveRequests.IsEmpty())
+    {
+      TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = FHttpModule::Get().CreateRequest();
+      HttpRequest->SetURL(HealthURL);
+      HttpRequest->SetVerb(TEXT("GET"));
+      HttpRequest->SetHeader(TEXT("Connection"), TEXT("keep-alive"));
+      HttpRequest->ProcessRequest();
+    }
+    return true;
+  }), m_Settings->LocalKeepAliveSeconds);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::Preconnect()
+{
+  if(!m_Settings->bPreconnectAtStartup || IsReplayingTraffic() || IsUsingEmbeddedBackend() || m_Settings->ApiURL.IsEmpty())
   {
-    TryProcessCommand(ProcessedResponse);
+    return;
+  }
+
+  // Any answer will do, the connection stays in the pool for the first request; llama.cpp has /health
+  const FString HealthURL = GetServerURL(m_Settings->BackendProfile == ELLMBackendProfile::LlamaCpp ? TEXT("/health") : TEXT("/v1/models"));
+  TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = FHttpModule::Get().CreateRequest();
+  HttpRequest->SetURL(HealthURL.IsEmpty() ? m_Settings->ApiURL : HealthURL);
+  HttpRequest->SetVerb(TEXT("GET"));
+  HttpRequest->SetHeader(TEXT("Connection"), TEXT("keep-alive"));
+  if(!m_Settings->ApiKey.IsEmpty())
+  {
+    HttpRequest->SetHeader(TEXT("Authorization"), FString::Printf(TEXT("Bearer %s"), *m_Settings->ApiKey));
+  }
+  HttpRequest->OnProcessRequestComplete().BindWeakLambda(this, [this](FHttpRequestPtr Request, FHttpResponsePtr Response, bool bSuccess)
+  {
+    m_PreconnectSeconds = Request.IsValid() ? Request->GetElapsedTime() : 0.0f;
+    UE_LOG(LLM, Log, TEXT("Preconnect %s in %.3f s"), bSuccess && Response.IsValid() ? TEXT("finished") : TEXT("failed"), m_PreconnectSeconds);
+  });
+  HttpRequest->ProcessRequest();
+}
+
+//----------------------------------------------------------------------
+float ULLMConnectorSubsystem::GetPreconnectSeconds() const
+{
+  return m_PreconnectSeconds;
+}
+
+//----------------------------------------------------------------------
+float ULLMConnectorSubsystem::GetFirstResponseSeconds() const
+{
+  return m_FirstResponseSeconds;
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::LoadTokenizer()
+{
+  if(m_Settings->TokenizerFile.FilePath.IsEmpty())
+  {
+    return;
   }
+
+  const FString FileName = FPaths::ConvertRelativePathToFull(FPaths::ProjectDir(), m_Settings->TokenizerFile.FilePath);
+  Async(EAsyncExecution::ThreadPool, [WeakThis = TWeakObjectPtr<ULLMConnectorSubsystem>(this), FileName]()
+  {
+    FString Error;
+    TSharedPtr<const FLLMTokenizer> Tokenizer = FLLMTokenizer::LoadFromFile(FileName, &Error);
+    AsyncTask(ENamedThreads::GameThread, [WeakThis, Tokenizer, Error, FileName]()
+    {
+      if(!Tokenizer.IsValid())
+      {
+        UE_LOG(LLM, Warning, TEXT("Tokenizer not loaded, token counts are estimated: %s"), *Error);
+      }
+      else if(WeakThis.IsValid())
+      {
+        UE_LOG(LLM, Log, TEXT("Loaded tokenizer %s with %d tokens"), *FileName, Tokenizer->GetVocabSize());
+        WeakThis->m_Tokenizer = Tokenizer;
+      }
+    });
+  });
+}
+
+//----------------------------------------------------------------------
+const FLLMTokenizer* ULLMConnectorSubsystem::GetTokenizer() const
+{
+  return m_Tokenizer.Get();
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConnectorSubsystem::CountTokens(const FString& Text) const
+{
+  return m_Tokenizer.IsValid() ? m_Tokenizer->CountTokens(FStringView(Text)) : FLLMPromptNode::EstimateTokenCount(Text);
+}
+
+//----------------------------------------------------------------------
+bool ULLMConnectorSubsystem::HasTokenizer() const
+{
+  return m_Tokenizer.IsValid();
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::OpenTrafficTrace()
+{
+  ELLMTrafficMode Mode = m_Settings->TrafficMode;
+  FString TraceFile = m_Settings->TrafficTraceFile;
+  m_ReplaySpeed = m_Settings->ReplaySpeed;
+
+  if(FParse::Value(FCommandLine::Get(), TEXT("LLMRecord="), TraceFile))
+  {
+    Mode = ELLMTrafficMode::Record;
+  }
+  else if(FParse::Value(FCommandLine::Get(), TEXT("LLMReplay="), TraceFile))
+  {
+    Mode = ELLMTrafficMode::Replay;
+  }
+  FParse::Value(FCommandLine::Get(), TEXT("LLMReplaySpeed="), m_ReplaySpeed);
+
+  if(Mode == ELLMTrafficMode::Live)
+  {
+    return;
+  }
+
+  if(FPaths::IsRelative(TraceFile))
+  {
+    TraceFile = FPaths::ProjectSavedDir() / TraceFile;
+  }
+  m_TrafficTrace = Mode == ELLMTrafficMode::Record
+    ? FLLMTrafficTrace::CreateRecording(TraceFile)
+    : FLLMTrafficTrace::OpenReplay(TraceFile);
+}
+
+//----------------------------------------------------------------------
+void ULLMConnectorSubsystem::ReplayRequest(FHttpRequestPtr Request, const FString& Payload)
+{
+  const FLLMTrafficEntry* Entry = m_TrafficTrace->TakeReplay(Payload);
+  if(Entry == nullptr)
+  {
+    UE_LOG(LLM, Warning, TEXT("Every exchange of %s was replayed, the request fails"), *m_TrafficTrace->GetFileName());
+  }
+
+  FLLMTrafficEntry Replayed = Entry != nullptr ? *Entry : FLLMTrafficEntry();
+  const float Delay = m_ReplaySpeed > 0.0f ? static_cast<float>(Replayed.ElapsedSeconds) / m_ReplaySpeed : 0.0f;
+  FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateWeakLambda(this, [this, Request, Replayed = MoveTemp(Replayed)](float)
+  {
+    OnRequestFinished(Request, Replayed.bSuccess, Replayed.ResponseCode, Replayed.Response);
+    return false;
+  }), Delay);
 }
@@ -0,0 +1,371 @@
+﻿#include "LLMContextRegistry.h"
+
+#include "LLMPromptTree.h"
+#include "Misc/ScopeRWLock.h"
+
+namespace LLMContextRegistry
+{
+  // AbbreviatedKeys uses fixed codes, a per-fragment legend could not be shared between cached fragments
+  const TCHAR* ShortNameKey = TEXT("Short Name");
+  const TCHAR* AlternativeNamesKey = TEXT("Alternative Names");
+  const TCHAR* ShortNameCode = TEXT("SN");
+  const TCHAR* AlternativeNamesCode = TEXT("AN");
+
+  // Names are what players say, descriptions mostly add noise
+  constexpr float NameWeight = 3.0f;
+  constexpr float AlternativeNamesWeight = 2.0f;
+  constexpr float TagWeight = 2.0f;
+  constexpr float DescriptionWeight = 1.0f;
+}
+
+
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::SetTitle(const FString& InTitle)
+{
+  FWriteScopeLock WriteLock(m_Lock);
+  m_Title = InTitle;
+}
+
+//----------------------------------------------------------------------
+bool FLLMContextRegistry::SetEntry(const FString& Id, const FContextDescription& Description)
+{
+  check(IsInGameThread());
+
+  FEntry NewEntry;
+  NewEntry.Id = Id;
+  NewEntry.FullName = Description.FullName;
+  NewEntry.Description = Description.Description;
+  NewEntry.ShortName = Description.ShortName;
+  NewEntry.AlternativeNames = Description.GetAlternativeNamesString();
+  NewEntry.Tag = Description.Tag;
+
+  FWriteScopeLock WriteLock(m_Lock);
+
+  if(const int32* Found = m_IdToIndex.Find(Id))
+  {
+    FEntry& Entry = m_Entries[*Found];
+    Entry.SyncGeneration = m_SyncGeneration;
+    if(HasSameContent(Entry, NewEntry))
+    {
+      return false;
+    }
+
+    NewEntry.SyncGeneration = m_SyncGeneration;
+    m_NumDirty += Entry.bDirty ? 0 : 1;
+    Entry = MoveTemp(NewEntry);
+    m_bRetrievalIndexDirty = true;
+    return true;
+  }
+
+  NewEntry.SyncGeneration = m_SyncGeneration;
+  m_IdToIndex.Add(Id, m_Entries.Add(MoveTemp(NewEntry)));
+  ++m_NumDirty;
+  m_bRetrievalIndexDirty = true;
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool FLLMContextRegistry::RemoveEntry(const FString& Id)
+{
+  FWriteScopeLock WriteLock(m_Lock);
+
+  int32 Index = INDEX_NONE;
+  if(!m_IdToIndex.RemoveAndCopyValue(Id, Index))
+  {
+    return false;
+  }
+
+  m_NumDirty -= m_Entries[Index].bDirty ? 1 : 0;
+  m_Entries.RemoveAt(Index);
+  RebuildIdIndex();
+  m_bRetrievalIndexDirty = true;
+  return true;
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::Empty()
+{
+  FWriteScopeLock WriteLock(m_Lock);
+  m_Entries.Empty();
+  m_IdToIndex.Empty();
+  m_NumDirty = 0;
+  m_bRetrievalIndexDirty = true;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMContextRegistry::Num() const
+{
+  FReadScopeLock ReadLock(m_Lock);
+  return m_Entries.Num();
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::WriteTo(FStringBuilderBase& Out, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */, TConstArrayView<int32> EntryIndices /*= {} */) const
+{
+  // Fast path - nothing to render again
+  {
+    FReadScopeLock ReadLock(m_Lock);
+    if(m_NumDirty == 0 && m_FragmentsFormat == Format)
+    {
+      WriteFragments(Out, Format, EntryIndices);
+      return;
+    }
+  }
+
+  FWriteScopeLock WriteLock(m_Lock);
+  UpdateFragments(Format);
+  WriteFragments(Out, Format, EntryIndices);
+}
+
+//----------------------------------------------------------------------
+FString FLLMContextRegistry::ToString(ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */, TConstArrayView<int32> EntryIndices /*= {} */) const
+{
+  TStringBuilder<4096> Builder;
+  WriteTo(Builder, Format, EntryIndices);
+  return FString(Builder.Len(), Builder.GetData());
+}
+
+//----------------------------------------------------------------------
+TArray<int32> FLLMContextRegistry::FindRelevantEntries(FStringView Query, int32 TopK) const
+{
+  TArray<int32> Result;
+  bool bQueried = false;
+  {
+    FReadScopeLock ReadLock(m_Lock);
+    if(!m_bRetrievalIndexDirty)
+    {
+      m_RetrievalIndex.Query(Query, TopK, Result);
+      bQueried = true;
+    }
+  }
+
+  if(!bQueried)
+  {
+    FWriteScopeLock WriteLock(m_Lock);
+    UpdateRetrievalIndex();
+    m_RetrievalIndex.Query(Query, TopK, Result);
+  }
+
+  // Keep registry order, so the same set renders the same text
+  Result.Sort();
+  return Result;
+}
+
+//----------------------------------------------------------------------
+FString FLLMContextRegistry::ToStringRelevant(FStringView Query, int32 TopK, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */) const
+{
+  const TArray<int32> EntryIndices = FindRelevantEntries(Query, TopK);
+  if(EntryIndices.IsEmpty())
+  {
+    return FString();
+  }
+
+  // Entries may have changed between the query and rendering
+  TStringBuilder<2048> Builder;
+  {
+    FWriteScopeLock WriteLock(m_Lock);
+    for(const int32 Index : EntryIndices)
+    {
+      if(!m_Entries.IsValidIndex(Index))
+      {
+        return FString();
+      }
+    }
+    UpdateFragments(Format);
+    WriteFragments(Builder, Format, EntryIndices);
+  }
+  return FString(Builder.Len(), Builder.GetData());
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::UpdateRetrievalIndex() const
+{
+  if(!m_bRetrievalIndexDirty)
+  {
+    return;
+  }
+
+  m_RetrievalIndex.Reset();
+  for(const FEntry& Entry : m_Entries)
+  {
+    m_RetrievalIndex.BeginDocument();
+    m_RetrievalIndex.AddField(Entry.FullName, LLMContextRegistry::NameWeight);
+    m_RetrievalIndex.AddField(Entry.ShortName, LLMContextRegistry::NameWeight);
+    m_RetrievalIndex.AddField(Entry.AlternativeNames, LLMContextRegistry::AlternativeNamesWeight);
+    m_RetrievalIndex.AddField(Entry.Tag, LLMContextRegistry::TagWeight);
+    m_RetrievalIndex.AddField(Entry.Description, LLMContextRegistry::DescriptionWeight);
+    m_RetrievalIndex.EndDocument();
+  }
+  m_bRetrievalIndexDirty = false;
+}
+
+//----------------------------------------------------------------------
+bool FLLMContextRegistry::HasSameContent(const FEntry& A, const FEntry& B)
+{
+  // Case-sensitive, a changed capital changes the prompt
+  return A.FullName.Equals(B.FullName, ESearchCase::CaseSensitive)
+    && A.Description.Equals(B.Description, ESearchCase::CaseSensitive)
+    && A.ShortName.Equals(B.ShortName, ESearchCase::CaseSensitive)
+    && A.AlternativeNames.Equals(B.AlternativeNames, ESearchCase::CaseSensitive)
+    && A.Tag.Equals(B.Tag, ESearchCase::CaseSensitive);
+}
+
+//----------------------------------------------------------------------
+FString FLLMContextRegistry::RenderFragment(const FEntry& Entry, ELLMPromptFormat Format)
+{
+  const bool bAbbreviate = Format == ELLMPromptFormat::AbbreviatedKeys;
+
+  // Same fields as FContextDescription::ToPromptNode
+  FLLMPromptTree Tree(5, Entry.FullName.Len() + Entry.Description.Len() + Entry.ShortName.Len() + Entry.AlternativeNames.Len() + Entry.Tag.Len() + 32);
+  const FLLMPromptTree::FNodeId Node = Tree.AddChild(FLLMPromptTree::RootId, Entry.FullName, Entry.Description);
+  if(!Entry.ShortName.IsEmpty())
+  {
+    Tree.AddChild(Node, bAbbreviate ? LLMContextRegistry::ShortNameCode : LLMContextRegistry::ShortNameKey, Entry.ShortName);
+  }
+  if(!Entry.AlternativeNames.IsEmpty())
+  {
+    Tree.AddChild(Node, bAbbreviate ? LLMContextRegistry::AlternativeNamesCode : LLMContextRegistry::AlternativeNamesKey, Entry.AlternativeNames);
+  }
+  if(!Entry.Tag.IsEmpty())
+  {
+    Tree.AddChild(Node, TEXT("Tag"), Entry.Tag);
+  }
+
+  FString Fragment = Tree.ToString(bAbbreviate ? ELLMPromptFormat::Minified : Format);
+
+  // {"Name":{...}} -> "Name":{...}, joined with commas under one object
+  if(Format == ELLMPromptFormat::CompactJson)
+  {
+    Fragment.MidInline(1, Fragment.Len() - 2);
+  }
+  return Fragment;
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::UpdateFragments(ELLMPromptFormat Format) const
+{
+  const bool bFormatChanged = m_FragmentsFormat != Format;
+  m_FragmentsFormat = Format;
+
+  for(FEntry& Entry : m_Entries)
+  {
+    if(Entry.bDirty || bFormatChanged)
+    {
+      Entry.Fragment = RenderFragment(Entry, Format);
+      Entry.bDirty = false;
+    }
+  }
+  m_NumDirty = 0;
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::WriteFragments(FStringBuilderBase& Out, ELLMPromptFormat Format, TConstArrayView<int32> EntryIndices) const
+{
+  const int32 NumToWrite = EntryIndices.IsEmpty() ? m_Entries.Num() : EntryIndices.Num();
+  auto GetEntry = [this, EntryIndices](int32 Index) -> const FEntry&
+  {
+    return m_Entries[EntryIndices.IsEmpty() ? Index : EntryIndices[Index]];
+  };
+
+  switch(Format)
+  {
+  case ELLMPromptFormat::Indented:
+    Out << m_Title;
+    if(!m_Title.IsEmpty() && NumToWrite > 0)
+    {
+      Out.AppendChar(TEXT('\n'));
+    }
+    for(int32 Index = 0; Index < NumToWrite; ++Index)
+    {
+      Out << GetEntry(Index).Fragment;
+    }
+    break;
+
+  case ELLMPromptFormat::CompactJson:
+    {
+      Out.AppendChar(TEXT('{'));
+      bool bFirst = true;
+      if(!m_Title.IsEmpty())
+      {
+        // Titles are plain text, the fragments are already escaped
+        FLLMPromptTree TitleTree;
+        TitleTree.SetContent(FLLMPromptTree::RootId, m_Title);
+        const FString TitleJson = TitleTree.ToString(ELLMPromptFormat::CompactJson);
+        Out << FStringView(TitleJson).Mid(1, TitleJson.Len() - 2);
+        bFirst = false;
+      }
+      for(int32 Index = 0; Index < NumToWrite; ++Index)
+      {
+        if(!bFirst)
+        {
+          Out.AppendChar(TEXT(','));
+        }
+        bFirst = false;
+        Out << GetEntry(Index).Fragment;
+      }
+      Out.AppendChar(TEXT('}'));
+    }
+    break;
+
+  case ELLMPromptFormat::Minified:
+  case ELLMPromptFormat::AbbreviatedKeys:
+    {
+      if(Format == ELLMPromptFormat::AbbreviatedKeys && NumToWrite > 0)
+      {
+        Out << TEXT("Keys: ") << LLMContextRegistry::AlternativeNamesCode << TEXT("=") << LLMContextRegistry::AlternativeNamesKey
+          << TEXT(", ") << LLMContextRegistry::ShortNameCode << TEXT("=") << LLMContextRegistry::ShortNameKey << TEXT("\n");
+      }
+      Out << m_Title;
+      for(int32 Index = 0; Index < NumToWrite; ++Index)
+      {
+        if(Index > 0 || !m_Title.IsEmpty())
+        {
+          Out.AppendChar(TEXT('\n'));
+        }
+        Out << GetEntry(Index).Fragment;
+      }
+    }
+    break;
+  }
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::BeginSync()
+{
+  FWriteScopeLock WriteLock(m_Lock);
+  ++m_SyncGeneration;
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::EndSync()
+{
+  FWriteScopeLock WriteLock(m_Lock);
+
+  const int32 PrevNum = m_Entries.Num();
+  m_Entries.RemoveAll([this](const FEntry& Entry)
+  {
+    if(Entry.SyncGeneration != m_SyncGeneration)
+    {
+      m_NumDirty -= Entry.bDirty ? 1 : 0;
+      return true;
+    }
+    return false;
+  });
+
+  if(m_Entries.Num() != PrevNum)
+  {
+    RebuildIdIndex();
+    m_bRetrievalIndexDirty = true;
+  }
+}
+
+//----------------------------------------------------------------------
+void FLLMContextRegistry::RebuildIdIndex()
+{
+  m_IdToIndex.Reset();
+  for(int32 Index = 0; Index < m_Entries.Num(); ++Index)
+  {
+    m_IdToIndex.Add(m_Entries[Index].Id, Index);
+  }
+}
@@ -0,0 +1,1669 @@
+﻿#include "LLMConversation.h"
+
+#include "LLMConnectorSubsystem.h"
+#include "LLMConnectorSettings.h"
+#include "LLMPromptTree.h"
+#include "LLMTokenizer.h"
+#include "LLMContextRegistry.h"
+#include "Async/Async.h"
+#include "Engine/World.h"
+#include "GameFramework/Actor.h"
+#include "HttpModule.h"
+#include "Interfaces/IHttpResponse.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonSerializer.h"
+
+namespace LLMConversation
+{
+  // 429 answers resent before the response counts as failed
+  constexpr int32 MaxRateLimitedAttempts = 3;
+
+  // The provider names the rejected field in error.param, other 400s must not turn the format off
+  bool IsResponseFormatRejection(const FString& ResponseString)
+  {
+    TSharedPtr<FJsonObject> Root;
+    const TSharedRef<TJsonReader<TCHAR>> Reader = TJsonReaderFactory<TCHAR>::Create(ResponseString);
+    const TSharedPtr<FJsonObject>* Error = nullptr;
+    if(!FJsonSerializer::Deserialize(Reader, Root) || !Root.IsValid() || !Root->TryGetObjectField(TEXT("error"), Error))
+    {
+      return false;
+    }
+
+    FString Code;
+    if((*Error)->TryGetStringField(TEXT("code"), Code) && Code == TEXT("invalid_json_schema"))
+    {
+      return true;
+    }
+
+    FString Param;
+    (*Error)->TryGetStringField(TEXT("param"), Param);
+    for(const TCHAR* FormatParam : { TEXT("response_format"), TEXT("tools"), TEXT("tool_choice"), TEXT("parallel_tool_calls") })
+    {
+      // Also "response_format.json_schema" or "tools[0].function"
+      if(Param.StartsWith(FormatParam, ESearchCase::CaseSensitive)
+        && (Param.Len() == FCString::Strlen(FormatParam) || Param[FCString::Strlen(FormatParam)] == TEXT('.') || Param[FCString::Strlen(FormatParam)] == TEXT('[')))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // "name (type), name (a|b)" in declaration order
+  FString GetParameterSignature(const TArray<FLLMCommandParameter>& ParameterSchema)
+  {
+    TStringBuilder<256> Builder;
+    for(const FLLMCommandParameter& Parameter : ParameterSchema)
+    {
+      if(Builder.Len() > 0)
+      {
+        Builder << TEXT(", ");
+      }
+      Builder << Parameter.ToPromptString();
+    }
+    return FString(Builder.Len(), Builder.GetData());
+  }
+}
+
+
+
+//----------------------------------------------------------------------
+ULLMConnectorSubsystem* ULLMConversation::GetConnector() const
+{
+  return m_Connector;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::Setup(ULLMConnectorSubsystem* Connector)
+{
+  m_Connector = Connector;
+  m_Settings = GetDefault<ULLMSettings>();
+  m_ServerSlot = Connector->AllocateServerSlot();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::Shutdown()
+{
+  FTSTicker::GetCoreTicker().RemoveTicker(m_CommandResultsTickerHandle);
+  m_CommandResultsTickerHandle.Reset();
+  m_PendingCommandResults.Empty();
+  m_PromptQueue.Empty();
+  m_ActiveRequestIds.Empty();
+  // A response still in flight is dropped by the connector
+  m_ActiveRequest.Reset();
+  // Conversations waiting for a retry of this one's request would never be answered
+  if(!m_SharedFollowers.IsEmpty())
+  {
+    AsyncTask(ENamedThreads::GameThread, [Followers = MoveTemp(m_SharedFollowers)]()
+    {
+      for(const TWeakObjectPtr<ULLMConversation>& Follower : Followers)
+      {
+        if(ULLMConversation* FollowerConversation = Follower.Get())
+        {
+          FollowerConversation->HandleSharedResponse(false, FLLMResponseBase());
+        }
+      }
+    });
+    m_SharedFollowers.Reset();
+  }
+  m_bWaitingForRequestSlot = false;
+  m_bFollowUpRequested = false;
+  m_Connector = nullptr;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::BeginDestroy()
+{
+  if(m_Connector != nullptr)
+  {
+    TArray<int32> RequestIds = m_ActiveRequestIds;
+    for(const FLLMQueuedPrompt& Queued : m_PromptQueue)
+    {
+      if(Queued.RequestId != 0)
+      {
+        RequestIds.Add(Queued.RequestId);
+      }
+    }
+
+    // Runs during garbage collection, waiters are told on the next tick
+    if(!RequestIds.IsEmpty())
+    {
+      AsyncTask(ENamedThreads::GameThread, [WeakConnector = TWeakObjectPtr<ULLMConnectorSubsystem>(m_Connector), RequestIds]()
+      {
+        if(ULLMConnectorSubsystem* Connector = WeakConnector.Get())
+        {
+          Connector->BroadcastRequestsFailed(RequestIds, ELLMErrorType::Cancelled);
+        }
+      });
+    }
+  }
+
+  Shutdown();
+  Super::BeginDestroy();
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::SendLLMPrompt(const FString& Message, ELLMRole Role)
+{
+  return SendPromptInternal(FLLMPromptBase(Role, Message));
+}
+
+//----------------------------------------------------------------------
+TFuture<FLLMPromptResult> ULLMConversation::SendPromptAsync(const FString& Message, ELLMRole Role, const FLLMCancellationToken& Token /*= FLLMCancellationToken()*/)
+{
+  FLLMPromptWaiter Waiter;
+  Waiter.Promise = MakeShared<TPromise<FLLMPromptResult>, ESPMode::ThreadSafe>();
+  Waiter.Token = Token;
+  TFuture<FLLMPromptResult> Future = Waiter.Promise->GetFuture();
+
+  auto Send = [](ULLMConversation* Conversation, const FString& InMessage, ELLMRole InRole, FLLMPromptWaiter& InWaiter)
+  {
+    const TSharedPtr<TPromise<FLLMPromptResult>, ESPMode::ThreadSafe> Promise = InWaiter.Promise;
+    const bool bCancelled = InWaiter.Token.IsCancelled();
+    if(Conversation == nullptr || bCancelled || Conversation->SendPromptInternal(FLLMPromptBase(InRole, InMessage), &InWaiter) == 0)
+    {
+      FLLMPromptResult Result;
+      Result.Error = Conversation != nullptr && !bCancelled ? ELLMErrorType::InvalidAPIKey : ELLMErrorType::Cancelled;
+      Promise->SetValue(MoveTemp(Result));
+    }
+  };
+
+  // Queue and history belong to the game thread
+  if(IsInGameThread())
+  {
+    Send(this, Message, Role, Waiter);
+  }
+  else
+  {
+    AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<ULLMConversation>(this), Message, Role, Waiter, Send]() mutable
+    {
+      Send(WeakThis.Get(), Message, Role, Waiter);
+    });
+  }
+  return Future;
+}
+
+//----------------------------------------------------------------------
+bool ULLMConversation::CanSendLLMPrompt() const
+{
+  return !m_ActiveRequest.IsValid() && !m_bWaitingForRequestSlot;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SendLLMToolResult(const FString& ToolCallId, const FString& Result, bool bRequestResponse)
+{
+  FLLMPromptBase ToolMessage(ELLMRole::Tool, Result);
+  ToolMessage.ToolCallId = ToolCallId;
+
+  // Every tool call needs its result in history right after the call, even if no answer is expected
+  AddPromptHistory(ToolMessage);
+
+  if(bRequestResponse)
+  {
+    m_bFollowUpRequested = true;
+    SendQueuedPrompts();
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::QueueCommandResult(const FString& Result)
+{
+  if(Result.IsEmpty())
+  {
+    return;
+  }
+
+  m_PendingCommandResults.Add(Result);
+  ScheduleCommandResultsFlush();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::TryProcessCommand(const FLLMResponseBase& ResponseParams)
+{
+  if(m_Connector != nullptr)
+  {
+    m_Connector->QueueCommandBatch(this, ResponseParams);
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::ScheduleCommandResultsFlush()
+{
+  if(m_CommandResultsTickerHandle.IsValid())
+  {
+    return;
+  }
+
+  const float Window = m_Settings != nullptr ? FMath::Max(0.0f, m_Settings->CommandResultsWindowSeconds) : 0.0f;
+  m_CommandResultsTickerHandle = FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateWeakLambda(this, [this](float)
+  {
+    m_CommandResultsTickerHandle.Reset();
+    FlushCommandResults();
+    return false;
+  }), Window);
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::FlushCommandResults()
+{
+  if(!m_PendingCommandResults.IsEmpty())
+  {
+    m_PromptQueue.Add({FLLMPromptBase(ELLMRole::System, FString::Join(m_PendingCommandResults, TEXT("\n"))), 0});
+    m_PendingCommandResults.Reset();
+    m_bFollowUpRequested = true;
+  }
+  SendQueuedPrompts();
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::SendPromptInternal(const FLLMPromptBase& Prompt, FLLMPromptWaiter* Waiter /*= nullptr*/)
+{
+  if(m_Connector == nullptr)
+  {
+    UE_LOG(LLM, Error, TEXT("The conversation is not connected, the prompt is dropped"));
+    return 0;
+  }
+
+  RestorePendingHistory();
+
+  // Get settings
+  if(m_Settings == nullptr || (m_Settings->ApiKey.IsEmpty() && m_Connector->IsApiKeyRequired()))
+  {
+    UE_LOG(LLM, Error, TEXT("API Key not set in Project Settings"));
+    BroadcastError(ELLMErrorType::InvalidAPIKey);
+    return 0;
+  }
+
+  const int32 RequestId = m_Connector->m_NextRequestId++;
+
+  // Nothing is dropped while a request is in progress, queued prompts go out together with the next request
+  m_PromptQueue.Add({Prompt, RequestId});
+  if(Waiter != nullptr)
+  {
+    m_Connector->m_PromptWaiters.Add(RequestId, MoveTemp(*Waiter));
+  }
+  if(!CanSendLLMPrompt())
+  {
+    UE_LOG(LLM, Log, TEXT("Another request is already in progress, the prompt is queued"));
+    return RequestId;
+  }
+
+  SendQueuedPrompts();
+  return RequestId;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SendQueuedPrompts()
+{
+  if(m_Connector == nullptr)
+  {
+    return;
+  }
+
+  RemoveCancelledPrompts();
+
+  if(!CanSendLLMPrompt() || (m_PromptQueue.IsEmpty() && !m_bFollowUpRequested))
+  {
+    return;
+  }
+
+  // Tool calls still waiting for execution must be answered first
+  if(m_Connector->HasQueuedToolCalls(this))
+  {
+    return;
+  }
+
+  // Get settings
+  if(m_Settings == nullptr || (m_Settings->ApiKey.IsEmpty() && m_Connector->IsApiKeyRequired()))
+  {
+    UE_LOG(LLM, Error, TEXT("API Key not set in Project Settings"));
+    TArray<int32> FailedRequestIds;
+    for(const FLLMQueuedPrompt& Queued : m_PromptQueue)
+    {
+      if(Queued.RequestId != 0)
+      {
+        FailedRequestIds.Add(Queued.RequestId);
+      }
+    }
+    m_PromptQueue.Reset();
+    m_bFollowUpRequested = false;
+    BroadcastError(ELLMErrorType::InvalidAPIKey);
+    m_Connector->BroadcastRequestsFailed(FailedRequestIds, ELLMErrorType::InvalidAPIKey);
+    return;
+  }
+
+  // Requests of all conversations share the request slots of the connector
+  m_bWaitingForRequestSlot = true;
+  m_Connector->ScheduleRequest(this);
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::RemoveCancelledPrompts()
+{
+  for(int32 Index = m_PromptQueue.Num() - 1; Index >= 0; --Index)
+  {
+    const int32 RequestId = m_PromptQueue[Index].RequestId;
+    if(m_Connector->IsPromptCancelled(RequestId))
+    {
+      m_PromptQueue.RemoveAt(Index);
+      m_Connector->OnRequestFailedNative.Broadcast(RequestId, ELLMErrorType::Cancelled);
+      m_Connector->CompletePromptWaiter(RequestId, ELLMErrorType::Cancelled);
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::StartRequest()
+{
+  m_bWaitingForRequestSlot = false;
+  if(m_Connector == nullptr)
+  {
+    return;
+  }
+
+  if(m_bResendingRequest)
+  {
+    m_bResendingRequest = false;
+    DispatchPromptHistory();
+    return;
+  }
+
+  // Prompts may have been cancelled while waiting for the slot
+  RemoveCancelledPrompts();
+  RestorePendingHistory();
+  if(m_PromptQueue.IsEmpty() && !m_bFollowUpRequested)
+  {
+    return;
+  }
+
+  // Commands near the listener right now
+  UpdateCommandScope();
+
+  const int32 LastUserPrompt = m_PromptQueue.FindLastByPredicate([](const FLLMQueuedPrompt& Queued) { return Queued.Prompt.Role == ELLMRole::User; });
+
+  // World context relevant to this line goes right before it
+  if(LastUserPrompt != INDEX_NONE)
+  {
+    UpdateRelevantContextMessage(m_PromptQueue[LastUserPrompt].Prompt.Content);
+  }
+
+  // Add new messages, all of them are answered by one request
+  m_RateLimitedAttempts = 0;
+  m_FormatRejectedAttempts = 0;
+  m_ActiveRequestIds.Reset();
+  for(const FLLMQueuedPrompt& Queued : m_PromptQueue)
+  {
+    AddPromptHistory(Queued.Prompt);
+    if(Queued.RequestId != 0)
+    {
+      m_ActiveRequestIds.Add(Queued.RequestId);
+    }
+  }
+  m_PromptQueue.Reset();
+  m_bFollowUpRequested = false;
+
+  TrimPromptHistory();
+
+  // Add instructions to the response format at the end of the messages to avoid hallucinating llm
+  if(LastUserPrompt != INDEX_NONE)
+  {
+    UpdateFormatInstructionsMessage(true);
+  }
+
+  DispatchPromptHistory();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::DispatchPromptHistory()
+{
+  TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = CreateHttpRequest();
+
+  // Store request, the connector counts it against MaxConcurrentRequests
+  m_ActiveRequest = HttpRequest;
+  m_Connector->m_ActiveRequests.Add(HttpRequest, this);
+
+  m_ActiveRequestFormatMode = m_Connector->GetActiveResponseFormatMode();
+  TSharedPtr<FJsonObject> JsonObject = BuildRequestPayload(m_ActiveRequestFormatMode, m_PromptHistory.Num());
+
+  // Convert JSON to string
+  FString JsonString;
+  TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&JsonString);
+  FJsonSerializer::Serialize(JsonObject.ToSharedRef(), Writer);
+
+  // Set request content
+  HttpRequest->SetContentAsString(JsonString);
+
+  // Bind callback
+  HttpRequest->OnProcessRequestComplete().BindUObject(m_Connector, &ULLMConnectorSubsystem::OnHttpResponse);
+
+  // Another conversation already asked exactly this, its response answers both
+  if(FHttpRequestPtr SharedRequest = m_Connector->ShareInFlightRequest(this, HttpRequest, JsonString))
+  {
+    m_ActiveRequest = SharedRequest;
+    UE_LOG(LLM, Log, TEXT("Identical request already in flight, waiting for its response"));
+    return;
+  }
+  m_Connector->ChargeRateLimit(EstimateRequestTokens());
+
+  // Send request, or answer it from the recorded traffic or the embedded model
+  if(m_Connector->IsReplayingTraffic())
+  {
+    m_Connector->ReplayRequest(HttpRequest, JsonString);
+  }
+  else if(m_Connector->IsUsingEmbeddedBackend())
+  {
+    m_Connector->RunEmbeddedRequest(HttpRequest, JsonString);
+  }
+  else
+  {
+    HttpRequest->ProcessRequest();
+  }
+
+  FString LogJsonString = JsonString;
+  LogJsonString.ReplaceInline(TEXT("\\n"), TEXT("\n"));
+  UE_LOG(LLM, Log, TEXT("Sending request: %s"), *LogJsonString);
+}
+
+//----------------------------------------------------------------------
+TSharedRef<IHttpRequest, ESPMode::ThreadSafe> ULLMConversation::CreateHttpRequest() const
+{
+  TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = FHttpModule::Get().CreateRequest();
+  HttpRequest->SetURL(m_Settings->ApiURL);
+  HttpRequest->SetVerb(TEXT("POST"));
+  HttpRequest->SetHeader(TEXT("Content-Type"), TEXT("application/json"));
+  if(!m_Settings->ApiKey.IsEmpty())
+  {
+    HttpRequest->SetHeader(TEXT("Authorization"), FString::Printf(TEXT("Bearer %s"), *m_Settings->ApiKey));
+  }
+  if(m_Settings->BackendProfile == ELLMBackendProfile::LlamaCpp)
+  {
+    HttpRequest->SetHeader(TEXT("Connection"), TEXT("keep-alive"));
+  }
+  return HttpRequest;
+}
+
+//----------------------------------------------------------------------
+TSharedPtr<FJsonObject> ULLMConversation::BuildRequestPayload(ELLMResponseFormatMode FormatMode, int32 NumMessages) const
+{
+  const ELLMBackendProfile Profile = m_Settings->BackendProfile;
+  const bool bUseTools = FormatMode == ELLMResponseFormatMode::ToolCalls;
+
+  // Create JSON payload
+  TSharedPtr<FJsonObject> JsonObject = MakeShared<FJsonObject>();
+  JsonObject->SetStringField(TEXT("model"), m_Settings->ModelName);
+
+  // Create messages array
+  TArray<TSharedPtr<FJsonValue>> MessagesArray;
+
+  // Add the messages from history
+  for(int32 Index = 0; Index < NumMessages; ++Index)
+  {
+    const FLLMStoredPrompt& HistoryMessage = m_PromptHistory[Index];
+    TSharedPtr<FJsonObject> MessageObject = MakeShared<FJsonObject>();
+    MessageObject->SetStringField(TEXT("content"), HistoryMessage.Text.ToString());
+
+    if(!bUseTools && HistoryMessage.Role == ELLMRole::Tool)
+    {
+      // After a fallback the tool results are still useful as plain context
+      MessageObject->SetStringField(TEXT("role"), ULLMConnectorSubsystem::ConvertLLMRoleToString(ELLMRole::System));
+    }
+    else
+    {
+      MessageObject->SetStringField(TEXT("role"), ULLMConnectorSubsystem::ConvertLLMRoleToString(HistoryMessage.Role));
+    }
+
+    if(bUseTools && HistoryMessage.Role == ELLMRole::Tool)
+    {
+      MessageObject->SetStringField(TEXT("tool_call_id"), HistoryMessage.ToolCallId);
+    }
+
+    if(bUseTools && !HistoryMessage.ToolCalls.IsEmpty())
+    {
+      TArray<TSharedPtr<FJsonValue>> ToolCallsArray;
+      for(const FLLMToolCall& ToolCall : HistoryMessage.ToolCalls)
+      {
+        TSharedPtr<FJsonObject> FunctionObject = MakeShared<FJsonObject>();
+        FunctionObject->SetStringField(TEXT("name"), ToolCall.Name);
+        FunctionObject->SetStringField(TEXT("arguments"), ToolCall.Arguments);
+
+        TSharedPtr<FJsonObject> ToolCallObject = MakeShared<FJsonObject>();
+        ToolCallObject->SetStringField(TEXT("id"), ToolCall.Id);
+        ToolCallObject->SetStringField(TEXT("type"), TEXT("function"));
+        ToolCallObject->SetObjectField(TEXT("function"), FunctionObject);
+        ToolCallsArray.Add(MakeShared<FJsonValueObject>(ToolCallObject));
+      }
+      MessageObject->SetArrayField(TEXT("tool_calls"), ToolCallsArray);
+    }
+
+    MessagesArray.Add(MakeShared<FJsonValueObject>(MessageObject));
+  }
+
+  JsonObject->SetArrayField(TEXT("messages"), MessagesArray);
+
+  // Generation settings the server accepts
+  if(m_Settings->GenerationSettings.bUseTemperature)
+  {
+    JsonObject->SetNumberField(TEXT("temperature"), m_Settings->GenerationSettings.Temperature);
+  }
+  if(m_Settings->GenerationSettings.bUseFrequencyPenalty)
+  {
+    JsonObject->SetNumberField(TEXT("frequency_penalty"), m_Settings->GenerationSettings.FrequencyPenalty);
+  }
+  if(m_Settings->GenerationSettings.bUsePresencePenalty)
+  {
+    JsonObject->SetNumberField(TEXT("presence_penalty"), m_Settings->GenerationSettings.PresencePenalty);
+  }
+  if(m_Settings->GenerationSettings.bUseRepetitionPenalty && Profile != ELLMBackendProfile::OpenAI)
+  {
+    const bool bLlamaNames = Profile == ELLMBackendProfile::LlamaCpp || Profile == ELLMBackendProfile::Embedded;
+    JsonObject->SetNumberField(bLlamaNames ? TEXT("repeat_penalty") : TEXT("repetition_penalty"), m_Settings->GenerationSettings.RepetitionPenalty);
+  }
+  if(m_Settings->GenerationSettings.bUseMinP && Profile != ELLMBackendProfile::OpenAI)
+  {
+    JsonObject->SetNumberField(TEXT("min_p"), m_Settings->GenerationSettings.MinP);
+  }
+  if(m_Settings->GenerationSettings.bUseTopA && Profile == ELLMBackendProfile::OpenRouter)
+  {
+    JsonObject->SetNumberField(TEXT("top_a"), m_Settings->GenerationSettings.TopA);
+  }
+  if(m_Settings->GenerationSettings.bUseTopK && Profile != ELLMBackendProfile::OpenAI)
+  {
+    JsonObject->SetNumberField(TEXT("top_k"), m_Settings->GenerationSettings.TopK);
+  }
+  if(m_Settings->GenerationSettings.bUseTopP)
+  {
+    JsonObject->SetNumberField(TEXT("top_p"), m_Settings->GenerationSettings.TopP);
+  }
+  if(m_Settings->GenerationSettings.bUseMaxTokens)
+  {
+    JsonObject->SetNumberField(TEXT("max_tokens"), m_Settings->GenerationSettings.MaxTokens);
+  }
+
+  // The slot keeps the KV cache of this conversation, the server evaluates only the messages after the common prefix
+  if(Profile == ELLMBackendProfile::LlamaCpp)
+  {
+    if(m_ServerSlot != INDEX_NONE)
+    {
+      JsonObject->SetNumberField(TEXT("id_slot"), m_ServerSlot);
+    }
+    JsonObject->SetBoolField(TEXT("cache_prompt"), m_Settings->bCachePrompt);
+  }
+
+  // Add response_format as object
+  if(bUseTools)
+  {
+    // Providers reject an empty "tools" array, without commands in scope the reply is plain content
+    const TArray<TSharedPtr<FJsonValue>>& Tools = GetCommandTools();
+    if(!Tools.IsEmpty())
+    {
+      // Every call must be answered before the next request
+      JsonObject->SetArrayField(TEXT("tools"), Tools);
+      JsonObject->SetStringField(TEXT("tool_choice"), TEXT("auto"));
+      JsonObject->SetBoolField(TEXT("parallel_tool_calls"), m_Settings->MaxCommandsPerResponse > 1);
+    }
+  }
+  else if(FormatMode == ELLMResponseFormatMode::JsonSchema)
+  {
+    JsonObject->SetObjectField(TEXT("response_format"), GetResponseFormatJsonSchema());
+  }
+  else
+  {
+    TSharedPtr<FJsonObject> ResponseFormatObject = MakeShared<FJsonObject>();
+    ResponseFormatObject->SetStringField(TEXT("type"), TEXT("json_object"));
+    JsonObject->SetObjectField(TEXT("response_format"), ResponseFormatObject);
+  }
+
+  // stop response as user
+  TArray<TSharedPtr<FJsonValue>> StopArray;
+  StopArray.Add(MakeShared<FJsonValueString>(TEXT("USER")));
+  JsonObject->SetArrayField(TEXT("stop"), StopArray);
+
+  return JsonObject;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::HandleResponse(bool bSuccess, int32 ResponseCode, const FString& ResponseString)
+{
+  m_ActiveRequest.Reset();
+  const TArray<int32> RequestIds = MoveTemp(m_ActiveRequestIds);
+  m_ActiveRequestIds.Reset();
+
+  if(bSuccess)
+  {
+    UE_LOG(LLM, Log, TEXT("Response received: %s"), *ResponseString);
+  }
+
+  // The connector holds the queue back until Retry-After, this conversation goes first then
+  if(bSuccess && ResponseCode == EHttpResponseCodes::TooManyRequests && m_RateLimitedAttempts < LLMConversation::MaxRateLimitedAttempts)
+  {
+    ++m_RateLimitedAttempts;
+    m_ActiveRequestIds = RequestIds;
+    m_bResendingRequest = true;
+    m_bWaitingForRequestSlot = true;
+    m_Connector->m_ScheduledConversations.Insert(this, 0);
+    return;
+  }
+
+  // Provider doesn't support "json_schema" or "tools" - resend the same history with prompt instructions
+  if(bSuccess && m_ActiveRequestFormatMode != ELLMResponseFormatMode::JsonObject
+    && (ResponseCode == EHttpResponseCodes::BadRequest || ResponseCode == 422)
+    && LLMConversation::IsResponseFormatRejection(ResponseString))
+  {
+    const TCHAR* FormatName = m_ActiveRequestFormatMode == ELLMResponseFormatMode::ToolCalls ? TEXT("tools") : TEXT("json_schema response format");
+
+    // A single upstream of a router may lack the feature, the fallback applies to every conversation
+    if(++m_FormatRejectedAttempts > 1)
+    {
+      UE_LOG(LLM, Warning, TEXT("Provider rejected %s again, falling back to json_object"), FormatName);
+      m_Connector->OnResponseFormatRejected();
+      UpdateFormatInstructionsMessage(false);
+    }
+    else
+    {
+      UE_LOG(LLM, Warning, TEXT("Provider rejected %s, trying once more"), FormatName);
+    }
+    m_ActiveRequestIds = RequestIds;
+    m_bResendingRequest = true;
+    m_bWaitingForRequestSlot = true;
+    m_Connector->ScheduleRequest(this);
+    return;
+  }
+  
+  // The answer is final, taken before sending queued prompts can attach new followers
+  const TArray<TWeakObjectPtr<ULLMConversation>> Followers = MoveTemp(m_SharedFollowers);
+  m_SharedFollowers.Reset();
+
+  // Get the response structure
+  const FLLMResponseBase ProcessedResponse = bSuccess ? m_Connector->ProcessLLMResponse(ResponseString) : FLLMResponseBase();
+  CompleteResponse(RequestIds, bSuccess, ProcessedResponse, true);
+
+  for(const TWeakObjectPtr<ULLMConversation>& Follower : Followers)
+  {
+    if(ULLMConversation* FollowerConversation = Follower.Get())
+    {
+      FollowerConversation->HandleSharedResponse(bSuccess, ProcessedResponse);
+    }
+  }
+
+  // Prompts sent while waiting for this response
+  SendQueuedPrompts();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::HandleSharedResponse(bool bSuccess, const FLLMResponseBase& Response)
+{
+  if(m_Connector == nullptr)
+  {
+    return;
+  }
+
+  m_ActiveRequest.Reset();
+  const TArray<int32> RequestIds = MoveTemp(m_ActiveRequestIds);
+  m_ActiveRequestIds.Reset();
+
+  CompleteResponse(RequestIds, bSuccess, Response, false);
+  SendQueuedPrompts();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::CompleteResponse(const TArray<int32>& RequestIds, bool bSuccess, const FLLMResponseBase& Response, bool bSentRequest)
+{
+  if(!bSuccess)
+  {
+    BroadcastError(ELLMErrorType::InvalidAPIKey);
+    m_Connector->BroadcastRequestsFailed(RequestIds, ELLMErrorType::InvalidAPIKey);
+    return;
+  }
+
+  // Add assistant's response to history
+  FLLMPromptBase AssistantMessage(ELLMRole::Assistant, Response.ToString());
+  if(bSentRequest && !Response.ToolCalls.IsEmpty())
+  {
+    // The call itself carries the command, keep only what was said
+    // Nobody answers the calls in a shared copy, it keeps them as plain text
+    AssistantMessage.Content = Response.Message;
+    AssistantMessage.ToolCalls = Response.ToolCalls;
+  }
+  AddPromptHistory(AssistantMessage);
+
+  UE_LOG(LLM, Log, TEXT("%s\n"), *AssistantMessage.Content);
+
+  BroadcastResponse(Response);
+  for(const int32 RequestId : RequestIds)
+  {
+    m_Connector->OnRequestCompletedNative.Broadcast(RequestId, Response);
+    m_Connector->CompletePromptWaiter(RequestId, ELLMErrorType::None, Response);
+  }
+
+  // Process the command and, if necessary, send the message back to the llm
+  // The conversation that sent the request already ran the commands through the shared handlers
+  if(bSentRequest ? IsHandlingCommandsExternally() : OnHandleProceedCommandsResponse.IsBound())
+  {
+    BroadcastProceedCommands(Response);
+  }
+  else if(bSentRequest)
+  {
+    TryProcessCommand(Response);
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::BroadcastResponse(const FLLMResponseBase& Response)
+{
+  OnResponseReceived.Broadcast(Response);
+  OnResponseReceivedNative.Broadcast(Response);
+  if(IsDefaultConversation())
+  {
+    m_Connector->OnResponseReceived.Broadcast(Response);
+    m_Connector->OnResponseReceivedNative.Broadcast(Response);
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::BroadcastError(ELLMErrorType ErrorType)
+{
+  OnError.Broadcast(ErrorType);
+  if(IsDefaultConversation())
+  {
+    m_Connector->OnError.Broadcast(ErrorType);
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::BroadcastProceedCommands(const FLLMResponseBase& Response)
+{
+  OnHandleProceedCommandsResponse.Broadcast(Response);
+  if(IsDefaultConversation())
+  {
+    m_Connector->OnHandleProceedCommandsResponse.Broadcast(Response);
+  }
+}
+
+//----------------------------------------------------------------------
+bool ULLMConversation::IsHandlingCommandsExternally() const
+{
+  return OnHandleProceedCommandsResponse.IsBound() || (IsDefaultConversation() && m_Connector->OnHandleProceedCommandsResponse.IsBound());
+}
+
+//----------------------------------------------------------------------
+bool ULLMConversation::IsDefaultConversation() const
+{
+  return m_Connector != nullptr && m_Connector->m_DefaultConversation == this;
+}
+
+//----------------------------------------------------------------------
+FLLMPromptNode ULLMConversation::GetInstructionsForResponseFormat() const
+{
+  FLLMPromptNode PromptNode;
+  
+  TArray<FString> CommandNames;
+  TArray<FString> Targets;
+  for(const FLLMCommandStruct& Command : GetAdvertisedCommands())
+  {
+    CommandNames.AddUnique(Command.Name);
+    Targets.AddUnique(Command.Target);
+  }
+
+  if(!m_OverrideInstructionsForResponseFormatTitle.IsEmpty())
+  {
+    PromptNode.ContentText = m_OverrideInstructionsForResponseFormatTitle;
+  }
+  else
+  {
+    PromptNode.ContentText = m_Settings->ResponseFormatInstructionsText;
+  }
+
+  // The schema or tools already describe every field
+  if(m_Connector->GetActiveResponseFormatMode() != ELLMResponseFormatMode::JsonObject)
+  {
+    return PromptNode;
+  }
+
+  FLLMPromptNode JsonNode;
+  JsonNode.AddChild("{");
+  const int32 MaxCommands = FMath::Max(1, m_Settings->MaxCommandsPerResponse);
+  if(MaxCommands > 1)
+  {
+    FString ParametersText = m_Settings->ParametersInstructionsText.TrimStartAndEnd();
+    ParametersText.RemoveFromEnd(TEXT(","));
+    JsonNode.AddChild(" \"commands\"", FString::Printf(TEXT("[{\"command\": \"%s\", \"target\": \"%s\", \"parameters\": %s}, ...] up to %d commands in execution order,"),
+      *FString::Join(CommandNames, TEXT("|")), *FString::Join(Targets, TEXT("|")), *ParametersText, MaxCommands));
+  }
+  else
+  {
+    JsonNode.AddChild(" \"command\"", TEXT("\"") + FString::Join(CommandNames, TEXT("|")) + TEXT("\","));
+    JsonNode.AddChild(" \"target\"", TEXT("\"") + FString::Join(Targets, TEXT("|")) + TEXT("\","));
+    JsonNode.AddChild(" \"parameters\"", m_Settings->ParametersInstructionsText);
+  }
+  JsonNode.AddChild(" \"message\"", m_Settings->MessageInstructionsText);
+  
+#if !UE_BUILD_SHIPPING
+  JsonNode.AddChild(" \"reasoning\"", m_Settings->ReasoningInstructionsText);
+#endif
+  
+  JsonNode.AddChild("}");
+  
+  PromptNode.AddChild("Use this JSON object to give your answer", MoveTemp(JsonNode));
+
+  return PromptNode;
+}
+
+//----------------------------------------------------------------------
+TSharedPtr<FJsonObject> ULLMConversation::GetResponseFormatJsonSchema() const
+{
+  if(m_CachedResponseFormatSchema.IsValid())
+  {
+    return m_CachedResponseFormatSchema;
+  }
+
+  // Settings texts are written as JSON template fragments, strip quotes and commas for descriptions
+  auto ToDescription = [](const FString& InstructionsText)
+  {
+    FString Result = InstructionsText.TrimStartAndEnd();
+    Result.RemoveFromEnd(TEXT(","));
+    if(Result.Len() > 1 && Result.StartsWith(TEXT("\"")) && Result.EndsWith(TEXT("\"")))
+    {
+      Result = Result.Mid(1, Result.Len() - 2);
+    }
+    return Result;
+  };
+
+  auto MakeStringProperty = [](const FString& Description, const TArray<FString>& EnumValues)
+  {
+    TSharedPtr<FJsonObject> Property = MakeShared<FJsonObject>();
+    Property->SetStringField(TEXT("type"), TEXT("string"));
+    if(!Description.IsEmpty())
+    {
+      Property->SetStringField(TEXT("description"), Description);
+    }
+    if(!EnumValues.IsEmpty())
+    {
+      TArray<TSharedPtr<FJsonValue>> EnumArray;
+      for(const FString& Value : EnumValues)
+      {
+        EnumArray.Add(MakeShared<FJsonValueString>(Value));
+      }
+      Property->SetArrayField(TEXT("enum"), EnumArray);
+    }
+    return Property;
+  };
+
+  TArray<FString> CommandNames;
+  TArray<FString> Targets;
+  TArray<FString> Signatures;
+  for(const FLLMCommandStruct& Command : GetAdvertisedCommands())
+  {
+    CommandNames.AddUnique(Command.Name);
+    Targets.AddUnique(Command.Target);
+    if(!Command.ParameterSchema.IsEmpty())
+    {
+      Signatures.AddUnique(FString::Printf(TEXT("%s: %s"), *Command.Name, *LLMConversation::GetParameterSignature(Command.ParameterSchema)));
+    }
+  }
+
+  FString ParametersDescription = ToDescription(m_Settings->ParametersInstructionsText);
+  if(!Signatures.IsEmpty())
+  {
+    ParametersDescription += TEXT("\n") + FString::Join(Signatures, TEXT("\n"));
+  }
+
+  // Field order matches the prompt instructions
+  TSharedPtr<FJsonObject> Properties = MakeShared<FJsonObject>();
+  TArray<TSharedPtr<FJsonValue>> Required;
+
+  TSharedPtr<FJsonObject> ParametersProperty = MakeShared<FJsonObject>();
+  ParametersProperty->SetStringField(TEXT("type"), TEXT("array"));
+  ParametersProperty->SetStringField(TEXT("description"), ParametersDescription);
+  ParametersProperty->SetObjectField(TEXT("items"), MakeStringProperty(TEXT(""), {}));
+
+  const int32 MaxCommands = FMath::Max(1, m_Settings->MaxCommandsPerResponse);
+  if(MaxCommands > 1)
+  {
+    TSharedPtr<FJsonObject> CommandProperties = MakeShared<FJsonObject>();
+    CommandProperties->SetObjectField(TEXT("command"), MakeStringProperty(TEXT(""), CommandNames));
+    CommandProperties->SetObjectField(TEXT("target"), MakeStringProperty(TEXT(""), Targets));
+    CommandProperties->SetObjectField(TEXT("parameters"), ParametersProperty);
+
+    TArray<TSharedPtr<FJsonValue>> CommandRequired;
+    for(const auto& Property : CommandProperties->Values)
+    {
+      CommandRequired.Add(MakeShared<FJsonValueString>(Property.Key));
+    }
+
+    TSharedPtr<FJsonObject> CommandItem = MakeShared<FJsonObject>();
+    CommandItem->SetStringField(TEXT("type"), TEXT("object"));
+    CommandItem->SetObjectField(TEXT("properties"), CommandProperties);
+    CommandItem->SetArrayField(TEXT("required"), CommandRequired);
+    CommandItem->SetBoolField(TEXT("additionalProperties"), false);
+
+    // "maxItems" is not accepted in strict mode everywhere, extra commands are dropped after parsing
+    TSharedPtr<FJsonObject> CommandsProperty = MakeShared<FJsonObject>();
+    CommandsProperty->SetStringField(TEXT("type"), TEXT("array"));
+    CommandsProperty->SetStringField(TEXT("description"), FString::Printf(TEXT("Up to %d commands in execution order"), MaxCommands));
+    CommandsProperty->SetObjectField(TEXT("items"), CommandItem);
+    Properties->SetObjectField(TEXT("commands"), CommandsProperty);
+  }
+  else
+  {
+    Properties->SetObjectField(TEXT("command"), MakeStringProperty(TEXT(""), CommandNames));
+    Properties->SetObjectField(TEXT("target"), MakeStringProperty(TEXT(""), Targets));
+    Properties->SetObjectField(TEXT("parameters"), ParametersProperty);
+  }
+
+  Properties->SetObjectField(TEXT("message"), MakeStringProperty(ToDescription(m_Settings->MessageInstructionsText), {}));
+
+#if !UE_BUILD_SHIPPING
+  Properties->SetObjectField(TEXT("reasoning"), MakeStringProperty(ToDescription(m_Settings->ReasoningInstructionsText), {}));
+#endif
+
+  // Strict mode requires every property to be listed
+  for(const auto& Property : Properties->Values)
+  {
+    Required.Add(MakeShared<FJsonValueString>(Property.Key));
+  }
+
+  TSharedPtr<FJsonObject> Schema = MakeShared<FJsonObject>();
+  Schema->SetStringField(TEXT("type"), TEXT("object"));
+  Schema->SetObjectField(TEXT("properties"), Properties);
+  Schema->SetArrayField(TEXT("required"), Required);
+  Schema->SetBoolField(TEXT("additionalProperties"), false);
+
+  TSharedPtr<FJsonObject> JsonSchema = MakeShared<FJsonObject>();
+  JsonSchema->SetStringField(TEXT("name"), TEXT("llm_command"));
+  JsonSchema->SetBoolField(TEXT("strict"), true);
+  JsonSchema->SetObjectField(TEXT("schema"), Schema);
+
+  m_CachedResponseFormatSchema = MakeShared<FJsonObject>();
+  m_CachedResponseFormatSchema->SetStringField(TEXT("type"), TEXT("json_schema"));
+  m_CachedResponseFormatSchema->SetObjectField(TEXT("json_schema"), JsonSchema);
+  return m_CachedResponseFormatSchema;
+}
+
+//----------------------------------------------------------------------
+const TArray<TSharedPtr<FJsonValue>>& ULLMConversation::GetCommandTools() const
+{
+  if(!m_CachedCommandTools.IsEmpty())
+  {
+    return m_CachedCommandTools;
+  }
+
+  // Several handlers may share a command name with different targets - one function per name
+  TMap<FString, TArray<const FLLMCommandStruct*>> CommandsByName;
+  const TArray<FLLMCommandStruct> Commands = GetAdvertisedCommands();
+  for(const FLLMCommandStruct& Command : Commands)
+  {
+    CommandsByName.FindOrAdd(Command.Name).Add(&Command);
+  }
+
+  for(const auto& Pair : CommandsByName)
+  {
+    const FString ToolName = m_Connector->GetToolName(Pair.Key);
+    if(ToolName.IsEmpty())
+    {
+      continue;
+    }
+
+    TArray<FString> Targets;
+    TArray<FString> Descriptions;
+    TArray<FString> Signatures;
+    for(const FLLMCommandStruct* Command : Pair.Value)
+    {
+      Targets.AddUnique(Command->Target);
+      Descriptions.AddUnique(Command->Description);
+      if(!Command->ParameterSchema.IsEmpty())
+      {
+        Signatures.AddUnique(LLMConversation::GetParameterSignature(Command->ParameterSchema));
+      }
+    }
+
+    TArray<TSharedPtr<FJsonValue>> TargetsArray;
+    for(const FString& Target : Targets)
+    {
+      TargetsArray.Add(MakeShared<FJsonValueString>(Target));
+    }
+
+    TSharedPtr<FJsonObject> TargetProperty = MakeShared<FJsonObject>();
+    TargetProperty->SetStringField(TEXT("type"), TEXT("string"));
+    TargetProperty->SetArrayField(TEXT("enum"), TargetsArray);
+
+    TSharedPtr<FJsonObject> ItemsProperty = MakeShared<FJsonObject>();
+    ItemsProperty->SetStringField(TEXT("type"), TEXT("string"));
+
+    TSharedPtr<FJsonObject> ParametersProperty = MakeShared<FJsonObject>();
+    ParametersProperty->SetStringField(TEXT("type"), TEXT("array"));
+    ParametersProperty->SetObjectField(TEXT("items"), ItemsProperty);
+    if(!Signatures.IsEmpty())
+    {
+      ParametersProperty->SetStringField(TEXT("description"), FString::Join(Signatures, TEXT(" or ")));
+    }
+
+    TSharedPtr<FJsonObject> MessageProperty = MakeShared<FJsonObject>();
+    MessageProperty->SetStringField(TEXT("type"), TEXT("string"));
+    MessageProperty->SetStringField(TEXT("description"), TEXT("Message to show to player"));
+
+    TSharedPtr<FJsonObject> Properties = MakeShared<FJsonObject>();
+    Properties->SetObjectField(TEXT("target"), TargetProperty);
+    Properties->SetObjectField(TEXT("parameters"), ParametersProperty);
+    Properties->SetObjectField(TEXT("message"), MessageProperty);
+
+    TArray<TSharedPtr<FJsonValue>> Required;
+    Required.Add(MakeShared<FJsonValueString>(TEXT("target")));
+    Required.Add(MakeShared<FJsonValueString>(TEXT("parameters")));
+
+    TSharedPtr<FJsonObject> ParametersSchema = MakeShared<FJsonObject>();
+    ParametersSchema->SetStringField(TEXT("type"), TEXT("object"));
+    ParametersSchema->SetObjectField(TEXT("properties"), Properties);
+    ParametersSchema->SetArrayField(TEXT("required"), Required);
+
+    TSharedPtr<FJsonObject> FunctionObject = MakeShared<FJsonObject>();
+    FunctionObject->SetStringField(TEXT("name"), ToolName);
+    FunctionObject->SetStringField(TEXT("description"), FString::Join(Descriptions, TEXT("\n")));
+    FunctionObject->SetObjectField(TEXT("parameters"), ParametersSchema);
+
+    TSharedPtr<FJsonObject> ToolObject = MakeShared<FJsonObject>();
+    ToolObject->SetStringField(TEXT("type"), TEXT("function"));
+    ToolObject->SetObjectField(TEXT("function"), FunctionObject);
+    m_CachedCommandTools.Add(MakeShared<FJsonValueObject>(ToolObject));
+  }
+
+  return m_CachedCommandTools;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::ResetCommandFormats()
+{
+  m_CachedResponseFormatSchema.Reset();
+  m_CachedCommandTools.Reset();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::UpdateFormatInstructionsMessage(bool bMoveToEnd)
+{
+  // Instructions are the same for conversations with the same commands, they share one buffer
+  const FLLMPromptText NewContent = FLLMPromptText::Intern(GetInstructionsForResponseFormat().ToString());
+
+  const int32 PrevIndex = m_FormatInstructionsContent.IsEmpty()
+    ? INDEX_NONE
+    : m_PromptHistory.IndexOfByPredicate([this](const FLLMStoredPrompt& Stored)
+      {
+        return Stored.Role == ELLMRole::System && Stored.Text == m_FormatInstructionsContent;
+      });
+  m_FormatInstructionsContent = NewContent;
+
+  if(PrevIndex != INDEX_NONE && !bMoveToEnd)
+  {
+    m_PromptHistory[PrevIndex].Text = NewContent;
+    return;
+  }
+
+  // Delete previous message to save context
+  if(PrevIndex != INDEX_NONE)
+  {
+    m_PromptHistory.RemoveAt(PrevIndex);
+  }
+  FLLMStoredPrompt Stored;
+  Stored.Role = ELLMRole::System;
+  Stored.Text = NewContent;
+  m_PromptHistory.Add(MoveTemp(Stored));
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SetRelevantContext(TSharedPtr<const FLLMContextRegistry> Registry, int32 TopK /*= 8 */, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */)
+{
+  m_RelevantContext = Registry;
+  m_RelevantContextTopK = TopK;
+  m_RelevantContextFormat = Format;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::UpdateRelevantContextMessage(const FString& Prompt)
+{
+  // Delete previous message to save context
+  if(!m_RelevantContextContent.IsEmpty())
+  {
+    m_PromptHistory.RemoveAll([this](const FLLMStoredPrompt& Stored)
+    {
+      return Stored.Role == ELLMRole::System && Stored.Text == m_RelevantContextContent;
+    });
+    m_RelevantContextContent = FLLMPromptText();
+  }
+
+  if(!m_RelevantContext.IsValid())
+  {
+    return;
+  }
+
+  // Not interned, the selection differs per prompt
+  m_RelevantContextContent = FLLMPromptText(m_RelevantContext->ToStringRelevant(Prompt, m_RelevantContextTopK, m_RelevantContextFormat));
+  if(!m_RelevantContextContent.IsEmpty())
+  {
+    FLLMStoredPrompt Stored;
+    Stored.Role = ELLMRole::System;
+    Stored.Text = m_RelevantContextContent;
+    m_PromptHistory.Add(MoveTemp(Stored));
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SetOverrideInstructionsForResponseFormatTitle(const FString& Title)
+{
+  m_OverrideInstructionsForResponseFormatTitle = Title;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::AddPromptHistory(const FLLMPromptBase& Prompt)
+{
+  RestorePendingHistory();
+  FLLMStoredPrompt& Stored = m_PromptHistory.Emplace_GetRef(Prompt);
+  if(m_PromptHistory.Num() <= m_ReservedMessages)
+  {
+    Stored.Text = FLLMPromptText::Intern(Stored.Text.GetView());
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::RemovePromptHistory(const FLLMPromptBase& Prompt)
+{
+  RestorePendingHistory();
+  m_PromptHistory.RemoveAll([&Prompt](const FLLMStoredPrompt& Stored)
+  {
+    return Stored == Prompt;
+  });
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::ClearPromptHistory()
+{
+  // The loaded history is dropped without decoding it
+  m_PendingRestore.Reset();
+  m_PromptHistory.Empty();
+  m_FormatInstructionsContent = FLLMPromptText();
+  m_RelevantContextContent = FLLMPromptText();
+}
+
+//----------------------------------------------------------------------
+TArray<FLLMPromptBase> ULLMConversation::GetPromptHistory() const
+{
+  FLLMSavedConversation Pending;
+  if(m_PendingRestore.IsValid())
+  {
+    m_PendingRestore->Read(m_SaveId, Pending);
+  }
+  const TArray<FLLMStoredPrompt>& StoredHistory = m_PendingRestore.IsValid() ? Pending.History : m_PromptHistory;
+
+  TArray<FLLMPromptBase> History;
+  History.Reserve(StoredHistory.Num());
+  for(const FLLMStoredPrompt& Stored : StoredHistory)
+  {
+    History.Add(Stored.ToPrompt());
+  }
+  return History;
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::GetNumPromptHistory() const
+{
+  return m_PendingRestore.IsValid() ? m_PendingRestore->GetNumMessages(m_SaveId) : m_PromptHistory.Num();
+}
+
+//----------------------------------------------------------------------
+int64 ULLMConversation::GetPromptHistoryBytes() const
+{
+  int64 Bytes = m_PromptHistory.GetAllocatedSize();
+  for(const FLLMStoredPrompt& Stored : m_PromptHistory)
+  {
+    Bytes += Stored.Text.GetAllocatedSize() + Stored.ToolCallId.GetAllocatedSize() + Stored.ToolCalls.GetAllocatedSize();
+  }
+  return Bytes;
+}
+
+//----------------------------------------------------------------------
+int64 ULLMConversation::GetUniquePromptHistoryBytes() const
+{
+  int64 Bytes = m_PromptHistory.GetAllocatedSize();
+  for(const FLLMStoredPrompt& Stored : m_PromptHistory)
+  {
+    Bytes += Stored.ToolCallId.GetAllocatedSize() + Stored.ToolCalls.GetAllocatedSize();
+    if(!Stored.Text.IsShared())
+    {
+      Bytes += Stored.Text.GetAllocatedSize();
+    }
+  }
+  return Bytes;
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::GetPromptHistoryTokens() const
+{
+  int32 Tokens = FLLMTokenizer::TokensPerReply;
+  for(const FLLMStoredPrompt& Stored : m_PromptHistory)
+  {
+    Tokens += CountPromptTokens(Stored);
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::CountPromptTokens(const FLLMStoredPrompt& Stored) const
+{
+  const FLLMTokenizer* Tokenizer = m_Connector != nullptr ? m_Connector->GetTokenizer() : nullptr;
+  if(Tokenizer == nullptr)
+  {
+    int32 Tokens = FLLMTokenizer::TokensPerMessage + FLLMPromptNode::EstimateTokenCount(Stored.Text.ToString());
+    for(const FLLMToolCall& ToolCall : Stored.ToolCalls)
+    {
+      Tokens += FLLMPromptNode::EstimateTokenCount(ToolCall.Name) + FLLMPromptNode::EstimateTokenCount(ToolCall.Arguments);
+    }
+    return Tokens;
+  }
+
+  // The stored text is already UTF-8
+  int32 Tokens = FLLMTokenizer::TokensPerMessage + Tokenizer->CountTokens(Stored.Text.GetView());
+  for(const FLLMToolCall& ToolCall : Stored.ToolCalls)
+  {
+    Tokens += Tokenizer->CountTokens(FStringView(ToolCall.Name)) + Tokenizer->CountTokens(FStringView(ToolCall.Arguments));
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::EstimateRequestTokens() const
+{
+  int32 Tokens = GetPromptHistoryTokens();
+  for(const FLLMQueuedPrompt& Queued : m_PromptQueue)
+  {
+    Tokens += FLLMTokenizer::TokensPerMessage + m_Connector->CountTokens(Queued.Prompt.Content);
+  }
+  if(m_Settings->GenerationSettings.bUseMaxTokens)
+  {
+    Tokens += m_Settings->GenerationSettings.MaxTokens;
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::TrimPromptHistory()
+{
+  // Max history messages, reserved ones are for context messages
+  int32 ToRemove = FMath::Max(0, m_PromptHistory.Num() - m_Settings->MaxHistoryMessages - m_ReservedMessages);
+
+  // Then as many of the oldest as needed to fit the token limit, the newest message always stays
+  if(m_Settings->MaxHistoryTokens > 0)
+  {
+    int32 Tokens = FLLMTokenizer::TokensPerReply;
+    TArray<int32, TInlineAllocator<32>> MessageTokens;
+    MessageTokens.SetNumZeroed(m_PromptHistory.Num());
+    for(int32 Index = 0; Index < m_PromptHistory.Num(); ++Index)
+    {
+      // Messages over the count limit are removed anyway
+      if(Index < m_ReservedMessages || Index >= m_ReservedMessages + ToRemove)
+      {
+        MessageTokens[Index] = CountPromptTokens(m_PromptHistory[Index]);
+        Tokens += MessageTokens[Index];
+      }
+    }
+    while(Tokens > m_Settings->MaxHistoryTokens && m_ReservedMessages + ToRemove < m_PromptHistory.Num() - 1)
+    {
+      Tokens -= MessageTokens[m_ReservedMessages + ToRemove];
+      ++ToRemove;
+    }
+  }
+
+  if(ToRemove == 0)
+  {
+    return;
+  }
+  m_PromptHistory.RemoveAt(m_ReservedMessages, ToRemove);
+
+  // A tool result without its assistant tool call is rejected by providers
+  while(m_PromptHistory.IsValidIndex(m_ReservedMessages) && m_PromptHistory[m_ReservedMessages].Role == ELLMRole::Tool)
+  {
+    m_PromptHistory.RemoveAt(m_ReservedMessages);
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SetCountReservedMessages(int32 ReservedNum)
+{
+  RestorePendingHistory();
+  m_ReservedMessages = ReservedNum;
+  InternReservedMessages();
+  if(m_Settings != nullptr && m_Settings->bWarmUpReservedContext)
+  {
+    WarmUpReservedContext();
+  }
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::EstimateWarmUpTokens() const
+{
+  int32 Tokens = 1;
+  for(int32 Index = 0; Index < FMath::Min(m_ReservedMessages, m_PromptHistory.Num()); ++Index)
+  {
+    Tokens += CountPromptTokens(m_PromptHistory[Index]);
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::InternReservedMessages()
+{
+  // The game context is usually the same in many conversations, one-off messages would only fill the intern table
+  for(int32 Index = 0; Index < FMath::Min(m_ReservedMessages, m_PromptHistory.Num()); ++Index)
+  {
+    FLLMStoredPrompt& Stored = m_PromptHistory[Index];
+    Stored.Text = FLLMPromptText::Intern(Stored.Text.GetView());
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::WarmUpReservedContext()
+{
+  // The embedded model has nothing to warm up, and without cache_prompt the llama.cpp slot doesn't keep the prefix
+  if(m_Connector == nullptr || m_ReservedMessages <= 0 || m_PromptHistory.IsEmpty() || m_Connector->IsUsingEmbeddedBackend()
+    || (m_Settings->ApiKey.IsEmpty() && m_Connector->IsApiKeyRequired())
+    || (m_Settings->BackendProfile == ELLMBackendProfile::LlamaCpp && !m_Settings->bCachePrompt))
+  {
+    return;
+  }
+
+  // Sent when no prompt waits for a slot, within the provider limits
+  m_Connector->ScheduleWarmUp(this);
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::DispatchWarmUp()
+{
+  const int32 NumReserved = FMath::Min(m_ReservedMessages, m_PromptHistory.Num());
+  if(NumReserved <= 0)
+  {
+    return;
+  }
+
+  // Tools and response format are part of the cached prefix too, so the payload is the one of the next request cut after the reserved messages
+  TSharedRef<IHttpRequest, ESPMode::ThreadSafe> HttpRequest = CreateHttpRequest();
+  TSharedPtr<FJsonObject> JsonObject = BuildRequestPayload(m_Connector->GetActiveResponseFormatMode(), NumReserved);
+  JsonObject->SetNumberField(TEXT("max_tokens"), 1);
+
+  FString JsonString;
+  TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&JsonString);
+  FJsonSerializer::Serialize(JsonObject.ToSharedRef(), Writer);
+  HttpRequest->SetContentAsString(JsonString);
+  HttpRequest->OnProcessRequestComplete().BindUObject(m_Connector, &ULLMConnectorSubsystem::OnHttpResponse);
+  m_Connector->SendWarmUpRequest(HttpRequest, JsonString, EstimateWarmUpTokens());
+}
+
+//----------------------------------------------------------------------
+int32 ULLMConversation::GetCountReservedMessages() const
+{
+  return m_PendingRestore.IsValid() ? m_PendingRestore->GetReservedMessages(m_SaveId) : m_ReservedMessages;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SetSaveId(FName SaveId)
+{
+  if(SaveId == m_SaveId)
+  {
+    return;
+  }
+  // Keep the history loaded under the previous id
+  RestorePendingHistory();
+  m_SaveId = SaveId;
+  if(m_Connector != nullptr)
+  {
+    m_Connector->AttachLoadedConversation(this);
+  }
+}
+
+//----------------------------------------------------------------------
+FName ULLMConversation::GetSaveId() const
+{
+  return m_SaveId;
+}
+
+//----------------------------------------------------------------------
+bool ULLMConversation::IsRestorePending() const
+{
+  return m_PendingRestore.IsValid();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SetPendingRestore(const TSharedPtr<const FLLMConversationArchive>& Archive)
+{
+  // The save replaces what the conversation had
+  m_PromptHistory.Empty();
+  m_FormatInstructionsContent = FLLMPromptText();
+  m_RelevantContextContent = FLLMPromptText();
+  m_PendingRestore = Archive;
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::RestorePendingHistory()
+{
+  if(!m_PendingRestore.IsValid())
+  {
+    return;
+  }
+
+  FLLMSavedConversation State;
+  const TSharedPtr<const FLLMConversationArchive> Archive = MoveTemp(m_PendingRestore);
+  if(Archive->Read(m_SaveId, State))
+  {
+    RestoreState(MoveTemp(State));
+  }
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SaveState(FLLMSavedConversation& OutState) const
+{
+  if(m_PendingRestore.IsValid())
+  {
+    m_PendingRestore->Read(m_SaveId, OutState);
+    return;
+  }
+
+  OutState.History = m_PromptHistory;
+  OutState.ReservedMessages = m_ReservedMessages;
+  OutState.FormatInstructionsIndex = m_FormatInstructionsContent.IsEmpty() ? INDEX_NONE : m_PromptHistory.IndexOfByPredicate([this](const FLLMStoredPrompt& Stored)
+  {
+    return Stored.Role == ELLMRole::System && Stored.Text == m_FormatInstructionsContent;
+  });
+  OutState.RelevantContextIndex = m_RelevantContextContent.IsEmpty() ? INDEX_NONE : m_PromptHistory.IndexOfByPredicate([this](const FLLMStoredPrompt& Stored)
+  {
+    return Stored.Role == ELLMRole::System && Stored.Text == m_RelevantContextContent;
+  });
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::RestoreState(FLLMSavedConversation&& State)
+{
+  m_PendingRestore.Reset();
+  m_PromptHistory = MoveTemp(State.History);
+  m_ReservedMessages = State.ReservedMessages;
+  m_FormatInstructionsContent = m_PromptHistory.IsValidIndex(State.FormatInstructionsIndex) ? m_PromptHistory[State.FormatInstructionsIndex].Text : FLLMPromptText();
+  m_RelevantContextContent = m_PromptHistory.IsValidIndex(State.RelevantContextIndex) ? m_PromptHistory[State.RelevantContextIndex].Text : FLLMPromptText();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::SetCommandScope(const FLLMCommandScope& Scope)
+{
+  m_CommandScope = Scope;
+  m_bHasCommandScope = true;
+  UpdateCommandScope();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::ClearCommandScope()
+{
+  m_bHasCommandScope = false;
+  m_ScopedCommandSlots.Reset();
+  ResetCommandFormats();
+}
+
+//----------------------------------------------------------------------
+void ULLMConversation::UpdateCommandScope()
+{
+  if(!m_bHasCommandScope || m_Connector == nullptr)
+  {
+    return;
+  }
+
+  const TSparseArray<FLLMRegisteredCommandHandler>& CommandHandlers = m_Connector->m_CommandHandlers;
+
+  TArray<int32> ScopedSlots;
+  const int32 MaxCommands = FMath::Max(1, m_CommandScope.MaxCommands);
+
+  // Global commands first, they don't depend on where the listener is
+  for(const int32 Slot : m_Connector->m_CommandHandlerOrder)
+  {
+    if(ScopedSlots.Num() >= MaxCommands)
+    {
+      break;
+    }
+    const FLLMRegisteredCommandHandler& Entry = CommandHandlers[Slot];
+    if(!Entry.bSpatial && Entry.Handler != nullptr && IsCommandInScopeByTags(Entry, nullptr))
+    {
+      ScopedSlots.Add(Slot);
+    }
+  }
+
+  const AActor* Listener = m_CommandScope.Listener.Get();
+  if(Listener != nullptr && ScopedSlots.Num() < MaxCommands)
+  {
+    m_Connector->RefreshCommandSpatialIndex();
+
+    const FVector Center = Listener->GetActorLocation();
+    const double MaxDistanceSquared = FMath::Square<double>(m_CommandScope.MaxDistance);
+
+    TArray<int32> Candidates;
+    m_Connector->m_CommandSpatialIndex.Query(Center, m_CommandScope.MaxDistance, Candidates);
+
+    // The index may be slightly out of date, distances are checked against current locations
+    TArray<TPair<double, int32>> InRange;
+    for(const int32 Slot : Candidates)
+    {
+      if(!CommandHandlers.IsValidIndex(Slot) || CommandHandlers[Slot].Handler == nullptr)
+      {
+        continue;
+      }
+      const AActor* Actor = CommandHandlers[Slot].Actor.Get();
+      if(Actor == nullptr || Actor == Listener)
+      {
+        continue;
+      }
+      const double DistanceSquared = FVector::DistSquared(Center, Actor->GetActorLocation());
+      if(DistanceSquared <= MaxDistanceSquared && IsCommandInScopeByTags(CommandHandlers[Slot], Actor))
+      {
+        InRange.Emplace(DistanceSquared, Slot);
+      }
+    }
+    InRange.Sort([](const TPair<double, int32>& A, const TPair<double, int32>& B) { return A.Key < B.Key; });
+
+    FVector EyesLocation;
+    FRotator EyesRotation;
+    Listener->GetActorEyesViewPoint(EyesLocation, EyesRotation);
+    UWorld* World = Listener->GetWorld();
+
+    for(const TPair<double, int32>& Candidate : InRange)
+    {
+      if(ScopedSlots.Num() >= MaxCommands)
+      {
+        break;
+      }
+
+      // Traces only for the nearest candidates that can still make it into the scope
+      const AActor* Actor = CommandHandlers[Candidate.Value].Actor.Get();
+      if(m_CommandScope.bRequireLineOfSight && World != nullptr)
+      {
+        FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(LLMCommandScope), false, Listener);
+        QueryParams.AddIgnoredActor(Actor);
+        if(World->LineTraceTestByChannel(EyesLocation, Actor->GetActorLocation(), ECC_Visibility, QueryParams))
+        {
+          continue;
+        }
+      }
+      ScopedSlots.Add(Candidate.Value);
+    }
+  }
+
+  // Registration order keeps the prompt text identical while the same commands are in scope, slot numbers are reused
+  ScopedSlots.Sort([&CommandHandlers](int32 A, int32 B) { return CommandHandlers[A].Serial < CommandHandlers[B].Serial; });
+  if(ScopedSlots != m_ScopedCommandSlots)
+  {
+    m_ScopedCommandSlots = MoveTemp(ScopedSlots);
+    ResetCommandFormats();
+  }
+}
+
+//----------------------------------------------------------------------
+TArray<FLLMCommandStruct> ULLMConversation::GetAdvertisedCommands() const
+{
+  if(m_Connector == nullptr)
+  {
+    return {};
+  }
+  if(!m_bHasCommandScope)
+  {
+    return m_Connector->GetParamsRegisterCommands();
+  }
+
+  const TSparseArray<FLLMRegisteredCommandHandler>& CommandHandlers = m_Connector->m_CommandHandlers;
+
+  TArray<FLLMCommandStruct> ArrParams;
+  ArrParams.Reserve(m_ScopedCommandSlots.Num());
+  for(const int32 Slot : m_ScopedCommandSlots)
+  {
+    if(ULLMCommandHandlerBase* Handler = CommandHandlers.IsValidIndex(Slot) ? CommandHandlers[Slot].Handler : nullptr)
+    {
+      ArrParams.Add(Handler->GetParams());
+    }
+  }
+  return ArrParams;
+}
+
+//----------------------------------------------------------------------
+bool ULLMConversation::IsCommandInScopeByTags(const FLLMRegisteredCommandHandler& Entry, const AActor* Actor) const
+{
+  if(m_CommandScope.RequiredTags.IsEmpty())
+  {
+    return true;
+  }
+
+  const TArray<FName>& CommandTags = Entry.Handler->GetParams().Tags;
+  for(const FName& Tag : m_CommandScope.RequiredTags)
+  {
+    if(CommandTags.Contains(Tag) || (Actor != nullptr && Actor->ActorHasTag(Tag)))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+FString ULLMConversation::GetContextCommands(const FString& InfoText /*= "Available Commands" */, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */) const
+{
+  const TArray<FLLMCommandStruct> Commands = GetAdvertisedCommands();
+
+  FLLMPromptTree PromptTree(Commands.Num() * 4);
+  PromptTree.SetContent(FLLMPromptTree::RootId, InfoText);
+  for(const FLLMCommandStruct& Command : Commands)
+  {
+    const FLLMPromptTree::FNodeId CommandNode = PromptTree.AddChild(FLLMPromptTree::RootId, Command.Name);
+    PromptTree.AddChild(CommandNode, TEXT("Target"), Command.Target);
+    PromptTree.AddChild(CommandNode, TEXT("Description"), Command.Description);
+    if(!Command.ParameterSchema.IsEmpty())
+    {
+      PromptTree.AddChild(CommandNode, TEXT("Parameters"), LLMConversation::GetParameterSignature(Command.ParameterSchema));
+    }
+    if(!Command.Examples.IsEmpty())
+    {
+      const FLLMPromptTree::FNodeId ExamplesNode = PromptTree.AddChild(CommandNode, TEXT("Examples"));
+      for(auto& It : Command.Examples)
+      {
+        PromptTree.AddChild(ExamplesNode, It);
+      }
+    }
+  }
+  return PromptTree.ToString(Format);
+}
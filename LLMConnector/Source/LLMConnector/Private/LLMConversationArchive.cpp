@@ -0,0 +1,433 @@
+﻿#include "LLMConversationArchive.h"
+
+#include "LLMConnectorSubsystem.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+
+namespace LLMConversationArchive
+{
+  // "LLMC"
+  constexpr uint32 Magic = 0x434D4C4C;
+  constexpr uint32 Version = 1;
+
+  enum EMessageFlags : uint8
+  {
+    SharedText = 1 << 0,
+    HasToolCallId = 1 << 1,
+    HasToolCalls = 1 << 2,
+  };
+
+  // Counts, lengths and offsets are mostly small, 7 bits per byte
+  void WriteVarUInt(TArray<uint8>& Out, uint64 Value)
+  {
+    do
+    {
+      uint8 Byte = static_cast<uint8>(Value & 0x7f);
+      Value >>= 7;
+      if(Value != 0)
+      {
+        Byte |= 0x80;
+      }
+      Out.Add(Byte);
+    }
+    while(Value != 0);
+  }
+
+  void WriteUInt32(TArray<uint8>& Out, uint32 Value)
+  {
+    Out.Append(reinterpret_cast<const uint8*>(&Value), sizeof(Value));
+  }
+
+  void WriteUtf8(TArray<uint8>& Out, FUtf8StringView Text)
+  {
+    WriteVarUInt(Out, Text.Len());
+    Out.Append(reinterpret_cast<const uint8*>(Text.GetData()), Text.Len());
+  }
+
+  void WriteString(TArray<uint8>& Out, const FString& Text)
+  {
+    const auto Converted = StringCast<UTF8CHAR>(*Text, Text.Len());
+    WriteUtf8(Out, FUtf8StringView(Converted.Get(), Converted.Length()));
+  }
+
+  // Bounds-checked reading of the data, any error stops the rest
+  struct FReader
+  {
+    const uint8* Data = nullptr;
+    int64 Size = 0;
+    int64 Pos = 0;
+    bool bError = false;
+
+    int64 GetRemaining() const
+    {
+      return Size - Pos;
+    }
+
+    uint8 ReadByte()
+    {
+      if(Pos >= Size)
+      {
+        bError = true;
+        return 0;
+      }
+      return Data[Pos++];
+    }
+
+    uint32 ReadUInt32()
+    {
+      uint32 Value = 0;
+      if(GetRemaining() < static_cast<int64>(sizeof(Value)))
+      {
+        bError = true;
+        return 0;
+      }
+      FMemory::Memcpy(&Value, Data + Pos, sizeof(Value));
+      Pos += sizeof(Value);
+      return Value;
+    }
+
+    uint64 ReadVarUInt()
+    {
+      uint64 Value = 0;
+      for(int32 Shift = 0; Shift < 64 && !bError; Shift += 7)
+      {
+        const uint8 Byte = ReadByte();
+        Value |= static_cast<uint64>(Byte & 0x7f) << Shift;
+        if((Byte & 0x80) == 0)
+        {
+          return Value;
+        }
+      }
+      bError = true;
+      return 0;
+    }
+
+    // Count of elements that take at least one byte each
+    int32 ReadCount()
+    {
+      const uint64 Count = ReadVarUInt();
+      if(Count > static_cast<uint64>(GetRemaining()) || Count > MAX_int32)
+      {
+        bError = true;
+        return 0;
+      }
+      return static_cast<int32>(Count);
+    }
+
+    // View into the data, valid while the archive is
+    FUtf8StringView ReadUtf8()
+    {
+      const uint64 Len = ReadVarUInt();
+      if(bError || Len > static_cast<uint64>(GetRemaining()) || Len > MAX_int32)
+      {
+        bError = true;
+        return FUtf8StringView();
+      }
+      const FUtf8StringView View(reinterpret_cast<const UTF8CHAR*>(Data + Pos), static_cast<int32>(Len));
+      Pos += Len;
+      return View;
+    }
+
+    FString ReadString()
+    {
+      const FUtf8StringView View = ReadUtf8();
+      const auto Converted = StringCast<TCHAR>(View.GetData(), View.Len());
+      return FString(Converted.Length(), Converted.Get());
+    }
+  };
+}
+
+
+
+//----------------------------------------------------------------------
+FLLMConversationArchive::~FLLMConversationArchive()
+{
+  // The region must go before its file
+  m_MappedRegion.Reset();
+  m_MappedFile.Reset();
+}
+
+//----------------------------------------------------------------------
+void FLLMConversationArchive::Write(const TMap<FName, FLLMSavedConversation>& Conversations, TArray<uint8>& OutData)
+{
+  using namespace LLMConversationArchive;
+
+  // Interned texts of different conversations share a buffer, its address identifies them
+  TMap<const UTF8CHAR*, uint32> SharedTextIndices;
+  TArray<FUtf8StringView> SharedTexts;
+  TArray<uint8> Directory;
+  TArray<uint8> Bodies;
+
+  for(const TPair<FName, FLLMSavedConversation>& Pair : Conversations)
+  {
+    const FLLMSavedConversation& Conversation = Pair.Value;
+
+    WriteString(Directory, Pair.Key.ToString());
+    WriteVarUInt(Directory, Bodies.Num());
+    WriteVarUInt(Directory, Conversation.History.Num());
+    WriteVarUInt(Directory, FMath::Max(Conversation.ReservedMessages, 0));
+
+    // INDEX_NONE is stored as 0
+    WriteVarUInt(Bodies, FMath::Max(Conversation.FormatInstructionsIndex + 1, 0));
+    WriteVarUInt(Bodies, FMath::Max(Conversation.RelevantContextIndex + 1, 0));
+
+    for(int32 MessageIndex = 0; MessageIndex < Conversation.History.Num(); ++MessageIndex)
+    {
+      const FLLMStoredPrompt& Message = Conversation.History[MessageIndex];
+      const FUtf8StringView Text = Message.Text.GetView();
+      // The texts the conversation interns, they are loaded interned again
+      const bool bShared = !Text.IsEmpty() && (MessageIndex < Conversation.ReservedMessages || MessageIndex == Conversation.FormatInstructionsIndex);
+
+      uint8 Flags = 0;
+      Flags |= bShared ? SharedText : 0;
+      Flags |= Message.ToolCallId.IsEmpty() ? 0 : HasToolCallId;
+      Flags |= Message.ToolCalls.IsEmpty() ? 0 : HasToolCalls;
+      Bodies.Add(static_cast<uint8>(Message.Role));
+      Bodies.Add(Flags);
+
+      if(bShared)
+      {
+        const uint32 Index = SharedTextIndices.FindOrAdd(Text.GetData(), SharedTexts.Num());
+        if(Index == static_cast<uint32>(SharedTexts.Num()))
+        {
+          SharedTexts.Add(Text);
+        }
+        WriteVarUInt(Bodies, Index);
+      }
+      else
+      {
+        WriteUtf8(Bodies, Text);
+      }
+
+      if(Flags & HasToolCallId)
+      {
+        WriteString(Bodies, Message.ToolCallId);
+      }
+      if(Flags & HasToolCalls)
+      {
+        WriteVarUInt(Bodies, Message.ToolCalls.Num());
+        for(const FLLMToolCall& ToolCall : Message.ToolCalls)
+        {
+          WriteString(Bodies, ToolCall.Id);
+          WriteString(Bodies, ToolCall.Name);
+          WriteString(Bodies, ToolCall.Arguments);
+        }
+      }
+    }
+  }
+
+  OutData.Reset();
+  WriteUInt32(OutData, Magic);
+  WriteUInt32(OutData, Version);
+  WriteVarUInt(OutData, SharedTexts.Num());
+  for(const FUtf8StringView Text : SharedTexts)
+  {
+    WriteUtf8(OutData, Text);
+  }
+  WriteVarUInt(OutData, Conversations.Num());
+  OutData.Append(Directory);
+  OutData.Append(Bodies);
+}
+
+//----------------------------------------------------------------------
+TSharedPtr<FLLMConversationArchive> FLLMConversationArchive::Open(TArray<uint8>&& Data)
+{
+  TSharedPtr<FLLMConversationArchive> Archive(new FLLMConversationArchive());
+  Archive->m_Data = MoveTemp(Data);
+  Archive->m_View = Archive->m_Data.GetData();
+  Archive->m_ViewSize = Archive->m_Data.Num();
+  return Archive->ParseDirectory() ? Archive : nullptr;
+}
+
+//----------------------------------------------------------------------
+TSharedPtr<FLLMConversationArchive> FLLMConversationArchive::OpenFile(const FString& FileName)
+{
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  FOpenMappedResult MappedFile = PlatformFile.OpenMappedEx(*FileName);
+  if(MappedFile.HasValue())
+  {
+    TSharedPtr<FLLMConversationArchive> Archive(new FLLMConversationArchive());
+    Archive->m_MappedFile = MappedFile.StealValue();
+    Archive->m_MappedRegion.Reset(Archive->m_MappedFile->MapRegion());
+    if(Archive->m_MappedRegion.IsValid())
+    {
+      Archive->m_View = Archive->m_MappedRegion->GetMappedPtr();
+      Archive->m_ViewSize = Archive->m_MappedRegion->GetMappedSize();
+      return Archive->ParseDirectory() ? Archive : nullptr;
+    }
+  }
+
+  // No mapped files on this platform
+  TArray<uint8> Data;
+  if(!FFileHelper::LoadFileToArray(Data, *FileName))
+  {
+    UE_LOG(LLM, Warning, TEXT("Can't read conversations from %s"), *FileName);
+    return nullptr;
+  }
+  return Open(MoveTemp(Data));
+}
+
+//----------------------------------------------------------------------
+bool FLLMConversationArchive::ParseDirectory()
+{
+  using namespace LLMConversationArchive;
+
+  FReader Reader{m_View, m_ViewSize};
+  if(Reader.ReadUInt32() != Magic)
+  {
+    UE_LOG(LLM, Error, TEXT("Saved conversations have an unknown format"));
+    return false;
+  }
+  const uint32 DataVersion = Reader.ReadUInt32();
+  if(DataVersion != Version)
+  {
+    UE_LOG(LLM, Error, TEXT("Saved conversations have version %u, expected %u"), DataVersion, Version);
+    return false;
+  }
+
+  const int32 NumTexts = Reader.ReadCount();
+  m_SharedTextViews.Reserve(NumTexts);
+  for(int32 Index = 0; Index < NumTexts && !Reader.bError; ++Index)
+  {
+    m_SharedTextViews.Add(Reader.ReadUtf8());
+  }
+  m_SharedTexts.SetNum(m_SharedTextViews.Num());
+
+  const int32 NumConversations = Reader.ReadCount();
+  m_Entries.Reserve(NumConversations);
+  for(int32 Index = 0; Index < NumConversations && !Reader.bError; ++Index)
+  {
+    const FName SaveId(*Reader.ReadString());
+    FEntry& Entry = m_Entries.Add(SaveId);
+    Entry.Offset = static_cast<int64>(Reader.ReadVarUInt());
+    Entry.NumMessages = Reader.ReadCount();
+    Entry.ReservedMessages = Reader.ReadCount();
+  }
+
+  // Offsets were written from the start of the histories
+  for(TPair<FName, FEntry>& Pair : m_Entries)
+  {
+    Pair.Value.Offset += Reader.Pos;
+    if(Pair.Value.Offset < Reader.Pos || Pair.Value.Offset > m_ViewSize)
+    {
+      Reader.bError = true;
+    }
+  }
+
+  if(Reader.bError)
+  {
+    UE_LOG(LLM, Error, TEXT("Saved conversations are corrupted"));
+    m_Entries.Empty();
+    return false;
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMConversationArchive::GetNumMessages(FName SaveId) const
+{
+  const FEntry* Entry = m_Entries.Find(SaveId);
+  return Entry != nullptr ? Entry->NumMessages : 0;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMConversationArchive::GetReservedMessages(FName SaveId) const
+{
+  const FEntry* Entry = m_Entries.Find(SaveId);
+  return Entry != nullptr ? Entry->ReservedMessages : 0;
+}
+
+//----------------------------------------------------------------------
+FLLMPromptText FLLMConversationArchive::GetSharedText(uint32 Index) const
+{
+  FLLMPromptText& Text = m_SharedTexts[Index];
+  if(Text.IsEmpty())
+  {
+    Text = FLLMPromptText::Intern(m_SharedTextViews[Index]);
+  }
+  return Text;
+}
+
+//----------------------------------------------------------------------
+bool FLLMConversationArchive::Read(FName SaveId, FLLMSavedConversation& OutConversation) const
+{
+  using namespace LLMConversationArchive;
+
+  const FEntry* Entry = m_Entries.Find(SaveId);
+  if(Entry == nullptr)
+  {
+    return false;
+  }
+
+  FReader Reader{m_View, m_ViewSize, Entry->Offset};
+  OutConversation.ReservedMessages = Entry->ReservedMessages;
+  OutConversation.FormatInstructionsIndex = static_cast<int32>(FMath::Min<uint64>(Reader.ReadVarUInt(), MAX_int32)) - 1;
+  OutConversation.RelevantContextIndex = static_cast<int32>(FMath::Min<uint64>(Reader.ReadVarUInt(), MAX_int32)) - 1;
+
+  // Every message takes at least two bytes
+  OutConversation.History.Reset();
+  OutConversation.History.Reserve(FMath::Min<int64>(Entry->NumMessages, Reader.GetRemaining() / 2));
+  for(int32 Index = 0; Index < Entry->NumMessages && !Reader.bError; ++Index)
+  {
+    FLLMStoredPrompt& Message = OutConversation.History.AddDefaulted_GetRef();
+
+    const uint8 Role = Reader.ReadByte();
+    const uint8 Flags = Reader.ReadByte();
+    if(Role > static_cast<uint8>(ELLMRole::Tool))
+    {
+      Reader.bError = true;
+      break;
+    }
+    Message.Role = static_cast<ELLMRole>(Role);
+
+    if(Flags & SharedText)
+    {
+      const uint64 TextIndex = Reader.ReadVarUInt();
+      if(TextIndex >= static_cast<uint64>(m_SharedTextViews.Num()))
+      {
+        Reader.bError = true;
+        break;
+      }
+      Message.Text = GetSharedText(static_cast<uint32>(TextIndex));
+    }
+    else
+    {
+      Message.Text = FLLMPromptText(Reader.ReadUtf8());
+    }
+
+    if(Flags & HasToolCallId)
+    {
+      Message.ToolCallId = Reader.ReadString();
+    }
+    if(Flags & HasToolCalls)
+    {
+      const int32 NumToolCalls = Reader.ReadCount();
+      Message.ToolCalls.Reserve(NumToolCalls);
+      for(int32 ToolCallIndex = 0; ToolCallIndex < NumToolCalls && !Reader.bError; ++ToolCallIndex)
+      {
+        FLLMToolCall& ToolCall = Message.ToolCalls.AddDefaulted_GetRef();
+        ToolCall.Id = Reader.ReadString();
+        ToolCall.Name = Reader.ReadString();
+        ToolCall.Arguments = Reader.ReadString();
+      }
+    }
+  }
+
+  if(Reader.bError)
+  {
+    UE_LOG(LLM, Error, TEXT("Saved conversation %s is corrupted"), *SaveId.ToString());
+    OutConversation = FLLMSavedConversation();
+    return false;
+  }
+
+  if(!OutConversation.History.IsValidIndex(OutConversation.FormatInstructionsIndex))
+  {
+    OutConversation.FormatInstructionsIndex = INDEX_NONE;
+  }
+  if(!OutConversation.History.IsValidIndex(OutConversation.RelevantContextIndex))
+  {
+    OutConversation.RelevantContextIndex = INDEX_NONE;
+  }
+  return true;
+}
@@ -0,0 +1,388 @@
+﻿#include "LLMEmbeddedBackend.h"
+
+#include "LLMConnectorSettings.h"
+#include "LLMConnectorSubsystem.h"
+#include "Async/Async.h"
+#include "Misc/IQueuedWork.h"
+#include "Misc/Paths.h"
+#include "Misc/QueuedThreadPool.h"
+#include "Interfaces/IHttpResponse.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonSerializer.h"
+
+#if WITH_LLM_EMBEDDED_INFERENCE
+THIRD_PARTY_INCLUDES_START
+#include "llama.h"
+THIRD_PARTY_INCLUDES_END
+#endif
+
+namespace LLMEmbeddedBackend
+{
+  // Runs one function on the pool, abandoned work is dropped at shutdown
+  class FWork : public IQueuedWork
+  {
+  public:
+    explicit FWork(TUniqueFunction<void()>&& InFunction)
+      : Function(MoveTemp(InFunction))
+    {}
+
+    virtual void DoThreadedWork() override
+    {
+      Function();
+      delete this;
+    }
+
+    virtual void Abandon() override
+    {
+      delete this;
+    }
+
+  private:
+    TUniqueFunction<void()> Function;
+  };
+
+#if WITH_LLM_EMBEDDED_INFERENCE
+  // Any JSON value, responses must parse like the "json_object" format of the providers
+  const ANSICHAR* JsonGrammar = R"GBNF(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\/bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+ws     ::= | " " | "\n" [ \t]{0,20}
+)GBNF";
+
+  // Null-terminated UTF-8 for the C API
+  TArray<ANSICHAR> ToUtf8(const FString& Text)
+  {
+    const FTCHARToUTF8 Converted(*Text, Text.Len());
+    TArray<ANSICHAR> Result(Converted.Get(), Converted.Length());
+    Result.Add('\0');
+    return Result;
+  }
+
+  FString FromUtf8(const ANSICHAR* Text, int32 Len)
+  {
+    const FUTF8ToTCHAR Converted(Text, Len);
+    return FString(Converted.Length(), Converted.Get());
+  }
+
+  // Length without a multi-byte character cut at the end, a token may hold part of one
+  int32 GetCompleteUtf8Len(const TArray<ANSICHAR>& Text)
+  {
+    const int32 Len = Text.Num();
+    for(int32 Back = 1; Back <= FMath::Min(Len, 4); ++Back)
+    {
+      const uint8 Byte = static_cast<uint8>(Text[Len - Back]);
+      if((Byte & 0xC0) == 0x80)
+      {
+        continue;
+      }
+      const int32 CharLen = (Byte & 0x80) == 0 ? 1 : (Byte & 0xE0) == 0xC0 ? 2 : (Byte & 0xF0) == 0xE0 ? 3 : 4;
+      return CharLen <= Back ? Len : Len - Back;
+    }
+    return Len;
+  }
+
+  float GetNumber(const FJsonObject& Payload, const TCHAR* Field, float Default)
+  {
+    double Value = Default;
+    Payload.TryGetNumberField(Field, Value);
+    return static_cast<float>(Value);
+  }
+#endif
+}
+
+
+
+//----------------------------------------------------------------------
+TSharedPtr<FLLMEmbeddedBackend> FLLMEmbeddedBackend::Create(const ULLMSettings& Settings)
+{
+#if WITH_LLM_EMBEDDED_INFERENCE
+  TSharedPtr<FLLMEmbeddedBackend> Backend(new FLLMEmbeddedBackend());
+  Backend->m_ModelPath = FPaths::ConvertRelativePathToFull(FPaths::ProjectDir(), Settings.EmbeddedModelPath.FilePath);
+  Backend->m_ContextSize = Settings.EmbeddedContextSize;
+  Backend->m_Threads = Settings.EmbeddedThreads > 0 ? Settings.EmbeddedThreads : FPlatformMisc::NumberOfCores();
+
+  // llama.cpp computes with its own threads, the pool only keeps requests off the game thread and in order
+  Backend->m_ThreadPool.Reset(FQueuedThreadPool::Allocate());
+  Backend->m_ThreadPool->Create(1, 1024 * 1024, TPri_Normal, TEXT("LLMEmbeddedBackend"));
+  Backend->QueueWork([Backend = Backend.Get()]()
+  {
+    Backend->LoadModel();
+  });
+  return Backend;
+#else
+  UE_LOG(LLM, Error, TEXT("The plugin is built without llama.cpp, see LLMConnector.Build.cs for the embedded backend"));
+  return nullptr;
+#endif
+}
+
+//----------------------------------------------------------------------
+FLLMEmbeddedBackend::~FLLMEmbeddedBackend()
+{
+  // Generation stops at the next token, queued requests are dropped
+  m_bStopping = true;
+  if(m_ThreadPool.IsValid())
+  {
+    m_ThreadPool->Destroy();
+    m_ThreadPool.Reset();
+  }
+
+#if WITH_LLM_EMBEDDED_INFERENCE
+  if(m_Context != nullptr)
+  {
+    llama_free(m_Context);
+  }
+  if(m_Model != nullptr)
+  {
+    llama_model_free(m_Model);
+    llama_backend_free();
+  }
+#endif
+}
+
+//----------------------------------------------------------------------
+void FLLMEmbeddedBackend::QueueWork(TUniqueFunction<void()>&& Work)
+{
+  m_ThreadPool->AddQueuedWork(new LLMEmbeddedBackend::FWork(MoveTemp(Work)));
+}
+
+//----------------------------------------------------------------------
+void FLLMEmbeddedBackend::Generate(const FString& Payload, FOnLLMEmbeddedToken OnToken, FOnLLMEmbeddedComplete OnComplete)
+{
+#if WITH_LLM_EMBEDDED_INFERENCE
+  QueueWork([this, Payload, OnToken = MoveTemp(OnToken), OnComplete = MoveTemp(OnComplete)]()
+  {
+    FString Content;
+    FString FinishReason;
+    FString Error;
+    const bool bSuccess = GenerateOnWorker(Payload, OnToken, Content, FinishReason, Error);
+
+    // Same shape as a provider response, ProcessLLMResponse reads it unchanged
+    TSharedRef<FJsonObject> Body = MakeShared<FJsonObject>();
+    if(bSuccess)
+    {
+      TSharedRef<FJsonObject> Message = MakeShared<FJsonObject>();
+      Message->SetStringField(TEXT("role"), TEXT("assistant"));
+      Message->SetStringField(TEXT("content"), Content);
+
+      TSharedRef<FJsonObject> Choice = MakeShared<FJsonObject>();
+      Choice->SetNumberField(TEXT("index"), 0);
+      Choice->SetStringField(TEXT("finish_reason"), FinishReason);
+      Choice->SetObjectField(TEXT("message"), Message);
+      TArray<TSharedPtr<FJsonValue>> Choices;
+      Choices.Add(MakeShared<FJsonValueObject>(Choice));
+      Body->SetArrayField(TEXT("choices"), Choices);
+    }
+    else
+    {
+      TSharedRef<FJsonObject> ErrorObject = MakeShared<FJsonObject>();
+      ErrorObject->SetStringField(TEXT("message"), Error);
+      Body->SetObjectField(TEXT("error"), ErrorObject);
+    }
+
+    FString BodyString;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&BodyString);
+    FJsonSerializer::Serialize(Body, Writer);
+
+    const int32 ResponseCode = bSuccess ? EHttpResponseCodes::Ok : EHttpResponseCodes::ServerError;
+    AsyncTask(ENamedThreads::GameThread, [OnComplete, ResponseCode, BodyString = MoveTemp(BodyString)]()
+    {
+      OnComplete.ExecuteIfBound(true, ResponseCode, BodyString);
+    });
+  });
+#else
+  OnComplete.ExecuteIfBound(false, 0, FString());
+#endif
+}
+
+#if WITH_LLM_EMBEDDED_INFERENCE
+//----------------------------------------------------------------------
+void FLLMEmbeddedBackend::LoadModel()
+{
+  llama_backend_init();
+
+  // CPU only, it must run without a GPU
+  llama_model_params ModelParams = llama_model_default_params();
+  ModelParams.n_gpu_layers = 0;
+  m_Model = llama_model_load_from_file(LLMEmbeddedBackend::ToUtf8(m_ModelPath).GetData(), ModelParams);
+  if(m_Model == nullptr)
+  {
+    UE_LOG(LLM, Error, TEXT("Can't load the model %s"), *m_ModelPath);
+    llama_backend_free();
+    return;
+  }
+
+  llama_context_params ContextParams = llama_context_default_params();
+  ContextParams.n_ctx = m_ContextSize;
+  ContextParams.n_threads = m_Threads;
+  ContextParams.n_threads_batch = m_Threads;
+  m_Context = llama_init_from_model(m_Model, ContextParams);
+  if(m_Context == nullptr)
+  {
+    UE_LOG(LLM, Error, TEXT("Can't create a context of %d tokens for %s"), m_ContextSize, *m_ModelPath);
+    return;
+  }
+  UE_LOG(LLM, Log, TEXT("Embedded model %s loaded, %d threads"), *m_ModelPath, m_Threads);
+}
+
+//----------------------------------------------------------------------
+bool FLLMEmbeddedBackend::GenerateOnWorker(const FString& Payload, const FOnLLMEmbeddedToken& OnToken, FString& OutContent, FString& OutFinishReason, FString& OutError)
+{
+  using namespace LLMEmbeddedBackend;
+
+  if(m_Context == nullptr)
+  {
+    OutError = TEXT("The embedded model is not loaded");
+    return false;
+  }
+
+  TSharedPtr<FJsonObject> PayloadObject;
+  const TArray<TSharedPtr<FJsonValue>>* Messages = nullptr;
+  if(!FJsonSerializer::Deserialize(TJsonReaderFactory<>::Create(Payload), PayloadObject) || !PayloadObject.IsValid()
+    || !PayloadObject->TryGetArrayField(TEXT("messages"), Messages))
+  {
+    OutError = TEXT("Invalid request");
+    return false;
+  }
+
+  // Chat template of the model
+  TArray<TArray<ANSICHAR>> Strings;
+  TArray<llama_chat_message> ChatMessages;
+  Strings.Reserve(Messages->Num() * 2);
+  for(const TSharedPtr<FJsonValue>& Value : *Messages)
+  {
+    const TSharedPtr<FJsonObject> Message = Value->AsObject();
+    FString RoleString;
+    FString ContentString;
+    if(!Message.IsValid() || !Message->TryGetStringField(TEXT("role"), RoleString))
+    {
+      continue;
+    }
+    Message->TryGetStringField(TEXT("content"), ContentString);
+    const TArray<ANSICHAR>& Role = Strings.Add_GetRef(ToUtf8(RoleString));
+    const TArray<ANSICHAR>& Text = Strings.Add_GetRef(ToUtf8(ContentString));
+    ChatMessages.Add({Role.GetData(), Text.GetData()});
+  }
+
+  const char* Template = llama_model_chat_template(m_Model, nullptr);
+  TArray<ANSICHAR> Prompt;
+  Prompt.SetNumUninitialized(4096);
+  int32 PromptLen = llama_chat_apply_template(Template, ChatMessages.GetData(), ChatMessages.Num(), true, Prompt.GetData(), Prompt.Num());
+  if(PromptLen > Prompt.Num())
+  {
+    Prompt.SetNumUninitialized(PromptLen);
+    PromptLen = llama_chat_apply_template(Template, ChatMessages.GetData(), ChatMessages.Num(), true, Prompt.GetData(), Prompt.Num());
+  }
+  if(PromptLen < 0)
+  {
+    OutError = TEXT("The model has no usable chat template");
+    return false;
+  }
+
+  const llama_vocab* Vocab = llama_model_get_vocab(m_Model);
+  TArray<llama_token> Tokens;
+  Tokens.SetNumUninitialized(-llama_tokenize(Vocab, Prompt.GetData(), PromptLen, nullptr, 0, true, true));
+  llama_tokenize(Vocab, Prompt.GetData(), PromptLen, Tokens.GetData(), Tokens.Num(), true, true);
+
+  const int32 MaxTokens = PayloadObject->HasField(TEXT("max_tokens")) ? static_cast<int32>(GetNumber(*PayloadObject, TEXT("max_tokens"), 0.0f)) : m_ContextSize;
+  const int32 ContextSize = static_cast<int32>(llama_n_ctx(m_Context));
+  if(Tokens.Num() >= ContextSize)
+  {
+    OutError = FString::Printf(TEXT("The prompt has %d tokens, the context holds %d"), Tokens.Num(), ContextSize);
+    return false;
+  }
+
+  // Keep the cached prefix, at least the last token is evaluated again for its logits
+  int32 Common = 0;
+  while(Common < Tokens.Num() && Common < m_EvaluatedTokens.Num() && Tokens[Common] == m_EvaluatedTokens[Common])
+  {
+    ++Common;
+  }
+  Common = FMath::Min(Common, Tokens.Num() - 1);
+  llama_memory_seq_rm(llama_get_memory(m_Context), 0, Common, -1);
+  m_EvaluatedTokens.SetNum(Common);
+
+  const int32 BatchSize = static_cast<int32>(llama_n_batch(m_Context));
+  for(int32 Start = Common; Start < Tokens.Num(); Start += BatchSize)
+  {
+    const int32 Count = FMath::Min(BatchSize, Tokens.Num() - Start);
+    if(llama_decode(m_Context, llama_batch_get_one(Tokens.GetData() + Start, Count)) != 0)
+    {
+      // The cache is in an unknown state
+      llama_memory_clear(llama_get_memory(m_Context), true);
+      m_EvaluatedTokens.Reset();
+      OutError = TEXT("Prompt evaluation failed");
+      return false;
+    }
+    m_EvaluatedTokens.Append(Tokens.GetData() + Start, Count);
+  }
+
+  // Sampling as requested by the generation settings
+  const float Temperature = GetNumber(*PayloadObject, TEXT("temperature"), 0.8f);
+  llama_sampler* Sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+  if(PayloadObject->HasField(TEXT("response_format")))
+  {
+    llama_sampler_chain_add(Sampler, llama_sampler_init_grammar(Vocab, JsonGrammar, "root"));
+  }
+  llama_sampler_chain_add(Sampler, llama_sampler_init_penalties(64,
+    GetNumber(*PayloadObject, TEXT("repeat_penalty"), 1.0f),
+    GetNumber(*PayloadObject, TEXT("frequency_penalty"), 0.0f),
+    GetNumber(*PayloadObject, TEXT("presence_penalty"), 0.0f)));
+  if(Temperature <= 0.0f)
+  {
+    llama_sampler_chain_add(Sampler, llama_sampler_init_greedy());
+  }
+  else
+  {
+    llama_sampler_chain_add(Sampler, llama_sampler_init_top_k(static_cast<int32>(GetNumber(*PayloadObject, TEXT("top_k"), 40.0f))));
+    llama_sampler_chain_add(Sampler, llama_sampler_init_top_p(GetNumber(*PayloadObject, TEXT("top_p"), 1.0f), 1));
+    llama_sampler_chain_add(Sampler, llama_sampler_init_min_p(GetNumber(*PayloadObject, TEXT("min_p"), 0.0f), 1));
+    llama_sampler_chain_add(Sampler, llama_sampler_init_temp(Temperature));
+    llama_sampler_chain_add(Sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+  }
+
+  TArray<ANSICHAR> Output;
+  int32 StreamedLen = 0;
+  OutFinishReason = TEXT("length");
+  for(int32 Generated = 0; Generated < MaxTokens && !m_bStopping; ++Generated)
+  {
+    llama_token Token = llama_sampler_sample(Sampler, m_Context, -1);
+    if(llama_vocab_is_eog(Vocab, Token))
+    {
+      OutFinishReason = TEXT("stop");
+      break;
+    }
+
+    ANSICHAR Piece[256];
+    const int32 PieceLen = llama_token_to_piece(Vocab, Token, Piece, sizeof(Piece), 0, false);
+    if(PieceLen > 0)
+    {
+      Output.Append(Piece, PieceLen);
+    }
+
+    // Whole characters only
+    const int32 CompleteLen = GetCompleteUtf8Len(Output);
+    if(OnToken.IsBound() && CompleteLen > StreamedLen)
+    {
+      AsyncTask(ENamedThreads::GameThread, [OnToken, Text = FromUtf8(Output.GetData() + StreamedLen, CompleteLen - StreamedLen)]()
+      {
+        OnToken.ExecuteIfBound(Text);
+      });
+      StreamedLen = CompleteLen;
+    }
+
+    if(m_EvaluatedTokens.Num() + 1 >= ContextSize || llama_decode(m_Context, llama_batch_get_one(&Token, 1)) != 0)
+    {
+      break;
+    }
+    m_EvaluatedTokens.Add(Token);
+  }
+  llama_sampler_free(Sampler);
+
+  OutContent = FromUtf8(Output.GetData(), Output.Num());
+  return true;
+}
+#endif
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+
+#ifndef WITH_LLM_EMBEDDED_INFERENCE
+#define WITH_LLM_EMBEDDED_INFERENCE 0
+#endif
+
+class ULLMSettings;
+class FQueuedThreadPool;
+struct llama_model;
+struct llama_context;
+
+DECLARE_DELEGATE_OneParam(FOnLLMEmbeddedToken, const FString& /* Piece */);
+DECLARE_DELEGATE_ThreeParams(FOnLLMEmbeddedComplete, bool /* bSuccess */, int32 /* ResponseCode */, const FString& /* Body */);
+
+
+
+/**
+ * GGUF model run in-process by llama.cpp on the CPU, answers the payloads of the conversations without HTTP
+ * Compiled only WITH_LLM_EMBEDDED_INFERENCE, see LLMConnector.Build.cs
+ * One context on a dedicated thread: requests run in arrival order and the prompt prefix shared with the previous request is not evaluated again
+ */
+class FLLMEmbeddedBackend
+{
+public:
+  ~FLLMEmbeddedBackend();
+
+  // The model loads on the worker thread, requests sent meanwhile wait for it
+  // nullptr if the plugin is built without llama.cpp
+  static TSharedPtr<FLLMEmbeddedBackend> Create(const ULLMSettings& Settings);
+
+  // Payload as sent to ApiURL, the body is a chat completion like the providers return
+  // Delegates are executed on the game thread
+  void Generate(const FString& Payload, FOnLLMEmbeddedToken OnToken, FOnLLMEmbeddedComplete OnComplete);
+
+private:
+  FLLMEmbeddedBackend() = default;
+
+  void QueueWork(TUniqueFunction<void()>&& Work);
+
+#if WITH_LLM_EMBEDDED_INFERENCE
+  // Worker thread
+  void LoadModel();
+  bool GenerateOnWorker(const FString& Payload, const FOnLLMEmbeddedToken& OnToken, FString& OutContent, FString& OutFinishReason, FString& OutError);
+#endif
+
+  FString m_ModelPath;
+  int32 m_ContextSize = 4096;
+  int32 m_Threads = 0;
+
+  TUniquePtr<FQueuedThreadPool> m_ThreadPool;
+  std::atomic<bool> m_bStopping{false};
+
+  llama_model* m_Model = nullptr;
+  llama_context* m_Context = nullptr;
+  // Tokens in the KV cache, the start of the next prompt usually matches them
+  TArray<int32> m_EvaluatedTokens;
+};
@@ -0,0 +1,396 @@
+﻿#include "LLMLenientJson.h"
+
+#include "Dom/JsonObject.h"
+#include "Dom/JsonValue.h"
+#include "Misc/Parse.h"
+
+namespace LLMLenientJson
+{
+  constexpr int32 MaxDepth = 64;
+
+  class FReader
+  {
+  public:
+    explicit FReader(FStringView InText)
+      : Text(InText)
+    {}
+
+    TSharedPtr<FJsonObject> ReadRootObject()
+    {
+      // Fences, "Here is the JSON:" and other text before the object
+      while(Pos < Text.Len() && Text[Pos] != TEXT('{'))
+      {
+        ++Pos;
+      }
+      if(Pos == Text.Len())
+      {
+        Fail(TEXT("no object"));
+        return nullptr;
+      }
+
+      // Whatever follows the object is ignored
+      TSharedPtr<FJsonObject> Object = ReadObject(0);
+      return bFailed ? nullptr : Object;
+    }
+
+    FString GetError() const
+    {
+      return FString::Printf(TEXT("%s at %d"), Error, ErrorPos);
+    }
+
+  private:
+    static bool IsWordChar(TCHAR Character)
+    {
+      return FChar::IsAlnum(Character) || Character == TEXT('_') || Character == TEXT('-') || Character == TEXT('$') || Character == TEXT('.');
+    }
+
+    void Fail(const TCHAR* InError)
+    {
+      if(!bFailed)
+      {
+        bFailed = true;
+        Error = InError;
+        ErrorPos = Pos;
+      }
+    }
+
+    TCHAR Peek() const
+    {
+      return Pos < Text.Len() ? Text[Pos] : TEXT('\0');
+    }
+
+    // A comment after a bare value ends it, "http://host" stays one word
+    bool IsCommentAfterSpace(int32 WordStart) const
+    {
+      return Text[Pos] == TEXT('/') && Pos + 1 < Text.Len() && (Text[Pos + 1] == TEXT('/') || Text[Pos + 1] == TEXT('*'))
+        && (Pos == WordStart || FChar::IsWhitespace(Text[Pos - 1]));
+    }
+
+    // Whitespace, // and /* */ comments
+    void SkipSpace()
+    {
+      while(Pos < Text.Len())
+      {
+        const TCHAR Character = Text[Pos];
+        if(FChar::IsWhitespace(Character))
+        {
+          ++Pos;
+        }
+        else if(Character == TEXT('/') && Pos + 1 < Text.Len() && Text[Pos + 1] == TEXT('/'))
+        {
+          while(Pos < Text.Len() && !FChar::IsLinebreak(Text[Pos]))
+          {
+            ++Pos;
+          }
+        }
+        else if(Character == TEXT('/') && Pos + 1 < Text.Len() && Text[Pos + 1] == TEXT('*'))
+        {
+          const int32 End = Text.RightChop(Pos + 2).Find(TEXT("*/"));
+          Pos = End == INDEX_NONE ? Text.Len() : Pos + 2 + End + 2;
+        }
+        else
+        {
+          break;
+        }
+      }
+    }
+
+    TSharedPtr<FJsonObject> ReadObject(int32 Depth)
+    {
+      if(Depth > MaxDepth)
+      {
+        Fail(TEXT("nested too deep"));
+        return nullptr;
+      }
+
+      ++Pos;
+      TSharedPtr<FJsonObject> Object = MakeShared<FJsonObject>();
+      while(!bFailed)
+      {
+        SkipSpace();
+        const TCHAR Character = Peek();
+        if(Character == TEXT('}'))
+        {
+          ++Pos;
+          return Object;
+        }
+        // Trailing, doubled or missing commas
+        if(Character == TEXT(','))
+        {
+          ++Pos;
+          continue;
+        }
+        if(Character == TEXT('\0'))
+        {
+          Fail(TEXT("object is not closed"));
+          break;
+        }
+
+        FString Key;
+        if(Character == TEXT('"') || Character == TEXT('\''))
+        {
+          Key = ReadString();
+        }
+        else if(IsWordChar(Character))
+        {
+          Key = FString(ReadWord());
+        }
+        else
+        {
+          Fail(TEXT("expected a key"));
+          break;
+        }
+
+        SkipSpace();
+        if(Peek() != TEXT(':') && Peek() != TEXT('='))
+        {
+          Fail(TEXT("expected ':'"));
+          break;
+        }
+        ++Pos;
+
+        TSharedPtr<FJsonValue> Value = ReadValue(Depth + 1, TEXT('}'));
+        if(Value.IsValid())
+        {
+          Object->SetField(MoveTemp(Key), MoveTemp(Value));
+        }
+      }
+      return nullptr;
+    }
+
+    TSharedPtr<FJsonValue> ReadArray(int32 Depth)
+    {
+      if(Depth > MaxDepth)
+      {
+        Fail(TEXT("nested too deep"));
+        return nullptr;
+      }
+
+      ++Pos;
+      TArray<TSharedPtr<FJsonValue>> Values;
+      while(!bFailed)
+      {
+        SkipSpace();
+        const TCHAR Character = Peek();
+        if(Character == TEXT(']'))
+        {
+          ++Pos;
+          return MakeShared<FJsonValueArray>(MoveTemp(Values));
+        }
+        if(Character == TEXT(','))
+        {
+          ++Pos;
+          continue;
+        }
+        if(Character == TEXT('\0'))
+        {
+          Fail(TEXT("array is not closed"));
+          break;
+        }
+
+        TSharedPtr<FJsonValue> Value = ReadValue(Depth + 1, TEXT(']'));
+        if(Value.IsValid())
+        {
+          Values.Add(MoveTemp(Value));
+        }
+      }
+      return nullptr;
+    }
+
+    // Closer ends an unquoted value, e.g. {target: door}
+    TSharedPtr<FJsonValue> ReadValue(int32 Depth, TCHAR Closer)
+    {
+      SkipSpace();
+      const TCHAR Character = Peek();
+      if(Character == TEXT('{'))
+      {
+        TSharedPtr<FJsonObject> Object = ReadObject(Depth);
+        return Object.IsValid() ? MakeShared<FJsonValueObject>(Object) : nullptr;
+      }
+      if(Character == TEXT('['))
+      {
+        return ReadArray(Depth);
+      }
+      if(Character == TEXT('"') || Character == TEXT('\''))
+      {
+        return MakeShared<FJsonValueString>(ReadString());
+      }
+      if(Character == TEXT('\0'))
+      {
+        Fail(TEXT("expected a value"));
+        return nullptr;
+      }
+      return ReadBareValue(Closer);
+    }
+
+    // Numbers, true/false/null in any case, None, or an unquoted string up to the end of the value
+    TSharedPtr<FJsonValue> ReadBareValue(TCHAR Closer)
+    {
+      const int32 Start = Pos;
+      while(Pos < Text.Len() && Text[Pos] != TEXT(',') && Text[Pos] != Closer && !FChar::IsLinebreak(Text[Pos]) && !IsCommentAfterSpace(Start))
+      {
+        ++Pos;
+      }
+      const FStringView Word = Text.Mid(Start, Pos - Start).TrimEnd();
+      if(Word.IsEmpty())
+      {
+        Fail(TEXT("expected a value"));
+        return nullptr;
+      }
+
+      if(Word.Equals(TEXT("true"), ESearchCase::IgnoreCase))
+      {
+        return MakeShared<FJsonValueBoolean>(true);
+      }
+      if(Word.Equals(TEXT("false"), ESearchCase::IgnoreCase))
+      {
+        return MakeShared<FJsonValueBoolean>(false);
+      }
+      if(Word.Equals(TEXT("null"), ESearchCase::IgnoreCase) || Word.Equals(TEXT("None")))
+      {
+        return MakeShared<FJsonValueNull>();
+      }
+
+      double Number = 0.0;
+      if(TryParseNumber(Word, Number))
+      {
+        return MakeShared<FJsonValueNumber>(Number);
+      }
+      return MakeShared<FJsonValueString>(FString(Word));
+    }
+
+    // The whole word must be a number, "5 apples" stays a string
+    static bool TryParseNumber(FStringView Word, double& OutNumber)
+    {
+      TCHAR Buffer[64];
+      if(Word.Len() >= UE_ARRAY_COUNT(Buffer))
+      {
+        return false;
+      }
+
+      bool bHasDigit = false;
+      for(int32 Index = 0; Index < Word.Len(); ++Index)
+      {
+        const TCHAR Character = Word[Index];
+        bHasDigit |= FChar::IsDigit(Character);
+        const bool bSign = (Character == TEXT('-') || Character == TEXT('+'))
+          && (Index == 0 || Word[Index - 1] == TEXT('e') || Word[Index - 1] == TEXT('E'));
+        const bool bExponent = (Character == TEXT('e') || Character == TEXT('E')) && bHasDigit;
+        if(!FChar::IsDigit(Character) && Character != TEXT('.') && !bSign && !bExponent)
+        {
+          return false;
+        }
+        Buffer[Index] = Character;
+      }
+      Buffer[Word.Len()] = TEXT('\0');
+      if(!bHasDigit)
+      {
+        return false;
+      }
+      OutNumber = FCString::Atod(Buffer);
+      return true;
+    }
+
+    FStringView ReadWord()
+    {
+      const int32 Start = Pos;
+      while(Pos < Text.Len() && IsWordChar(Text[Pos]))
+      {
+        ++Pos;
+      }
+      return Text.Mid(Start, Pos - Start);
+    }
+
+    // Single or double quotes, the other quote and raw line breaks are plain characters
+    FString ReadString()
+    {
+      const TCHAR Quote = Text[Pos++];
+      const int32 Start = Pos;
+
+      // Usually there is nothing to unescape
+      while(Pos < Text.Len() && Text[Pos] != Quote && Text[Pos] != TEXT('\\'))
+      {
+        ++Pos;
+      }
+      if(Pos == Text.Len())
+      {
+        Fail(TEXT("string is not closed"));
+        return FString();
+      }
+      if(Text[Pos] == Quote)
+      {
+        return FString(Text.Mid(Start, Pos++ - Start));
+      }
+
+      FString Result;
+      Result.Reserve(Pos - Start + 16);
+      Result.Append(Text.GetData() + Start, Pos - Start);
+      while(Pos < Text.Len())
+      {
+        const TCHAR Character = Text[Pos++];
+        if(Character == Quote)
+        {
+          return Result;
+        }
+        if(Character != TEXT('\\') || Pos == Text.Len())
+        {
+          Result.AppendChar(Character);
+          continue;
+        }
+
+        const TCHAR Escaped = Text[Pos++];
+        switch(Escaped)
+        {
+        case TEXT('n'): Result.AppendChar(TEXT('\n')); break;
+        case TEXT('t'): Result.AppendChar(TEXT('\t')); break;
+        case TEXT('r'): Result.AppendChar(TEXT('\r')); break;
+        case TEXT('b'): Result.AppendChar(TEXT('\b')); break;
+        case TEXT('f'): Result.AppendChar(TEXT('\f')); break;
+        case TEXT('u'): AppendCodeUnit(Result); break;
+        // \" \' \\ \/ and unknown escapes keep the character
+        default: Result.AppendChar(Escaped); break;
+        }
+      }
+
+      Fail(TEXT("string is not closed"));
+      return FString();
+    }
+
+    void AppendCodeUnit(FString& Out)
+    {
+      uint32 CodeUnit = 0;
+      int32 Digits = 0;
+      for(; Digits < 4 && Pos < Text.Len() && FChar::IsHexDigit(Text[Pos]); ++Digits, ++Pos)
+      {
+        CodeUnit = CodeUnit * 16 + FParse::HexDigit(Text[Pos]);
+      }
+      if(Digits == 0)
+      {
+        Out.AppendChar(TEXT('u'));
+        return;
+      }
+      // Surrogate pairs come as two escapes, UTF-16 TCHAR keeps them as they are
+      Out.AppendChar(static_cast<TCHAR>(CodeUnit));
+    }
+
+    FStringView Text;
+    int32 Pos = 0;
+    bool bFailed = false;
+    const TCHAR* Error = TEXT("");
+    int32 ErrorPos = 0;
+  };
+}
+
+
+
+//----------------------------------------------------------------------
+TSharedPtr<FJsonObject> FLLMLenientJson::ParseObject(FStringView Text, FString* OutError /*= nullptr*/)
+{
+  LLMLenientJson::FReader Reader(Text);
+  TSharedPtr<FJsonObject> Object = Reader.ReadRootObject();
+  if(!Object.IsValid() && OutError != nullptr)
+  {
+    *OutError = Reader.GetError();
+  }
+  return Object;
+}
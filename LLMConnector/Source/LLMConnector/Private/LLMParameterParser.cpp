@@ -0,0 +1,248 @@
+﻿#include "LLMParameterParser.h"
+
+
+
+//----------------------------------------------------------------------
+void FLLMParameterParser::Split(FStringView Source, FStringView Delimiter, FViewArray& OutParts, bool bCullEmpty /*= true */)
+{
+  OutParts.Reset();
+  if(Delimiter.IsEmpty())
+  {
+    OutParts.Add(Source);
+    return;
+  }
+
+  while(true)
+  {
+    const int32 Found = Source.Find(Delimiter);
+    const FStringView Part = Found == INDEX_NONE ? Source : Source.Left(Found);
+    if(!bCullEmpty || !Part.IsEmpty())
+    {
+      OutParts.Add(Part);
+    }
+    if(Found == INDEX_NONE)
+    {
+      break;
+    }
+    Source.RightChopInline(Found + Delimiter.Len());
+  }
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::TryParseInt(FStringView Text, int32& OutValue)
+{
+  int32 Index = 0;
+  while(Index < Text.Len() && !FChar::IsDigit(Text[Index]))
+  {
+    ++Index;
+  }
+  if(Index == Text.Len())
+  {
+    return false;
+  }
+
+  const bool bNegative = Index > 0 && Text[Index - 1] == TEXT('-');
+  int64 Value = 0;
+  for(; Index < Text.Len() && FChar::IsDigit(Text[Index]); ++Index)
+  {
+    Value = FMath::Min<int64>(Value * 10 + (Text[Index] - TEXT('0')), MAX_int32);
+  }
+
+  OutValue = static_cast<int32>(bNegative ? -Value : Value);
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::TryParseFloat(FStringView Text, float& OutValue)
+{
+  double Value = 0.0;
+  if(!TryParseDouble(Text, Value))
+  {
+    return false;
+  }
+  OutValue = static_cast<float>(Value);
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::TryParseDouble(FStringView Text, double& OutValue)
+{
+  Text = Text.TrimStartAndEnd();
+
+  // Atod needs a terminated buffer, numbers are short
+  TCHAR Buffer[64];
+  int32 Len = 0;
+  bool bHasDigit = false;
+  for(const TCHAR Character : Text)
+  {
+    const bool bNumberChar = FChar::IsDigit(Character) || Character == TEXT('.') || Character == TEXT('-')
+      || Character == TEXT('+') || ((Character == TEXT('e') || Character == TEXT('E')) && bHasDigit);
+    if(!bNumberChar)
+    {
+      // "5.5sec" - stop after the number, skip anything before it
+      if(bHasDigit)
+      {
+        break;
+      }
+      Len = 0;
+      continue;
+    }
+    if(Len >= UE_ARRAY_COUNT(Buffer) - 1)
+    {
+      break;
+    }
+    Buffer[Len++] = Character;
+    bHasDigit |= FChar::IsDigit(Character);
+  }
+
+  if(!bHasDigit)
+  {
+    return false;
+  }
+  Buffer[Len] = TEXT('\0');
+  OutValue = FCString::Atod(Buffer);
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::TryParseBool(FStringView Text, bool& OutValue)
+{
+  Text = Text.TrimStartAndEnd();
+  if(Text.Equals(TEXT("true"), ESearchCase::IgnoreCase) || Text.Equals(TEXT("yes"), ESearchCase::IgnoreCase)
+    || Text.Equals(TEXT("on"), ESearchCase::IgnoreCase) || Text == TEXT("1"))
+  {
+    OutValue = true;
+    return true;
+  }
+  if(Text.Equals(TEXT("false"), ESearchCase::IgnoreCase) || Text.Equals(TEXT("no"), ESearchCase::IgnoreCase)
+    || Text.Equals(TEXT("off"), ESearchCase::IgnoreCase) || Text == TEXT("0"))
+  {
+    OutValue = false;
+    return true;
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::TryParseVector(FStringView Text, FVector& OutValue)
+{
+  // Numbers are read in order, separators and X=/Y=/Z= labels in between are skipped
+  double Components[3];
+  int32 NumComponents = 0;
+
+  int32 Index = 0;
+  while(Index < Text.Len() && NumComponents < 3)
+  {
+    const int32 Start = Index;
+    while(Index < Text.Len() && (FChar::IsDigit(Text[Index]) || Text[Index] == TEXT('.') || Text[Index] == TEXT('-')
+      || Text[Index] == TEXT('+') || (Index > Start && (Text[Index] == TEXT('e') || Text[Index] == TEXT('E')))))
+    {
+      ++Index;
+    }
+
+    // Large world coordinates don't fit a float
+    double Value = 0.0;
+    if(Index > Start && TryParseDouble(Text.Mid(Start, Index - Start), Value))
+    {
+      Components[NumComponents++] = Value;
+    }
+    else if(Index == Start)
+    {
+      ++Index;
+    }
+  }
+
+  if(NumComponents < 3)
+  {
+    return false;
+  }
+  OutValue = FVector(Components[0], Components[1], Components[2]);
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::TryParseEnum(FStringView Text, TConstArrayView<FString> Values, int32& OutIndex)
+{
+  Text = Text.TrimStartAndEnd();
+  for(int32 Index = 0; Index < Values.Num(); ++Index)
+  {
+    if(Text.Equals(Values[Index], ESearchCase::IgnoreCase))
+    {
+      OutIndex = Index;
+      return true;
+    }
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+FLLMParameterValue FLLMParameterParser::ParseValue(FStringView Text, const FLLMCommandParameter& Parameter)
+{
+  FLLMParameterValue Value;
+  Value.Type = Parameter.Type;
+
+  switch(Parameter.Type)
+  {
+  case ELLMParameterType::String:
+    Value.StringValue = FString(Text.TrimStartAndEnd());
+    Value.bValid = true;
+    break;
+
+  case ELLMParameterType::Int:
+    Value.bValid = TryParseInt(Text, Value.IntValue);
+    Value.FloatValue = Value.IntValue;
+    break;
+
+  case ELLMParameterType::Float:
+    Value.bValid = TryParseFloat(Text, Value.FloatValue);
+    Value.IntValue = FMath::RoundToInt(Value.FloatValue);
+    break;
+
+  case ELLMParameterType::Bool:
+    Value.bValid = TryParseBool(Text, Value.BoolValue);
+    break;
+
+  case ELLMParameterType::Enum:
+    Value.bValid = TryParseEnum(Text, Parameter.EnumValues, Value.EnumIndex);
+    if(Value.bValid)
+    {
+      Value.NameValue = FName(Parameter.EnumValues[Value.EnumIndex]);
+    }
+    break;
+
+  case ELLMParameterType::Vector:
+    Value.bValid = TryParseVector(Text, Value.VectorValue);
+    break;
+
+  case ELLMParameterType::Name:
+    Text = Text.TrimStartAndEnd();
+    Value.bValid = !Text.IsEmpty();
+    Value.NameValue = FName(Text);
+    break;
+  }
+
+  return Value;
+}
+
+//----------------------------------------------------------------------
+bool FLLMParameterParser::ParseParameters(const TArray<FLLMCommandParameter>& Schema, TConstArrayView<FString> Parameters, TArray<FLLMParameterValue>& OutValues)
+{
+  OutValues.Reset(Schema.Num());
+
+  bool bAllRequiredValid = true;
+  for(int32 Index = 0; Index < Schema.Num(); ++Index)
+  {
+    const FLLMCommandParameter& Parameter = Schema[Index];
+    if(Parameters.IsValidIndex(Index))
+    {
+      OutValues.Add(ParseValue(Parameters[Index], Parameter));
+    }
+    else
+    {
+      FLLMParameterValue& Missing = OutValues.AddDefaulted_GetRef();
+      Missing.Type = Parameter.Type;
+    }
+    bAllRequiredValid &= Parameter.bOptional || OutValues.Last().bValid;
+  }
+  return bAllRequiredValid;
+}
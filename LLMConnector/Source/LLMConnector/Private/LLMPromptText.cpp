@@ -0,0 +1,164 @@
+﻿#include "LLMPromptText.h"
+
+#include "Misc/ScopeRWLock.h"
+
+namespace LLMPromptText
+{
+  // Weak, so the table never keeps a text alive; dead entries are dropped while looking up their bucket,
+  // and all of them once the table has doubled since the last sweep
+  struct FInternTable
+  {
+    FRWLock Lock;
+    TMultiMap<uint32, TWeakPtr<const TArray<UTF8CHAR>, ESPMode::ThreadSafe>> Buffers;
+    int32 SweepThreshold = 64;
+  };
+
+  FInternTable& GetInternTable()
+  {
+    static FInternTable Table;
+    return Table;
+  }
+
+  TArray<UTF8CHAR> ToUtf8(FStringView Text)
+  {
+    const auto Converted = StringCast<UTF8CHAR>(Text.GetData(), Text.Len());
+    return TArray<UTF8CHAR>(Converted.Get(), Converted.Length());
+  }
+}
+
+
+
+//----------------------------------------------------------------------
+FLLMPromptText::FLLMPromptText(FStringView Text)
+{
+  if(!Text.IsEmpty())
+  {
+    m_Data = MakeShared<FBuffer, ESPMode::ThreadSafe>(LLMPromptText::ToUtf8(Text));
+  }
+}
+
+//----------------------------------------------------------------------
+FLLMPromptText::FLLMPromptText(FUtf8StringView Text)
+{
+  if(!Text.IsEmpty())
+  {
+    m_Data = MakeShared<FBuffer, ESPMode::ThreadSafe>(Text.GetData(), Text.Len());
+  }
+}
+
+//----------------------------------------------------------------------
+FLLMPromptText FLLMPromptText::Intern(FStringView Text)
+{
+  return Text.IsEmpty() ? FLLMPromptText() : InternBuffer(LLMPromptText::ToUtf8(Text));
+}
+
+//----------------------------------------------------------------------
+FLLMPromptText FLLMPromptText::Intern(FUtf8StringView Text)
+{
+  return Text.IsEmpty() ? FLLMPromptText() : InternBuffer(FBuffer(Text.GetData(), Text.Len()));
+}
+
+//----------------------------------------------------------------------
+FLLMPromptText FLLMPromptText::InternBuffer(FBuffer&& Utf8)
+{
+  const FUtf8StringView View(Utf8.GetData(), Utf8.Num());
+  const uint32 Hash = FCrc::MemCrc32(Utf8.GetData(), Utf8.Num());
+
+  LLMPromptText::FInternTable& Table = LLMPromptText::GetInternTable();
+  auto FindInBucket = [&Table, Hash, View](bool bRemoveExpired)
+  {
+    TSharedPtr<const FBuffer, ESPMode::ThreadSafe> Found;
+    for(auto It = Table.Buffers.CreateKeyIterator(Hash); It; ++It)
+    {
+      TSharedPtr<const FBuffer, ESPMode::ThreadSafe> Buffer = It.Value().Pin();
+      if(!Buffer.IsValid())
+      {
+        if(bRemoveExpired)
+        {
+          It.RemoveCurrent();
+        }
+        continue;
+      }
+      if(!Found.IsValid() && FUtf8StringView(Buffer->GetData(), Buffer->Num()).Equals(View, ESearchCase::CaseSensitive))
+      {
+        Found = MoveTemp(Buffer);
+      }
+    }
+    return Found;
+  };
+
+  {
+    FReadScopeLock ReadLock(Table.Lock);
+    if(TSharedPtr<const FBuffer, ESPMode::ThreadSafe> Existing = FindInBucket(false))
+    {
+      return FLLMPromptText(MoveTemp(Existing));
+    }
+  }
+
+  // Another thread may have added it between the locks
+  FWriteScopeLock WriteLock(Table.Lock);
+  if(TSharedPtr<const FBuffer, ESPMode::ThreadSafe> Existing = FindInBucket(true))
+  {
+    return FLLMPromptText(MoveTemp(Existing));
+  }
+
+  if(Table.Buffers.Num() >= Table.SweepThreshold)
+  {
+    for(auto It = Table.Buffers.CreateIterator(); It; ++It)
+    {
+      if(!It.Value().IsValid())
+      {
+        It.RemoveCurrent();
+      }
+    }
+    Table.SweepThreshold = FMath::Max(64, Table.Buffers.Num() * 2);
+  }
+
+  TSharedPtr<const FBuffer, ESPMode::ThreadSafe> Buffer = MakeShared<FBuffer, ESPMode::ThreadSafe>(MoveTemp(Utf8));
+  Table.Buffers.Add(Hash, Buffer);
+  return FLLMPromptText(MoveTemp(Buffer));
+}
+
+//----------------------------------------------------------------------
+FString FLLMPromptText::ToString() const
+{
+  if(IsEmpty())
+  {
+    return FString();
+  }
+  const auto Converted = StringCast<TCHAR>(m_Data->GetData(), m_Data->Num());
+  return FString(Converted.Length(), Converted.Get());
+}
+
+//----------------------------------------------------------------------
+bool FLLMPromptText::Equals(FStringView Text) const
+{
+  // Cheap rejection by length before converting
+  const FUtf8StringView View = GetView();
+  if(View.Len() < Text.Len())
+  {
+    return false;
+  }
+  const auto Converted = StringCast<UTF8CHAR>(Text.GetData(), Text.Len());
+  return View.Equals(FUtf8StringView(Converted.Get(), Converted.Length()), ESearchCase::CaseSensitive);
+}
+
+
+
+//----------------------------------------------------------------------
+FLLMStoredPrompt::FLLMStoredPrompt(const FLLMPromptBase& Prompt)
+  : Role(Prompt.Role)
+  , Text(Prompt.Content)
+  , ToolCalls(Prompt.ToolCalls)
+  , ToolCallId(Prompt.ToolCallId)
+{
+}
+
+//----------------------------------------------------------------------
+FLLMPromptBase FLLMStoredPrompt::ToPrompt() const
+{
+  FLLMPromptBase Prompt(Role, Text.ToString());
+  Prompt.ToolCalls = ToolCalls;
+  Prompt.ToolCallId = ToolCallId;
+  return Prompt;
+}
@@ -0,0 +1,139 @@
+﻿#include "LLMPromptTree.h"
+
+#include "LLMPromptWriter.h"
+
+
+
+/**
+ * FLLMPromptTree adapter for TLLMPromptWriter
+ */
+struct FLLMPromptTreeView
+{
+  using FNodeRef = FLLMPromptTree::FNodeId;
+
+  const FLLMPromptTree& Tree;
+
+  FStringView GetContent(FNodeRef Node) const
+  {
+    return Tree.GetContent(Node);
+  }
+
+  int32 NumChildren(FNodeRef Node) const
+  {
+    return Tree.NumChildren(Node);
+  }
+
+  template <typename FuncType>
+  void ForEachChild(FNodeRef Node, FuncType&& Func) const
+  {
+    Tree.ForEachChild(Node, Forward<FuncType>(Func));
+  }
+};
+
+
+
+//----------------------------------------------------------------------
+FLLMPromptTree::FLLMPromptTree(int32 ExpectedNodes /*= 0 */, int32 ExpectedChars /*= 0 */)
+{
+  Nodes.Reserve(FMath::Max(ExpectedNodes, 1));
+  TextPool.Reserve(ExpectedChars);
+  Nodes.AddDefaulted();// Root
+}
+
+//----------------------------------------------------------------------
+FLLMPromptTree::FNodeId FLLMPromptTree::AddChild(FNodeId Parent, FStringView Key, FStringView Content /*= FStringView() */)
+{
+  check(Nodes.IsValidIndex(Parent));
+
+  const FNodeId NewId = Nodes.AddDefaulted();
+  FNode& NewNode = Nodes[NewId];
+  NewNode.Key = AddText(Key);
+  NewNode.Content = AddText(Content);
+
+  // Append to the sibling list
+  FNode& ParentNode = Nodes[Parent];
+  if(ParentNode.LastChild != INDEX_NONE)
+  {
+    Nodes[ParentNode.LastChild].NextSibling = NewId;
+  }
+  else
+  {
+    ParentNode.FirstChild = NewId;
+  }
+  ParentNode.LastChild = NewId;
+  ++ParentNode.NumChildren;
+
+  return NewId;
+}
+
+//----------------------------------------------------------------------
+FLLMPromptTree::FNodeId FLLMPromptTree::AddNode(FNodeId Parent, FStringView Key, const FLLMPromptNode& Node)
+{
+  const FNodeId NewId = AddChild(Parent, Key, Node.ContentText);
+  for(const auto& Child : Node.Children)
+  {
+    AddNode(NewId, Child.Key, *Child.Value);
+  }
+  return NewId;
+}
+
+//----------------------------------------------------------------------
+FLLMPromptTree::FNodeId FLLMPromptTree::GetOrAddChild(FNodeId Parent, FStringView Key)
+{
+  const FNodeId Found = FindChild(Parent, Key);
+  return Found != INDEX_NONE ? Found : AddChild(Parent, Key);
+}
+
+//----------------------------------------------------------------------
+FLLMPromptTree::FNodeId FLLMPromptTree::FindChild(FNodeId Parent, FStringView Key) const
+{
+  for(FNodeId Child = Nodes[Parent].FirstChild; Child != INDEX_NONE; Child = Nodes[Child].NextSibling)
+  {
+    if(GetKey(Child).Equals(Key, ESearchCase::IgnoreCase))
+    {
+      return Child;
+    }
+  }
+  return INDEX_NONE;
+}
+
+//----------------------------------------------------------------------
+void FLLMPromptTree::SetContent(FNodeId Node, FStringView Content)
+{
+  // Previous text stays in the pool until Reset
+  Nodes[Node].Content = AddText(Content);
+}
+
+//----------------------------------------------------------------------
+void FLLMPromptTree::Reset()
+{
+  Nodes.Reset();
+  TextPool.Reset();
+  Nodes.AddDefaulted();
+}
+
+//----------------------------------------------------------------------
+void FLLMPromptTree::WriteTo(FStringBuilderBase& Out, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */) const
+{
+  FLLMPromptTreeView View{*this};
+  TLLMPromptWriter<FLLMPromptTreeView> Writer(View, Out);
+  Writer.Write(RootId, Format);
+}
+
+//----------------------------------------------------------------------
+FString FLLMPromptTree::ToString(ELLMPromptFormat Format /*= ELLMPromptFormat::Indented */) const
+{
+  TStringBuilder<4096> Builder;
+  WriteTo(Builder, Format);
+  return FString(Builder.Len(), Builder.GetData());
+}
+
+//----------------------------------------------------------------------
+FLLMPromptTree::FTextSpan FLLMPromptTree::AddText(FStringView Text)
+{
+  FTextSpan Span;
+  Span.Offset = TextPool.Num();
+  Span.Len = Text.Len();
+  TextPool.Append(Text.GetData(), Text.Len());
+  return Span;
+}
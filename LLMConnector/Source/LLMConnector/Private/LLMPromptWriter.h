@@ -0,0 +1,330 @@
+﻿#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+#include "Misc/StringBuilder.h"
+
+
+
+/**
+ * Single-pass renderer shared by FLLMPromptNode and FLLMPromptTree
+ * TView provides FNodeRef, GetContent(Node), NumChildren(Node) and ForEachChild(Node, Func(Key, Child))
+ */
+template <typename TView>
+class TLLMPromptWriter
+{
+public:
+  using FNodeRef = typename TView::FNodeRef;
+
+  TLLMPromptWriter(const TView& InView, FStringBuilderBase& InOut)
+    : View(InView)
+    , Out(InOut)
+  {}
+
+  // Indent only applies to the Indented layout
+  void Write(FNodeRef Root, ELLMPromptFormat Format, int32 Indent = 0)
+  {
+    switch(Format)
+    {
+    case ELLMPromptFormat::Indented:
+      WriteIndented(Root, Indent);
+      break;
+
+    case ELLMPromptFormat::Minified:
+      WriteMinified(Root);
+      break;
+
+    case ELLMPromptFormat::CompactJson:
+      WriteJsonObject(Root);
+      break;
+
+    case ELLMPromptFormat::AbbreviatedKeys:
+      BuildAbbreviations(Root);
+      WriteMinified(Root);
+      break;
+    }
+  }
+
+private:
+  // Same layout FLLMPromptNode::ToString always had
+  void WriteIndented(FNodeRef Node, int32 Indent)
+  {
+    const FStringView Content = View.GetContent(Node);
+
+    // If node has content but no children - output as key-value pair on one line
+    if(!Content.IsEmpty() && View.NumChildren(Node) == 0)
+    {
+      AppendIndent(Indent);
+      Out << Content;
+      return;
+    }
+
+    // If node has content - output it on separate line
+    if(!Content.IsEmpty())
+    {
+      AppendIndent(Indent);
+      Out << Content;
+      Out.AppendChar(TEXT('\n'));
+    }
+
+    View.ForEachChild(Node, [this, Indent](FStringView Key, FNodeRef Child)
+    {
+      AppendIndent(Indent + 2);
+      Out << Key;
+
+      // If child has no children - output as key-value pair on one line
+      if(View.NumChildren(Child) == 0)
+      {
+        const FStringView ChildContent = View.GetContent(Child);
+        if(!ChildContent.IsEmpty())
+        {
+          Out << TEXT(": ") << ChildContent;
+        }
+        Out.AppendChar(TEXT('\n'));
+      }
+      else
+      {
+        // If child has children - output hierarchically
+        Out << TEXT(":\n");
+        WriteIndented(Child, Indent + 4);
+      }
+    });
+  }
+
+  void WriteMinified(FNodeRef Root)
+  {
+    if(!Legend.IsEmpty())
+    {
+      Out << Legend;
+      Out.AppendChar(TEXT('\n'));
+    }
+
+    const FStringView Content = View.GetContent(Root);
+    Out << Content;
+    if(!Content.IsEmpty() && View.NumChildren(Root) > 0)
+    {
+      Out.AppendChar(TEXT('\n'));
+    }
+    WriteMinifiedChildren(Root, TEXT('\n'));
+  }
+
+  // Keys of a nested child are separated by ';', top level children by new lines
+  void WriteMinifiedChildren(FNodeRef Node, TCHAR Separator)
+  {
+    bool bFirst = true;
+    View.ForEachChild(Node, [this, Separator, &bFirst](FStringView Key, FNodeRef Child)
+    {
+      if(!bFirst)
+      {
+        Out.AppendChar(Separator);
+      }
+      bFirst = false;
+
+      AppendKey(Key);
+
+      const FStringView ChildContent = View.GetContent(Child);
+      if(View.NumChildren(Child) == 0)
+      {
+        if(!ChildContent.IsEmpty())
+        {
+          Out.AppendChar(TEXT(':'));
+          Out << ChildContent;
+        }
+        return;
+      }
+
+      Out.AppendChar(TEXT('{'));
+      if(!ChildContent.IsEmpty())
+      {
+        Out << ChildContent;
+        Out.AppendChar(TEXT(';'));
+      }
+      WriteMinifiedChildren(Child, TEXT(';'));
+      Out.AppendChar(TEXT('}'));
+    });
+  }
+
+  // Content of a node with children goes to "_"
+  void WriteJsonObject(FNodeRef Node)
+  {
+    Out.AppendChar(TEXT('{'));
+    bool bFirst = true;
+
+    const FStringView Content = View.GetContent(Node);
+    if(!Content.IsEmpty())
+    {
+      Out << TEXT("\"_\":");
+      AppendJsonString(Content);
+      bFirst = false;
+    }
+
+    View.ForEachChild(Node, [this, &bFirst](FStringView Key, FNodeRef Child)
+    {
+      if(!bFirst)
+      {
+        Out.AppendChar(TEXT(','));
+      }
+      bFirst = false;
+
+      AppendJsonString(Key);
+      Out.AppendChar(TEXT(':'));
+      if(View.NumChildren(Child) == 0)
+      {
+        AppendJsonString(View.GetContent(Child));
+      }
+      else
+      {
+        WriteJsonObject(Child);
+      }
+    });
+    Out.AppendChar(TEXT('}'));
+  }
+
+  void AppendJsonString(FStringView Text)
+  {
+    Out.AppendChar(TEXT('"'));
+    for(const TCHAR Character : Text)
+    {
+      switch(Character)
+      {
+      case TEXT('"'):  Out << TEXT("\\\""); break;
+      case TEXT('\\'): Out << TEXT("\\\\"); break;
+      case TEXT('\n'): Out << TEXT("\\n"); break;
+      case TEXT('\r'): Out << TEXT("\\r"); break;
+      case TEXT('\t'): Out << TEXT("\\t"); break;
+      default:
+        if(Character < 0x20)
+        {
+          Out.Appendf(TEXT("\\u%04x"), static_cast<int32>(Character));
+        }
+        else
+        {
+          Out.AppendChar(Character);
+        }
+      }
+    }
+    Out.AppendChar(TEXT('"'));
+  }
+
+  void AppendKey(FStringView Key)
+  {
+    if(!Abbreviations.IsEmpty())
+    {
+      if(const FString* ShortKey = Abbreviations.Find(FString(Key)))
+      {
+        Out << *ShortKey;
+        return;
+      }
+    }
+    Out << Key;
+  }
+
+  void AppendIndent(int32 Num)
+  {
+    static constexpr TCHAR Spaces[] = TEXT("                                ");
+    static constexpr int32 SpacesLen = UE_ARRAY_COUNT(Spaces) - 1;
+    for(; Num > 0; Num -= SpacesLen)
+    {
+      Out.Append(Spaces, FMath::Min(Num, SpacesLen));
+    }
+  }
+
+  void CountKeys(FNodeRef Node, TMap<FString, int32>& OutKeyCounts)
+  {
+    View.ForEachChild(Node, [this, &OutKeyCounts](FStringView Key, FNodeRef Child)
+    {
+      ++OutKeyCounts.FindOrAdd(FString(Key));
+      CountKeys(Child, OutKeyCounts);
+    });
+  }
+
+  // Only repeated keys that actually save characters after paying for the legend entry
+  void BuildAbbreviations(FNodeRef Root)
+  {
+    TMap<FString, int32> KeyCounts;
+    CountKeys(Root, KeyCounts);
+
+    // Sorted so the legend doesn't depend on hash order
+    KeyCounts.KeySort(TLess<FString>());
+
+    TSet<FString> UsedCodes;
+    for(const auto& Pair : KeyCounts)
+    {
+      const FString& Key = Pair.Key;
+      if(Pair.Value < 2 || Key.Len() <= 3)
+      {
+        continue;
+      }
+
+      // Initials of words, or the first two letters of a single word
+      TArray<FString> Words;
+      Key.ParseIntoArrayWS(Words);
+      FString Code;
+      if(Words.Num() > 1)
+      {
+        for(const FString& Word : Words)
+        {
+          Code += FChar::ToUpper(Word[0]);
+        }
+      }
+      else
+      {
+        Code = Key.Left(2);
+      }
+
+      FString UniqueCode = Code;
+      for(int32 Suffix = 2; UsedCodes.Contains(UniqueCode) || KeyCounts.Contains(UniqueCode); ++Suffix)
+      {
+        UniqueCode = Code + FString::FromInt(Suffix);
+      }
+
+      const int32 Saved = (Key.Len() - UniqueCode.Len()) * Pair.Value;
+      const int32 LegendCost = Key.Len() + UniqueCode.Len() + 2;
+      if(Saved <= LegendCost)
+      {
+        continue;
+      }
+
+      UsedCodes.Add(UniqueCode);
+      Abbreviations.Add(Key, UniqueCode);
+      Legend += Legend.IsEmpty() ? TEXT("Keys: ") : TEXT(", ");
+      Legend += UniqueCode + TEXT("=") + Key;
+    }
+  }
+
+  const TView& View;
+  FStringBuilderBase& Out;
+
+  // AbbreviatedKeys only
+  TMap<FString, FString> Abbreviations;
+  FString Legend;
+};
+
+
+
+/**
+ * FLLMPromptNode adapter for TLLMPromptWriter
+ */
+struct FLLMPromptNodeView
+{
+  using FNodeRef = const FLLMPromptNode*;
+
+  FStringView GetContent(FNodeRef Node) const
+  {
+    return Node->ContentText;
+  }
+
+  int32 NumChildren(FNodeRef Node) const
+  {
+    return Node->Children.Num();
+  }
+
+  template <typename FuncType>
+  void ForEachChild(FNodeRef Node, FuncType&& Func) const
+  {
+    for(const auto& Child : Node->Children)
+    {
+      Func(FStringView(Child.Key), static_cast<FNodeRef>(Child.Value.Get()));
+    }
+  }
+};
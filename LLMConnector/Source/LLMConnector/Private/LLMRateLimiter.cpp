@@ -0,0 +1,240 @@
+﻿#include "LLMRateLimiter.h"
+
+#include "LLMConnectorSubsystem.h"
+#include "Interfaces/IHttpResponse.h"
+
+namespace LLMRateLimiter
+{
+  // Without Retry-After a 429 holds the requests back this long
+  constexpr double DefaultRetrySeconds = 1.0;
+
+  bool TryGetHeaderNumber(const IHttpResponse& Response, const TCHAR* Header, double& OutValue)
+  {
+    const FString Value = Response.GetHeader(Header);
+    if(Value.IsEmpty() || !FChar::IsDigit(Value[0]))
+    {
+      return false;
+    }
+    OutValue = FCString::Atod(*Value);
+    return true;
+  }
+}
+
+
+
+//----------------------------------------------------------------------
+double FLLMRateLimiter::FBucket::GetAvailable(double Now) const
+{
+  return FMath::Min(Capacity, Available + (Now - Time) * Capacity / 60.0);
+}
+
+//----------------------------------------------------------------------
+double FLLMRateLimiter::FBucket::GetWaitSeconds(double Amount, double Now) const
+{
+  if(!IsLimited())
+  {
+    return 0.0;
+  }
+  // A request larger than the whole minute would never fit, it goes when the bucket is full
+  const double Missing = FMath::Min(Amount, Capacity) - GetAvailable(Now);
+  return Missing > 0.0 ? Missing * 60.0 / Capacity : 0.0;
+}
+
+//----------------------------------------------------------------------
+void FLLMRateLimiter::FBucket::Take(double Amount, double Now)
+{
+  if(IsLimited())
+  {
+    Available = GetAvailable(Now) - Amount;
+    Time = Now;
+  }
+}
+
+//----------------------------------------------------------------------
+void FLLMRateLimiter::FBucket::SetLimit(double Limit, double Now)
+{
+  if(Limit <= 0.0 || Limit == Capacity)
+  {
+    return;
+  }
+  // A new limit starts full, the remaining header corrects it
+  Available = IsLimited() ? FMath::Min(GetAvailable(Now), Limit) : Limit;
+  Capacity = Limit;
+  Time = Now;
+}
+
+//----------------------------------------------------------------------
+void FLLMRateLimiter::FBucket::SetRemaining(double Remaining, double Now)
+{
+  if(IsLimited())
+  {
+    Available = FMath::Min(Remaining, Capacity);
+    Time = Now;
+  }
+}
+
+//----------------------------------------------------------------------
+void FLLMRateLimiter::Configure(int32 RequestsPerMinute, int32 TokensPerMinute, double Now)
+{
+  m_Requests = FBucket();
+  m_Tokens = FBucket();
+  m_Requests.SetLimit(RequestsPerMinute, Now);
+  m_Tokens.SetLimit(TokensPerMinute, Now);
+  m_BlockedUntil = 0.0;
+}
+
+//----------------------------------------------------------------------
+double FLLMRateLimiter::GetWaitSeconds(int32 Tokens, double Now) const
+{
+  return FMath::Max3(m_BlockedUntil - Now, m_Requests.GetWaitSeconds(1.0, Now), m_Tokens.GetWaitSeconds(Tokens, Now));
+}
+
+//----------------------------------------------------------------------
+void FLLMRateLimiter::OnRequestSent(int32 Tokens, double Now)
+{
+  m_Requests.Take(1.0, Now);
+  m_Tokens.Take(Tokens, Now);
+}
+
+//----------------------------------------------------------------------
+void FLLMRateLimiter::UpdateFromResponse(const IHttpResponse& Response, double Now)
+{
+  using namespace LLMRateLimiter;
+
+  // OpenAI style per-minute limits, or one request limit as OpenRouter sends it
+  double Value = 0.0;
+  if(TryGetHeaderNumber(Response, TEXT("x-ratelimit-limit-requests"), Value) || TryGetHeaderNumber(Response, TEXT("x-ratelimit-limit"), Value))
+  {
+    m_Requests.SetLimit(Value, Now);
+  }
+  if(TryGetHeaderNumber(Response, TEXT("x-ratelimit-limit-tokens"), Value))
+  {
+    m_Tokens.SetLimit(Value, Now);
+  }
+
+  // The provider knows what the other clients of the key used
+  const auto ApplyRemaining = [this, &Response, Now](FBucket& Bucket, const TCHAR* RemainingHeader, const TCHAR* ResetHeader)
+  {
+    double Remaining = 0.0;
+    if(!TryGetHeaderNumber(Response, RemainingHeader, Remaining))
+    {
+      return false;
+    }
+    Bucket.SetRemaining(Remaining, Now);
+
+    double ResetSeconds = 0.0;
+    if(Remaining < 1.0 && ParseResetSeconds(Response.GetHeader(ResetHeader), Now, ResetSeconds))
+    {
+      m_BlockedUntil = FMath::Max(m_BlockedUntil, Now + ResetSeconds);
+    }
+    return true;
+  };
+  if(!ApplyRemaining(m_Requests, TEXT("x-ratelimit-remaining-requests"), TEXT("x-ratelimit-reset-requests")))
+  {
+    ApplyRemaining(m_Requests, TEXT("x-ratelimit-remaining"), TEXT("x-ratelimit-reset"));
+  }
+  ApplyRemaining(m_Tokens, TEXT("x-ratelimit-remaining-tokens"), TEXT("x-ratelimit-reset-tokens"));
+
+  if(Response.GetResponseCode() == EHttpResponseCodes::TooManyRequests)
+  {
+    // Seconds, or an HTTP date
+    const FString RetryAfter = Response.GetHeader(TEXT("Retry-After"));
+    double RetrySeconds = DefaultRetrySeconds;
+    FDateTime RetryTime;
+    if(!RetryAfter.IsEmpty() && FChar::IsDigit(RetryAfter[0]))
+    {
+      RetrySeconds = FCString::Atod(*RetryAfter);
+    }
+    else if(FDateTime::ParseHttpDate(RetryAfter, RetryTime))
+    {
+      RetrySeconds = (RetryTime - FDateTime::UtcNow()).GetTotalSeconds();
+    }
+    m_BlockedUntil = FMath::Max(m_BlockedUntil, Now + FMath::Max(RetrySeconds, 0.0));
+    UE_LOG(LLM, Warning, TEXT("Rate limited by the provider, requests wait %.1f seconds"), m_BlockedUntil - Now);
+  }
+}
+
+//----------------------------------------------------------------------
+FLLMRateLimitHeadroom FLLMRateLimiter::GetHeadroom(double Now) const
+{
+  FLLMRateLimitHeadroom Headroom;
+  Headroom.WaitSeconds = static_cast<float>(FMath::Max(m_BlockedUntil - Now, 0.0));
+  if(m_Requests.IsLimited())
+  {
+    const double Available = FMath::Max(m_Requests.GetAvailable(Now), 0.0);
+    Headroom.Requests = FMath::FloorToInt32(Available);
+    Headroom.Fraction = FMath::Min(Headroom.Fraction, static_cast<float>(Available / m_Requests.Capacity));
+  }
+  if(m_Tokens.IsLimited())
+  {
+    const double Available = FMath::Max(m_Tokens.GetAvailable(Now), 0.0);
+    Headroom.Tokens = FMath::FloorToInt32(Available);
+    Headroom.Fraction = FMath::Min(Headroom.Fraction, static_cast<float>(Available / m_Tokens.Capacity));
+  }
+  if(Headroom.WaitSeconds > 0.0f)
+  {
+    Headroom.Fraction = 0.0f;
+  }
+  return Headroom;
+}
+
+//----------------------------------------------------------------------
+bool FLLMRateLimiter::ParseResetSeconds(const FString& Value, double Now, double& OutSeconds)
+{
+  if(Value.IsEmpty() || !FChar::IsDigit(Value[0]))
+  {
+    return false;
+  }
+
+  // Plain number: seconds, or OpenRouter's epoch time in milliseconds
+  if(Value.IsNumeric())
+  {
+    const double Number = FCString::Atod(*Value);
+    OutSeconds = Number > 1.0e12 ? Number / 1000.0 - (FDateTime::UtcNow() - FDateTime(1970, 1, 1)).GetTotalSeconds() : Number;
+    OutSeconds = FMath::Max(OutSeconds, 0.0);
+    return true;
+  }
+
+  // "1h2m3.5s", "20ms"
+  OutSeconds = 0.0;
+  int32 Pos = 0;
+  while(Pos < Value.Len())
+  {
+    const int32 Start = Pos;
+    while(Pos < Value.Len() && (FChar::IsDigit(Value[Pos]) || Value[Pos] == TEXT('.')))
+    {
+      ++Pos;
+    }
+    if(Pos == Start)
+    {
+      return false;
+    }
+    const double Number = FCString::Atod(*Value.Mid(Start, Pos - Start));
+    const FStringView Rest = FStringView(Value).RightChop(Pos);
+    if(Rest.StartsWith(TEXT("ms")))
+    {
+      OutSeconds += Number / 1000.0;
+      Pos += 2;
+    }
+    else if(Rest.StartsWith(TEXT("h")))
+    {
+      OutSeconds += Number * 3600.0;
+      ++Pos;
+    }
+    else if(Rest.StartsWith(TEXT("m")))
+    {
+      OutSeconds += Number * 60.0;
+      ++Pos;
+    }
+    else if(Rest.StartsWith(TEXT("s")) || Rest.IsEmpty())
+    {
+      OutSeconds += Number;
+      ++Pos;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
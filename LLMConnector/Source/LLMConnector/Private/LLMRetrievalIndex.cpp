@@ -0,0 +1,151 @@
+﻿#include "LLMRetrievalIndex.h"
+
+#include "Hash/CityHash.h"
+
+
+
+//----------------------------------------------------------------------
+void FLLMRetrievalIndex::Reset()
+{
+  m_Postings.Reset();
+  m_DocLengths.Reset();
+  m_TotalLength = 0.0f;
+  m_CurrentTerms.Reset();
+  m_CurrentLength = 0.0f;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMRetrievalIndex::BeginDocument()
+{
+  m_CurrentTerms.Reset();
+  m_CurrentLength = 0.0f;
+  return m_DocLengths.Num();
+}
+
+//----------------------------------------------------------------------
+void FLLMRetrievalIndex::AddField(FStringView Text, float Weight /*= 1.0f */)
+{
+  ForEachTerm(Text, [this, Weight](uint64 Term)
+  {
+    m_CurrentTerms.FindOrAdd(Term) += Weight;
+    m_CurrentLength += Weight;
+  });
+}
+
+//----------------------------------------------------------------------
+void FLLMRetrievalIndex::EndDocument()
+{
+  const int32 Document = m_DocLengths.Add(m_CurrentLength);
+  m_TotalLength += m_CurrentLength;
+
+  for(const auto& Pair : m_CurrentTerms)
+  {
+    m_Postings.FindOrAdd(Pair.Key).Add({Document, Pair.Value});
+  }
+  m_CurrentTerms.Reset();
+  m_CurrentLength = 0.0f;
+}
+
+//----------------------------------------------------------------------
+void FLLMRetrievalIndex::Query(FStringView Text, int32 TopK, TArray<int32>& OutDocuments, TArray<float>* OutScores /*= nullptr */) const
+{
+  OutDocuments.Reset();
+  if(OutScores != nullptr)
+  {
+    OutScores->Reset();
+  }
+
+  const int32 NumDocs = m_DocLengths.Num();
+  if(NumDocs == 0 || TopK <= 0)
+  {
+    return;
+  }
+
+  // Each query term counts once
+  TArray<uint64, TInlineAllocator<32>> QueryTerms;
+  ForEachTerm(Text, [&QueryTerms](uint64 Term)
+  {
+    QueryTerms.AddUnique(Term);
+  });
+
+  const float AvgLength = FMath::Max(m_TotalLength / NumDocs, 1.0f);
+
+  TArray<float, TInlineAllocator<256>> Scores;
+  Scores.SetNumZeroed(NumDocs);
+  TArray<int32, TInlineAllocator<64>> Touched;
+
+  for(const uint64 Term : QueryTerms)
+  {
+    const TArray<FPosting>* Postings = m_Postings.Find(Term);
+    if(Postings == nullptr)
+    {
+      continue;
+    }
+
+    const float DocFrequency = Postings->Num();
+    const float Idf = FMath::Loge(1.0f + (NumDocs - DocFrequency + 0.5f) / (DocFrequency + 0.5f));
+
+    for(const FPosting& Posting : *Postings)
+    {
+      const float Norm = K1 * (1.0f - B + B * m_DocLengths[Posting.Document] / AvgLength);
+      const float Score = Idf * Posting.TermFrequency * (K1 + 1.0f) / (Posting.TermFrequency + Norm);
+
+      if(Scores[Posting.Document] == 0.0f)
+      {
+        Touched.Add(Posting.Document);
+      }
+      Scores[Posting.Document] += Score;
+    }
+  }
+
+  // Ties keep document order, so the same query always selects the same entries
+  Touched.Sort([&Scores](int32 A, int32 BDoc)
+  {
+    return Scores[A] != Scores[BDoc] ? Scores[A] > Scores[BDoc] : A < BDoc;
+  });
+
+  const int32 NumResults = FMath::Min(TopK, Touched.Num());
+  OutDocuments.Append(Touched.GetData(), NumResults);
+  if(OutScores != nullptr)
+  {
+    for(int32 Index = 0; Index < NumResults; ++Index)
+    {
+      OutScores->Add(Scores[Touched[Index]]);
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+void FLLMRetrievalIndex::ForEachTerm(FStringView Text, TFunctionRef<void(uint64)> Func)
+{
+  // Lowercased in a fixed buffer, longer runs are cut - they are rare and still hash consistently
+  constexpr int32 MaxTermLen = 64;
+  TCHAR Term[MaxTermLen];
+  int32 TermLen = 0;
+
+  auto Flush = [&Term, &TermLen, &Func]()
+  {
+    // Single characters match almost everything
+    if(TermLen > 1)
+    {
+      Func(CityHash64(reinterpret_cast<const char*>(Term), TermLen * sizeof(TCHAR)));
+    }
+    TermLen = 0;
+  };
+
+  for(const TCHAR Character : Text)
+  {
+    if(FChar::IsAlnum(Character))
+    {
+      if(TermLen < MaxTermLen)
+      {
+        Term[TermLen++] = FChar::ToLower(Character);
+      }
+    }
+    else
+    {
+      Flush();
+    }
+  }
+  Flush();
+}
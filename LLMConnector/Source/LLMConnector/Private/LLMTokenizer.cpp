@@ -0,0 +1,480 @@
+﻿#include "LLMTokenizer.h"
+
+#include "Dom/JsonObject.h"
+#include "Hash/CityHash.h"
+#include "Misc/Base64.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Serialization/JsonSerializer.h"
+
+namespace LLMTokenizer
+{
+  // The cache is dropped when it grows over this, long sessions keep the names in use
+  constexpr int32 MaxCachedWords = 1 << 16;
+  // Longer words, e.g. base64 blobs, are merged without the cache
+  constexpr int32 MaxCachedWordBytes = 64;
+  constexpr int32 NoRank = MAX_int32;
+
+  enum class ECharClass : uint8
+  {
+    Letter,
+    Number,
+    Space,
+    Newline,
+    Other,
+  };
+
+  struct FCharInfo
+  {
+    ECharClass Class;
+    int32 Bytes;
+  };
+
+  struct FAsciiClasses
+  {
+    ECharClass Classes[128];
+
+    FAsciiClasses()
+    {
+      for(int32 Character = 0; Character < 128; ++Character)
+      {
+        Classes[Character] = FChar::IsAlpha(TCHAR(Character)) ? ECharClass::Letter
+          : FChar::IsDigit(TCHAR(Character)) ? ECharClass::Number
+          : Character == '\r' || Character == '\n' ? ECharClass::Newline
+          : FChar::IsWhitespace(TCHAR(Character)) ? ECharClass::Space
+          : ECharClass::Other;
+      }
+    }
+  };
+
+  // ASCII by table, the rest decoded from UTF-8
+  FCharInfo Classify(const uint8* Text, int32 Num)
+  {
+    static const FAsciiClasses Ascii;
+    const uint8 Lead = Text[0];
+    if(Lead < 0x80)
+    {
+      return { Ascii.Classes[Lead], 1 };
+    }
+
+    const int32 Bytes = FMath::Min(Lead >= 0xF0 ? 4 : Lead >= 0xE0 ? 3 : Lead >= 0xC0 ? 2 : 1, Num);
+    if(Bytes == 1)
+    {
+      // Stray continuation byte
+      return { ECharClass::Other, 1 };
+    }
+    uint32 CodePoint = Lead & (0x7F >> Bytes);
+    for(int32 Index = 1; Index < Bytes; ++Index)
+    {
+      CodePoint = (CodePoint << 6) | (Text[Index] & 0x3F);
+    }
+
+    // Above the BMP are mostly emoji, and CJK extensions from plane 2
+    if(CodePoint > 0xFFFF)
+    {
+      return { CodePoint >= 0x20000 ? ECharClass::Letter : ECharClass::Other, Bytes };
+    }
+    const TCHAR Character = static_cast<TCHAR>(CodePoint);
+    const ECharClass Class = FChar::IsAlpha(Character) ? ECharClass::Letter
+      : FChar::IsDigit(Character) ? ECharClass::Number
+      : FChar::IsWhitespace(Character) ? ECharClass::Space
+      : ECharClass::Other;
+    return { Class, Bytes };
+  }
+
+  int32 SkipClass(const uint8* Text, int32 Num, int32 Pos, ECharClass Class, int32 MaxChars = MAX_int32)
+  {
+    for(int32 Chars = 0; Pos < Num && Chars < MaxChars; ++Chars)
+    {
+      const FCharInfo Info = Classify(Text + Pos, Num - Pos);
+      if(Info.Class != Class)
+      {
+        break;
+      }
+      Pos += Info.Bytes;
+    }
+    return Pos;
+  }
+
+  // 's 't 're 've 'm 'll 'd in any case
+  int32 ContractionLength(const uint8* Text, int32 Num)
+  {
+    const auto Lower = [Text, Num](int32 Index)
+    {
+      return Index < Num ? FChar::ToLower(TCHAR(Text[Index])) : TCHAR(0);
+    };
+    const TCHAR First = Lower(1);
+    if(First == 's' || First == 't' || First == 'm' || First == 'd')
+    {
+      return 2;
+    }
+    const TCHAR Second = Lower(2);
+    if((First == 'r' && Second == 'e') || (First == 'v' && Second == 'e') || (First == 'l' && Second == 'l'))
+    {
+      return 3;
+    }
+    return 0;
+  }
+
+  // Printable bytes stand for themselves in byte-level vocabularies, the rest are moved to U+0100 and up
+  struct FByteLevelChars
+  {
+    int32 Bytes[256 + 68];
+
+    FByteLevelChars()
+    {
+      int32 Shifted = 0;
+      for(int32 Byte = 0; Byte < 256; ++Byte)
+      {
+        const bool bPrintable = (Byte >= 33 && Byte <= 126) || (Byte >= 161 && Byte <= 172) || Byte >= 174;
+        Bytes[Byte] = bPrintable ? Byte : INDEX_NONE;
+        if(!bPrintable)
+        {
+          Bytes[256 + Shifted++] = Byte;
+        }
+      }
+    }
+
+    bool Decode(const FString& Token, TArray<uint8>& OutBytes) const
+    {
+      OutBytes.Reset();
+      for(const TCHAR Character : Token)
+      {
+        const int32 Byte = static_cast<uint32>(Character) < UE_ARRAY_COUNT(Bytes) ? Bytes[Character] : INDEX_NONE;
+        if(Byte == INDEX_NONE)
+        {
+          return false;
+        }
+        OutBytes.Add(static_cast<uint8>(Byte));
+      }
+      return true;
+    }
+  };
+
+  // SentencePiece marks spaces with U+2581 and unknown bytes as <0xAB>
+  void DecodeSentencePiece(const FString& Token, TArray<uint8>& OutBytes)
+  {
+    OutBytes.Reset();
+    if(Token.Len() == 6 && Token.StartsWith(TEXT("<0x")) && Token.EndsWith(TEXT(">")))
+    {
+      OutBytes.Add(static_cast<uint8>(FParse::HexNumber(*Token.Mid(3, 2))));
+      return;
+    }
+    const FString Text = Token.Replace(TEXT("\u2581"), TEXT(" "));
+    const auto Converted = StringCast<UTF8CHAR>(*Text, Text.Len());
+    OutBytes.Append(reinterpret_cast<const uint8*>(Converted.Get()), Converted.Length());
+  }
+}
+
+
+
+//----------------------------------------------------------------------
+TSharedPtr<const FLLMTokenizer> FLLMTokenizer::LoadFromFile(const FString& FileName, FString* OutError /*= nullptr*/)
+{
+  FString Error;
+  FString Text;
+  TSharedPtr<FLLMTokenizer> Tokenizer(new FLLMTokenizer());
+  if(!FFileHelper::LoadFileToString(Text, *FileName))
+  {
+    Error = FString::Printf(TEXT("Can't read %s"), *FileName);
+  }
+  else
+  {
+    const bool bJson = Text.TrimStart().StartsWith(TEXT("{"));
+    const bool bLoaded = bJson ? Tokenizer->LoadTokenizerJson(Text, Error) : Tokenizer->LoadTikToken(Text, Error);
+    if(bLoaded && Tokenizer->m_Ranks.Num() == 0)
+    {
+      Error = FString::Printf(TEXT("No tokens in %s"), *FileName);
+    }
+  }
+
+  if(!Error.IsEmpty())
+  {
+    if(OutError != nullptr)
+    {
+      *OutError = MoveTemp(Error);
+    }
+    return nullptr;
+  }
+  return Tokenizer;
+}
+
+//----------------------------------------------------------------------
+bool FLLMTokenizer::LoadTikToken(const FString& Text, FString& OutError)
+{
+  TArray<FString> Lines;
+  Text.ParseIntoArrayLines(Lines);
+  m_Ranks.Reserve(Lines.Num());
+
+  TArray<uint8> Bytes;
+  for(const FString& Line : Lines)
+  {
+    FString Token;
+    FString Rank;
+    if(!Line.Split(TEXT(" "), &Token, &Rank) || !FBase64::Decode(Token, Bytes))
+    {
+      OutError = FString::Printf(TEXT("Invalid line '%s'"), *Line.Left(64));
+      return false;
+    }
+    AddToken(Bytes, FCString::Atoi(*Rank));
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+bool FLLMTokenizer::LoadTokenizerJson(const FString& Text, FString& OutError)
+{
+  TSharedPtr<FJsonObject> Root;
+  const TSharedRef<TJsonReader<TCHAR>> Reader = TJsonReaderFactory<TCHAR>::Create(Text);
+  const TSharedPtr<FJsonObject>* Model = nullptr;
+  const TSharedPtr<FJsonObject>* Vocab = nullptr;
+  if(!FJsonSerializer::Deserialize(Reader, Root) || !Root.IsValid()
+    || !Root->TryGetObjectField(TEXT("model"), Model) || !(*Model)->TryGetObjectField(TEXT("vocab"), Vocab))
+  {
+    OutError = TEXT("No model vocabulary in tokenizer.json");
+    return false;
+  }
+
+  FString ModelType;
+  if((*Model)->TryGetStringField(TEXT("type"), ModelType) && ModelType != TEXT("BPE"))
+  {
+    OutError = FString::Printf(TEXT("%s tokenizers are not supported, only BPE"), *ModelType);
+    return false;
+  }
+
+  // Ids of BPE vocabularies follow the merge order, so they work as ranks
+  static const LLMTokenizer::FByteLevelChars ByteLevel;
+  const bool bByteLevel = Text.Contains(TEXT("\"ByteLevel\""), ESearchCase::CaseSensitive);
+  m_Ranks.Reserve((*Vocab)->Values.Num());
+
+  TArray<uint8> Bytes;
+  for(const TPair<FString, TSharedPtr<FJsonValue>>& Entry : (*Vocab)->Values)
+  {
+    if(!bByteLevel)
+    {
+      LLMTokenizer::DecodeSentencePiece(Entry.Key, Bytes);
+    }
+    else if(!ByteLevel.Decode(Entry.Key, Bytes))
+    {
+      continue;
+    }
+    AddToken(Bytes, static_cast<int32>(Entry.Value->AsNumber()));
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+void FLLMTokenizer::AddToken(TConstArrayView<uint8> Bytes, int32 Rank)
+{
+  if(Bytes.Num() > 0)
+  {
+    m_Ranks.Add(CityHash64(reinterpret_cast<const char*>(Bytes.GetData()), Bytes.Num()), Rank);
+  }
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::FindRank(const uint8* Bytes, int32 Num) const
+{
+  const int32* Rank = m_Ranks.Find(CityHash64(reinterpret_cast<const char*>(Bytes), Num));
+  return Rank != nullptr ? *Rank : LLMTokenizer::NoRank;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::CountTokens(FUtf8StringView Text) const
+{
+  using namespace LLMTokenizer;
+
+  // Same split as the cl100k pattern, each word is encoded on its own
+  const uint8* Bytes = reinterpret_cast<const uint8*>(Text.GetData());
+  const int32 Num = Text.Len();
+  int32 Tokens = 0;
+  int32 Pos = 0;
+  while(Pos < Num)
+  {
+    const FCharInfo First = Classify(Bytes + Pos, Num - Pos);
+    const int32 Next = Pos + First.Bytes;
+    const ECharClass NextClass = Next < Num ? Classify(Bytes + Next, Num - Next).Class : ECharClass::Other;
+    int32 End = Next;
+
+    const int32 Contraction = Bytes[Pos] == '\'' ? ContractionLength(Bytes + Pos, Num - Pos) : 0;
+    if(Contraction > 0)
+    {
+      End = Pos + Contraction;
+    }
+    // Letters with one leading space or punctuation
+    else if(First.Class == ECharClass::Letter || (NextClass == ECharClass::Letter && First.Class != ECharClass::Newline && First.Class != ECharClass::Number))
+    {
+      End = SkipClass(Bytes, Num, Next, ECharClass::Letter);
+    }
+    // Up to three digits
+    else if(First.Class == ECharClass::Number)
+    {
+      End = SkipClass(Bytes, Num, Next, ECharClass::Number, 2);
+    }
+    // Punctuation with one leading space and the line breaks after it
+    else if(First.Class == ECharClass::Other || (Bytes[Pos] == ' ' && NextClass == ECharClass::Other))
+    {
+      End = SkipClass(Bytes, Num, Next, ECharClass::Other);
+      End = SkipClass(Bytes, Num, End, ECharClass::Newline);
+    }
+    // Whitespace up to the last line break, otherwise without the space that goes with the next word
+    else
+    {
+      int32 LastNewlineEnd = INDEX_NONE;
+      int32 LastCharStart = Pos;
+      End = Pos;
+      while(End < Num)
+      {
+        const FCharInfo Info = Classify(Bytes + End, Num - End);
+        if(Info.Class != ECharClass::Space && Info.Class != ECharClass::Newline)
+        {
+          break;
+        }
+        LastCharStart = End;
+        End += Info.Bytes;
+        if(Info.Class == ECharClass::Newline)
+        {
+          LastNewlineEnd = End;
+        }
+      }
+      if(LastNewlineEnd != INDEX_NONE)
+      {
+        End = LastNewlineEnd;
+      }
+      else if(End < Num && LastCharStart > Pos)
+      {
+        End = LastCharStart;
+      }
+    }
+
+    Tokens += CountWordTokens(Bytes + Pos, End - Pos);
+    Pos = End;
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::CountTokens(FStringView Text) const
+{
+  const auto Converted = StringCast<UTF8CHAR>(Text.GetData(), Text.Len());
+  return CountTokens(FUtf8StringView(Converted.Get(), Converted.Length()));
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::CountTokens(const FLLMPromptBase& Prompt) const
+{
+  int32 Tokens = TokensPerMessage + CountTokens(FStringView(Prompt.Content));
+  for(const FLLMToolCall& ToolCall : Prompt.ToolCalls)
+  {
+    Tokens += CountTokens(FStringView(ToolCall.Name)) + CountTokens(FStringView(ToolCall.Arguments));
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::CountTokens(TConstArrayView<FLLMPromptBase> Messages) const
+{
+  int32 Tokens = TokensPerReply;
+  for(const FLLMPromptBase& Prompt : Messages)
+  {
+    Tokens += CountTokens(Prompt);
+  }
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::CountTokens(const FLLMPromptNode& Node, ELLMPromptFormat Format /*= ELLMPromptFormat::Indented*/) const
+{
+  TStringBuilder<2048> Builder;
+  Node.WriteTo(Builder, Format);
+  return CountTokens(Builder.ToView());
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::CountWordTokens(const uint8* Bytes, int32 Num) const
+{
+  if(Num <= 1)
+  {
+    return Num;
+  }
+  if(Num > LLMTokenizer::MaxCachedWordBytes)
+  {
+    return MergeWord(Bytes, Num);
+  }
+
+  const uint64 Hash = CityHash64(reinterpret_cast<const char*>(Bytes), Num);
+  {
+    FReadScopeLock ReadLock(m_WordCacheLock);
+    if(const int32* Cached = m_WordCache.Find(Hash))
+    {
+      return *Cached;
+    }
+  }
+
+  const int32 Tokens = MergeWord(Bytes, Num);
+  FWriteScopeLock WriteLock(m_WordCacheLock);
+  if(m_WordCache.Num() >= LLMTokenizer::MaxCachedWords)
+  {
+    m_WordCache.Reset();
+  }
+  m_WordCache.Add(Hash, Tokens);
+  return Tokens;
+}
+
+//----------------------------------------------------------------------
+int32 FLLMTokenizer::MergeWord(const uint8* Bytes, int32 Num) const
+{
+  using namespace LLMTokenizer;
+
+  if(FindRank(Bytes, Num) != NoRank)
+  {
+    return 1;
+  }
+
+  // Start of each part and the rank of merging it with the next one, the last entry is the end
+  TArray<TPair<int32, int32>, TInlineAllocator<MaxCachedWordBytes + 1>> Parts;
+  Parts.Reserve(Num + 1);
+  for(int32 Index = 0; Index <= Num; ++Index)
+  {
+    Parts.Emplace(Index, NoRank);
+  }
+
+  // Rank of the part at Index joined with the following Skip parts
+  const auto GetRank = [&Parts, Bytes, this](int32 Index, int32 Skip)
+  {
+    return Index + Skip < Parts.Num()
+      ? FindRank(Bytes + Parts[Index].Key, Parts[Index + Skip].Key - Parts[Index].Key)
+      : NoRank;
+  };
+  for(int32 Index = 0; Index + 1 < Parts.Num(); ++Index)
+  {
+    Parts[Index].Value = GetRank(Index, 2);
+  }
+
+  // Lowest rank first, the same order the vocabulary was built in
+  while(Parts.Num() > 2)
+  {
+    int32 MinIndex = INDEX_NONE;
+    int32 MinRank = NoRank;
+    for(int32 Index = 0; Index + 1 < Parts.Num(); ++Index)
+    {
+      if(Parts[Index].Value < MinRank)
+      {
+        MinRank = Parts[Index].Value;
+        MinIndex = Index;
+      }
+    }
+    if(MinIndex == INDEX_NONE)
+    {
+      break;
+    }
+
+    Parts[MinIndex].Value = GetRank(MinIndex, 3);
+    if(MinIndex > 0)
+    {
+      Parts[MinIndex - 1].Value = GetRank(MinIndex - 1, 3);
+    }
+    Parts.RemoveAt(MinIndex + 1);
+  }
+  return Parts.Num() - 1;
+}
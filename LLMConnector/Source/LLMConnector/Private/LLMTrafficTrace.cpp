@@ -0,0 +1,136 @@
+﻿#include "LLMTrafficTrace.h"
+
+#include "LLMConnectorSubsystem.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Dom/JsonObject.h"
+#include "Policies/CondensedJsonPrintPolicy.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+
+namespace LLMTrafficTrace
+{
+  const TCHAR* TimeField = TEXT("time");
+  const TCHAR* ElapsedField = TEXT("elapsed");
+  const TCHAR* SuccessField = TEXT("success");
+  const TCHAR* CodeField = TEXT("code");
+  const TCHAR* RequestField = TEXT("request");
+  const TCHAR* ResponseField = TEXT("response");
+}
+
+
+
+//----------------------------------------------------------------------
+TUniquePtr<FLLMTrafficTrace> FLLMTrafficTrace::CreateRecording(const FString& FileName)
+{
+  if(!FFileHelper::SaveStringToFile(FString(), *FileName))
+  {
+    UE_LOG(LLM, Error, TEXT("Can't create the traffic trace %s"), *FileName);
+    return nullptr;
+  }
+
+  TUniquePtr<FLLMTrafficTrace> Trace(new FLLMTrafficTrace());
+  Trace->m_FileName = FileName;
+  Trace->m_StartSeconds = FPlatformTime::Seconds();
+  UE_LOG(LLM, Log, TEXT("Recording LLM traffic to %s"), *FileName);
+  return Trace;
+}
+
+//----------------------------------------------------------------------
+TUniquePtr<FLLMTrafficTrace> FLLMTrafficTrace::OpenReplay(const FString& FileName)
+{
+  using namespace LLMTrafficTrace;
+
+  TArray<FString> Lines;
+  if(!FFileHelper::LoadFileToStringArray(Lines, *FileName))
+  {
+    UE_LOG(LLM, Error, TEXT("Can't read the traffic trace %s"), *FileName);
+    return nullptr;
+  }
+
+  TUniquePtr<FLLMTrafficTrace> Trace(new FLLMTrafficTrace());
+  Trace->m_FileName = FileName;
+  Trace->m_bReplay = true;
+  Trace->m_Entries.Reserve(Lines.Num());
+  for(int32 LineIndex = 0; LineIndex < Lines.Num(); ++LineIndex)
+  {
+    TSharedPtr<FJsonObject> Object;
+    const TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(Lines[LineIndex]);
+    if(!FJsonSerializer::Deserialize(Reader, Object) || !Object.IsValid())
+    {
+      UE_LOG(LLM, Warning, TEXT("Skipping line %d of the traffic trace %s"), LineIndex + 1, *FileName);
+      continue;
+    }
+
+    FLLMTrafficEntry& Entry = Trace->m_Entries.AddDefaulted_GetRef();
+    Entry.StartSeconds = Object->GetNumberField(TimeField);
+    Entry.ElapsedSeconds = Object->GetNumberField(ElapsedField);
+    Entry.bSuccess = Object->GetBoolField(SuccessField);
+    Entry.ResponseCode = static_cast<int32>(Object->GetNumberField(CodeField));
+    Entry.Request = Object->GetStringField(RequestField);
+    Entry.Response = Object->GetStringField(ResponseField);
+    Trace->m_EntriesByRequest.Add(FCrc::StrCrc32(*Entry.Request), Trace->m_Entries.Num() - 1);
+  }
+  Trace->m_Served.Init(false, Trace->m_Entries.Num());
+
+  UE_LOG(LLM, Log, TEXT("Replaying %d LLM exchanges from %s"), Trace->m_Entries.Num(), *FileName);
+  return Trace;
+}
+
+//----------------------------------------------------------------------
+void FLLMTrafficTrace::Record(const FString& Request, bool bSuccess, int32 ResponseCode, const FString& Response, double ElapsedSeconds)
+{
+  using namespace LLMTrafficTrace;
+
+  TSharedRef<FJsonObject> Object = MakeShared<FJsonObject>();
+  Object->SetNumberField(TimeField, FPlatformTime::Seconds() - m_StartSeconds - ElapsedSeconds);
+  Object->SetNumberField(ElapsedField, ElapsedSeconds);
+  Object->SetBoolField(SuccessField, bSuccess);
+  Object->SetNumberField(CodeField, ResponseCode);
+  Object->SetStringField(RequestField, Request);
+  Object->SetStringField(ResponseField, Response);
+
+  // Condensed, newlines inside the payloads are escaped
+  FString Line;
+  TSharedRef<TJsonWriter<TCHAR, TCondensedJsonPrintPolicy<TCHAR>>> Writer = TJsonWriterFactory<TCHAR, TCondensedJsonPrintPolicy<TCHAR>>::Create(&Line);
+  FJsonSerializer::Serialize(Object, Writer);
+  Line += TEXT("\n");
+
+  if(!FFileHelper::SaveStringToFile(Line, *m_FileName, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM, &IFileManager::Get(), FILEWRITE_Append))
+  {
+    UE_LOG(LLM, Warning, TEXT("Can't append to the traffic trace %s"), *m_FileName);
+  }
+}
+
+//----------------------------------------------------------------------
+const FLLMTrafficEntry* FLLMTrafficTrace::TakeReplay(const FString& Request)
+{
+  // The multimap doesn't keep the order of the values
+  int32 Found = INDEX_NONE;
+  for(auto It = m_EntriesByRequest.CreateConstKeyIterator(FCrc::StrCrc32(*Request)); It; ++It)
+  {
+    const int32 Index = It.Value();
+    if(!m_Served[Index] && (Found == INDEX_NONE || Index < Found) && m_Entries[Index].Request == Request)
+    {
+      Found = Index;
+    }
+  }
+
+  if(Found == INDEX_NONE)
+  {
+    // The run diverged from the recording, keep the recorded order
+    while(m_FirstUnserved < m_Entries.Num() && m_Served[m_FirstUnserved])
+    {
+      ++m_FirstUnserved;
+    }
+    if(m_FirstUnserved == m_Entries.Num())
+    {
+      return nullptr;
+    }
+    Found = m_FirstUnserved;
+    UE_LOG(LLM, Warning, TEXT("No recorded exchange has the same request, replaying exchange %d"), Found + 1);
+  }
+
+  m_Served[Found] = true;
+  return &m_Entries[Found];
+}
@@ -6,6 +6,33 @@
 
 #include "LLMCommandHandler.generated.h"
 
+class AActor;
+
+
+
+/**
+ * Identifies a registered command handler, stays invalid after the handler is unregistered
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMCommandHandlerHandle
+{
+  GENERATED_BODY()
+
+  bool IsValid() const
+  {
+    return Serial != 0;
+  }
+
+  bool operator==(const FLLMCommandHandlerHandle& Other) const
+  {
+    return Index == Other.Index && Serial == Other.Serial;
+  }
+
+  // Slot in the registry and the registration it belongs to, a reused slot gets a new serial
+  int32 Index = INDEX_NONE;
+  uint32 Serial = 0;
+};
+
 
 
 /**
@@ -53,6 +80,17 @@ public:
   }
 
 
+  /**
+   * Actor the command belongs to, for spatial command scopes
+   * 
+   * @return nullptr for global commands.
+   */
+  virtual AActor* GetCommandActor() const
+  {
+    return nullptr;
+  }
+
+
   UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
   void SetParams(const FLLMCommandStruct& ResponseParams)
   {
@@ -0,0 +1,38 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+
+/**
+ * Uniform grid over command locations, so scoping commands to a listener doesn't scan the whole world
+ * Locations are snapshots; rebuild it when the actors may have moved
+ */
+class LLMCONNECTOR_API FLLMCommandSpatialIndex
+{
+public:
+	explicit FLLMCommandSpatialIndex(float InCellSize = 2000.0f)
+	{
+		Reset(InCellSize);
+	}
+
+	void Reset(float InCellSize);
+
+	void Add(int32 Id, const FVector& Location);
+
+	// Ids in the cells overlapping the sphere bounds, the exact distance is left to the caller
+	void Query(const FVector& Center, float Radius, TArray<int32>& OutIds) const;
+
+	int32 Num() const
+	{
+		return m_Num;
+	}
+
+private:
+	FIntVector GetCell(const FVector& Location) const;
+
+	float m_CellSize = 2000.0f;
+	TMap<FIntVector, TArray<int32>> m_Cells;
+	int32 m_Num = 0;
+};
@@ -7,6 +7,47 @@
 
 
 
+UENUM(BlueprintType)
+enum class ELLMResponseFormatMode : uint8
+{
+	// Only "json_object" is requested, the structure is described in the prompt
+	JsonObject							UMETA(DisplayName = "JSON Object"),
+	// Strict "json_schema" generated from registered commands
+	JsonSchema							UMETA(DisplayName = "JSON Schema"),
+	// Each registered command is exposed as a native "tools" function
+	ToolCalls								UMETA(DisplayName = "Tool Calls"),
+};
+
+
+
+UENUM(BlueprintType)
+enum class ELLMBackendProfile : uint8
+{
+	// OpenRouter and compatible services, every generation setting is sent
+	OpenRouter							UMETA(DisplayName = "OpenRouter"),
+	// OpenAI API, only the generation settings it accepts
+	OpenAI									UMETA(DisplayName = "OpenAI"),
+	// Local llama.cpp server, each conversation keeps a server slot with its KV cache
+	LlamaCpp								UMETA(DisplayName = "llama.cpp Server"),
+	// GGUF model run in-process on the CPU, the plugin must be built with llama.cpp
+	Embedded								UMETA(DisplayName = "Embedded Model"),
+};
+
+
+
+UENUM(BlueprintType)
+enum class ELLMTrafficMode : uint8
+{
+	// Requests go to ApiURL
+	Live										UMETA(DisplayName = "Live"),
+	// Requests go to ApiURL, every request and response is written to the trace file
+	Record									UMETA(DisplayName = "Record"),
+	// Responses come from the trace file, nothing is sent
+	Replay									UMETA(DisplayName = "Replay"),
+};
+
+
+
 USTRUCT(BlueprintType)
 struct FLLMGenerationSettings
 {
@@ -133,6 +174,52 @@ public:
 	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
 	FString ModelName = TEXT("google/gemini-2.0-flash-001");
 
+	/**
+	 * Server behind ApiURL, decides which request fields are sent
+	 * A llama.cpp server doesn't need an API key
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
+	ELLMBackendProfile BackendProfile = ELLMBackendProfile::OpenRouter;
+
+	/**
+	 * Parallel slots of the llama.cpp server (-np), conversations are spread over them and keep theirs
+	 * The slot reuses the KV cache of the previous turn, 0 lets the server choose
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0", UIMin = "0", UIMax = "16", EditCondition = "BackendProfile == ELLMBackendProfile::LlamaCpp"))
+	int32 LocalServerSlots = 0;
+
+	/**
+	 * Ask the llama.cpp server to keep the evaluated prompt, only the new messages are processed on the next turn
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (EditCondition = "BackendProfile == ELLMBackendProfile::LlamaCpp"))
+	bool bCachePrompt = true;
+
+	/**
+	 * Idle connections to the llama.cpp server are kept open by a health request at this interval, in seconds
+	 * 0 disables it
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0.0", UIMin = "0.0", UIMax = "120.0", EditCondition = "BackendProfile == ELLMBackendProfile::LlamaCpp"))
+	float LocalKeepAliveSeconds = 30.0f;
+
+	/**
+	 * GGUF model of the embedded backend, relative to the project directory
+	 * Small quantized models (Q4_K_M, 1-4B parameters) answer within seconds on a desktop CPU
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (FilePathFilter = "gguf", EditCondition = "BackendProfile == ELLMBackendProfile::Embedded"))
+	FFilePath EmbeddedModelPath;
+
+	/**
+	 * Context of the embedded model in tokens, history and response must fit in it
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "512", UIMin = "512", UIMax = "32768", EditCondition = "BackendProfile == ELLMBackendProfile::Embedded"))
+	int32 EmbeddedContextSize = 4096;
+
+	/**
+	 * CPU threads of the embedded model, 0 uses every physical core
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0", UIMin = "0", UIMax = "32", EditCondition = "BackendProfile == ELLMBackendProfile::Embedded"))
+	int32 EmbeddedThreads = 0;
+
 	/**
 	 * Maximum number of messages to keep in conversation history
 	 * Older messages beyond this limit will be removed 
@@ -140,12 +227,119 @@ public:
 	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
 	int32 MaxHistoryMessages = 10;
 
+	/**
+	 * Oldest messages are also removed while the history is over this many tokens, 0 for no limit
+	 * Counted with TokenizerFile when it is set, otherwise estimated
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0", UIMin = "0", UIMax = "131072"))
+	int32 MaxHistoryTokens = 0;
+
+	/**
+	 * Vocabulary of the model for exact token counts, relative to the project directory
+	 * A .tiktoken file (cl100k_base, o200k_base) or tokenizer.json of a BPE model
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
+	FFilePath TokenizerFile;
+
+	/**
+	 * Requests sent at the same time by all conversations together
+	 * Conversations over the limit wait in arrival order, 0 sends every request at once
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0", UIMin = "0", UIMax = "16"))
+	int32 MaxConcurrentRequests = 4;
+
+	/**
+	 * A conversation sending exactly the payload of a request in flight waits for that response instead
+	 * Saves slots and tokens when many NPCs react to the same event with the same history
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
+	bool bShareIdenticalRequests = true;
+
+	/**
+	 * Connect to the server of ApiURL at startup, so the first prompt doesn't wait for DNS, TCP and TLS
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
+	bool bPreconnectAtStartup = false;
+
+	/**
+	 * Send the reserved messages with a one token response when SetCountReservedMessages is called
+	 * The provider, or the llama.cpp slot, has the common prefix cached before the first prompt
+	 * Warm-ups wait for request slots no prompt needs and for the rate limits
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API")
+	bool bWarmUpReservedContext = false;
+
+	/**
+	 * How long the provider keeps a warmed prefix cached, the same prefix isn't warmed again within it
+	 * Provider prompt caches usually expire after 5-10 minutes without use
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0.0", UIMin = "0.0", UIMax = "3600.0"))
+	float WarmUpCacheSeconds = 300.0f;
+
+	/**
+	 * Requests per minute allowed by the provider, 0 until the x-ratelimit headers of the first response tell
+	 * Requests over the limit wait in the queue instead of failing with 429
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0", UIMin = "0", UIMax = "10000"))
+	int32 RequestsPerMinute = 0;
+
+	/**
+	 * Tokens per minute allowed by the provider, 0 until the x-ratelimit headers of the first response tell
+	 * A request counts its history and MaxTokens
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "API", meta = (ClampMin = "0", UIMin = "0", UIMax = "2000000"))
+	int32 TokensPerMinute = 0;
+
 	/**
 	 * Generation parameters (temperature, top_p, etc.)
 	 */
 	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Generation")
 	FLLMGenerationSettings GenerationSettings;
 
+	/**
+	 * How the expected response structure is passed to the provider
+	 * JsonSchema and ToolCalls fall back to JsonObject with prompt instructions if the provider rejects them
+	 * With ToolCalls there is no need to add GetContextCommands to the history
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "JSON")
+	ELLMResponseFormatMode ResponseFormatMode = ELLMResponseFormatMode::JsonSchema;
+
+	/**
+	 * How many commands the LLM may return in one response, they are executed in the listed order
+	 * With 1 the response keeps single "command", "target" and "parameters" fields
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "JSON", meta = (ClampMin = "1", ClampMax = "16", UIMin = "1", UIMax = "16"))
+	int32 MaxCommandsPerResponse = 1;
+
+	/**
+	 * Handler results arriving within this time are merged into one follow-up message
+	 * 0 sends them on the next tick
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Commands", meta = (ClampMin = "0.0", UIMin = "0.0", UIMax = "2.0", Delta = "0.05"))
+	float CommandResultsWindowSeconds = 0.1f;
+
+	/**
+	 * Game thread time per frame for executing command handlers, in milliseconds
+	 * The rest of the queued commands continue on the next frames, at least one command runs per frame
+	 * 0 executes all commands at once
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Commands", meta = (ClampMin = "0.0", UIMin = "0.0", UIMax = "16.0", Delta = "0.5"))
+	float CommandExecutionBudgetMs = 2.0f;
+
+	/**
+	 * Grid cell size of the spatial index used by command scopes
+	 * About the usual scope MaxDistance works well
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Commands", meta = (ClampMin = "100.0"))
+	float CommandIndexCellSize = 3000.0f;
+
+	/**
+	 * How often command actor locations are re-read into the spatial index, in seconds
+	 * Registering or unregistering a command always rebuilds it
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Commands", meta = (ClampMin = "0.0"))
+	float CommandIndexRefreshSeconds = 1.0f;
+
 	/**
 	 * Main instruction for the JSON response format
 	 * This guides the LLM on how to structure its responses 
@@ -174,4 +368,24 @@ public:
 	 */
 	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "JSON", meta = (MultiLine = true))
 	FString ReasoningInstructionsText = TEXT("\"detailed explanation of your thought process and decision making\"");
+
+	/**
+	 * Record the traffic for offline runs, or replay a recording without network
+	 * Overridden by -LLMRecord=File and -LLMReplay=File on the command line
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Traffic")
+	ELLMTrafficMode TrafficMode = ELLMTrafficMode::Live;
+
+	/**
+	 * Trace file, relative to the Saved directory
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Traffic", meta = (EditCondition = "TrafficMode != ELLMTrafficMode::Live"))
+	FString TrafficTraceFile = TEXT("LLMTraffic.jsonl");
+
+	/**
+	 * Replayed responses arrive after the recorded time divided by this, 0 answers on the next tick
+	 * Overridden by -LLMReplaySpeed=
+	 */
+	UPROPERTY(Config, EditAnywhere, BlueprintReadOnly, Category = "Traffic", meta = (ClampMin = "0.0", UIMin = "0.0", UIMax = "100.0", EditCondition = "TrafficMode == ELLMTrafficMode::Replay"))
+	float ReplaySpeed = 1.0f;
 };
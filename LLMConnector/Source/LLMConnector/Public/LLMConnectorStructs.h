@@ -2,8 +2,11 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Misc/StringBuilder.h"
 #include "LLMConnectorStructs.generated.h"
 
+class AActor;
+
 
 
 UENUM(BlueprintType)
@@ -12,6 +15,7 @@ enum class ELLMRole : uint8
 	System									UMETA(DisplayName = "System"),
 	User										UMETA(DisplayName = "User"),
 	Assistant								UMETA(DisplayName = "Assistant"),
+	Tool										UMETA(DisplayName = "Tool"),
 };
 
 UENUM(BlueprintType)
@@ -27,14 +31,49 @@ enum class ELLMErrorType : uint8
 	MissingFields           UMETA(DisplayName = "Missing Required Fields"),
 	Truncated               UMETA(DisplayName = "Response Truncated"),
 	JsonParseError          UMETA(DisplayName = "JSON Parse Error"),
+	Cancelled               UMETA(DisplayName = "Cancelled"),
 	
 	UnknownError            UMETA(DisplayName = "Unknown Error")
 };
 
 
 
+UENUM(BlueprintType)
+enum class ELLMPromptFormat : uint8
+{
+	// Indented "Key: value" lines, easiest to read
+	Indented								UMETA(DisplayName = "Indented"),
+	// No indentation, nested children inline as Key{a:b;c:d}
+	Minified								UMETA(DisplayName = "Minified"),
+	// Single line JSON object, content of a node with children goes to "_"
+	CompactJson							UMETA(DisplayName = "Compact JSON"),
+	// Minified with repeated keys replaced by short codes and a legend line
+	AbbreviatedKeys					UMETA(DisplayName = "Abbreviated Keys"),
+};
+
+
+
+UENUM(BlueprintType)
+enum class ELLMParameterType : uint8
+{
+	String									UMETA(DisplayName = "String"),
+	// Digits are taken from text like "5seconds"
+	Int											UMETA(DisplayName = "Int"),
+	Float										UMETA(DisplayName = "Float"),
+	Bool										UMETA(DisplayName = "Bool"),
+	// One of EnumValues, case-insensitive
+	Enum										UMETA(DisplayName = "Enum"),
+	// "x,y,z", "x y z" or "(X=..,Y=..,Z=..)"
+	Vector									UMETA(DisplayName = "Vector"),
+	Name										UMETA(DisplayName = "Name"),
+};
+
+
+
 /**
  * Helps create internal nesting for storing and sending text
+ * Children keep insertion order, so the same build code always renders the same text
+ * For large generated trees prefer FLLMPromptTree, it doesn't allocate per node
  */
 USTRUCT(BlueprintType)
 struct LLMCONNECTOR_API FLLMPromptNode
@@ -43,6 +82,7 @@ struct LLMCONNECTOR_API FLLMPromptNode
 
 	FString ContentText;
 
+	// TMap iterates in insertion order while no key is removed; children are only replaced in place or cleared
 	TMap<FString, TSharedPtr<FLLMPromptNode>> Children;
 
 	
@@ -55,18 +95,20 @@ struct LLMCONNECTOR_API FLLMPromptNode
 
 	FLLMPromptNode& AddChild(const FString& Key, const FString& Content = TEXT(""))
 	{
-		TSharedPtr<FLLMPromptNode> NewNode = MakeShared<FLLMPromptNode>(Content);
-		Children.Add(Key, NewNode);
-		return *NewNode;
+		return AddChild(Key, MakeShared<FLLMPromptNode>(Content));
 	}
 
 	FLLMPromptNode& AddChild(const FString& Key, const FLLMPromptNode& Node)
 	{
-		TSharedPtr<FLLMPromptNode> NewNode = MakeShared<FLLMPromptNode>(Node);
-		Children.Add(Key, NewNode);
-		return *NewNode;
+		return AddChild(Key, MakeShared<FLLMPromptNode>(Node));
 	}
 
+	FLLMPromptNode& AddChild(const FString& Key, FLLMPromptNode&& Node)
+	{
+		return AddChild(Key, MakeShared<FLLMPromptNode>(MoveTemp(Node)));
+	}
+
+	// An existing child with the same key is replaced in place
 	FLLMPromptNode& AddChild(const FString& Key, TSharedPtr<FLLMPromptNode> Node)
 	{
 		Children.Add(Key, Node);
@@ -104,50 +146,142 @@ struct LLMCONNECTOR_API FLLMPromptNode
 		Children.Empty();
 	}
 
-	FString ToString(int32 Indent = 0) const
+	// Render into an existing builder without intermediate strings
+	void WriteTo(FStringBuilderBase& Out, ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
+
+	// Render with one of the layouts, Indented is the same as ToString()
+	FString ToString(ELLMPromptFormat Format) const;
+
+	// Approximate token count of the rendered text, to compare formats
+	int32 EstimateTokens(ELLMPromptFormat Format = ELLMPromptFormat::Indented) const
 	{
-		FString Result;
+		return EstimateTokenCount(ToString(Format));
+	}
 
-		// If node has content but no children - output as key-value pair on one line
-		if(!ContentText.IsEmpty() && Children.Num() == 0)
-		{
-			Result += FString::ChrN(Indent, ' ') + ContentText;
-			return Result;
-		}
+	// Rough BPE-like estimate: short words are one token, long words, numbers and punctuation cost more
+	static int32 EstimateTokenCount(const FString& Text);
 
-		// If node has content - output it on separate line
-		if(!ContentText.IsEmpty())
-		{
-			Result += FString::ChrN(Indent, ' ') + ContentText + TEXT("\n");
-		}
+	FString ToString(int32 Indent = 0) const;
+};
 
-		// Process children
-		for(const auto& Child : Children)
-		{
-			// If child has no children - output as key-value pair on one line
-			if(Child.Value->Children.Num() == 0)
-			{
-				Result += FString::ChrN(Indent + 2, ' ') + Child.Key;
-				if(!Child.Value->ContentText.IsEmpty())
-				{
-					Result += TEXT(": ") + Child.Value->ContentText + TEXT("\n");
-				}
-				else
-				{
-					Result += TEXT("\n");
-				}
-			}
-			else
-			{
-				// If child has children - output hierarchically
-				Result += FString::ChrN(Indent + 2, ' ')
-					+ Child.Key + TEXT(":\n")
-					+ Child.Value->ToString(Indent + 4);
-			}
-		}
 
-		return Result;
-	}
+
+/**
+ * Declares one positional parameter of a command
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMCommandParameter
+{
+	GENERATED_BODY()
+
+	/** LLM-readable parameter name */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	FString Name;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	ELLMParameterType Type = ELLMParameterType::String;
+
+	/** Allowed values for Enum type */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command", meta = (EditCondition = "Type == ELLMParameterType::Enum"))
+	TArray<FString> EnumValues;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	bool bOptional = false;
+
+	// "name (type)" or "name (a|b|c)" for prompts and schemas
+	FString ToPromptString() const;
+};
+
+
+
+/**
+ * Parameter value converted once according to FLLMCommandParameter
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMParameterValue
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	ELLMParameterType Type = ELLMParameterType::String;
+
+	/** False if the text could not be converted, values keep their defaults */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	bool bValid = false;
+
+	/** String type only */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	FString StringValue;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	int32 IntValue = 0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	float FloatValue = 0.0f;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	bool BoolValue = false;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	FVector VectorValue = FVector::ZeroVector;
+
+	/** Name type, or the matched value for Enum type */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	FName NameValue;
+
+	/** Index in EnumValues for Enum type */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	int32 EnumIndex = INDEX_NONE;
+};
+
+
+
+/**
+ * Native function call requested by an LLM in tool calls mode
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMToolCall
+{
+	GENERATED_BODY()
+
+	/** Provider id, the tool result message must reference it */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Tool")
+	FString Id;
+
+	/** Function name as sent in "tools" */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Tool")
+	FString Name;
+
+	/** Raw JSON arguments string */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Tool")
+	FString Arguments;
+};
+
+
+
+/**
+ * One command of a response, several can be returned in execution order
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMCommandCall
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	FString Command;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	FString Target;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	TArray<FString> Parameters;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	TArray<FLLMParameterValue> TypedParameters;
+
+	/** Tool call this command came from, empty in JSON modes */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	FString ToolCallId;
 };
 
 
@@ -175,9 +309,20 @@ struct LLMCONNECTOR_API FLLMResponseBase
 	/** Optional parameters for the command */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
 	TArray<FString> Parameters;
+
+	/** Parameters converted by the command ParameterSchema, empty if the command declares none */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	TArray<FLLMParameterValue> TypedParameters;
+
+	/** Every command of the response in execution order, the first one is also in the fields above */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Response")
+	TArray<FLLMCommandCall> Commands;
 	
 	/** Reasoning or explanation provided by the LLM. Only Dev build */
 	FString Reasoning;
+
+	/** Native tool calls the command was parsed from, empty in JSON modes */
+	TArray<FLLMToolCall> ToolCalls;
 	
 	
 	FString ToString() const
@@ -190,6 +335,15 @@ struct LLMCONNECTOR_API FLLMResponseBase
 		{
 			Result += TEXT("Parameters: ") + FString::Join(Parameters, TEXT(", ")) + TEXT("\n");
 		}
+		for(int32 Index = 1; Index < Commands.Num(); ++Index)
+		{
+			Result += TEXT("Then: ") + Commands[Index].Command + TEXT(" ") + Commands[Index].Target;
+			if(!Commands[Index].Parameters.IsEmpty())
+			{
+				Result += TEXT(" (") + FString::Join(Commands[Index].Parameters, TEXT(", ")) + TEXT(")");
+			}
+			Result += TEXT("\n");
+		}
 
 #if !UE_BUILD_SHIPPING
 		Result += TEXT("Reasoning: ") + Reasoning + TEXT("\n");
@@ -198,6 +352,43 @@ struct LLMCONNECTOR_API FLLMResponseBase
 		return Result;
 	}
 
+	// Single command view for handlers, with the shared message and only the matching tool call
+	FLLMResponseBase GetCommandResponse(int32 Index) const;
+
+	// Copy the first command into Command, Target and Parameters
+	void UpdatePrimaryCommand();
+
+	// Typed access, Default if the parameter is missing or could not be converted
+	int32 GetIntParameter(int32 Index, int32 Default = 0) const
+	{
+		return TypedParameters.IsValidIndex(Index) && TypedParameters[Index].bValid ? TypedParameters[Index].IntValue : Default;
+	}
+
+	float GetFloatParameter(int32 Index, float Default = 0.0f) const
+	{
+		return TypedParameters.IsValidIndex(Index) && TypedParameters[Index].bValid ? TypedParameters[Index].FloatValue : Default;
+	}
+
+	bool GetBoolParameter(int32 Index, bool Default = false) const
+	{
+		return TypedParameters.IsValidIndex(Index) && TypedParameters[Index].bValid ? TypedParameters[Index].BoolValue : Default;
+	}
+
+	FVector GetVectorParameter(int32 Index, const FVector& Default = FVector::ZeroVector) const
+	{
+		return TypedParameters.IsValidIndex(Index) && TypedParameters[Index].bValid ? TypedParameters[Index].VectorValue : Default;
+	}
+
+	FName GetNameParameter(int32 Index, FName Default = NAME_None) const
+	{
+		return TypedParameters.IsValidIndex(Index) && TypedParameters[Index].bValid ? TypedParameters[Index].NameValue : Default;
+	}
+
+	int32 GetEnumParameter(int32 Index, int32 Default = INDEX_NONE) const
+	{
+		return TypedParameters.IsValidIndex(Index) && TypedParameters[Index].bValid ? TypedParameters[Index].EnumIndex : Default;
+	}
+
 	// use as "by {command} command with {parameters} parameters.."
 	FString GetFormatString(const FString& Text) const
 	{
@@ -227,6 +418,14 @@ struct LLMCONNECTOR_API FLLMPromptBase
 	/** Message content text */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Prompt", meta = (MultiLine = true))
 	FString Content;
+
+	/** Assistant only: tool calls requested in this message */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Prompt")
+	TArray<FLLMToolCall> ToolCalls;
+
+	/** Tool only: id of the call this message is the result of */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Prompt")
+	FString ToolCallId;
 	
 
 	FLLMPromptBase()
@@ -238,7 +437,8 @@ struct LLMCONNECTOR_API FLLMPromptBase
 	bool operator ==(const FLLMPromptBase& Other) const
 	{
 		return Role == Other.Role &&
-			Content == Other.Content;
+			Content == Other.Content &&
+			ToolCallId == Other.ToolCallId;
 	}
 };
 
@@ -264,6 +464,18 @@ struct LLMCONNECTOR_API FLLMCommandStruct
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command", meta = (MultiLine = true))
 	FString Description;
 
+	/** Positional parameters, converted once into FLLMResponseBase::TypedParameters */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	TArray<FLLMCommandParameter> ParameterSchema;
+
+	/** Matched by FLLMCommandScope::RequiredTags together with the tags of the command actor */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	TArray<FName> Tags;
+
+	/** Queued commands of higher priority are executed first when execution spreads over frames */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	int32 Priority = 0;
+
 	/** Example uses of the command to guide LLM */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command", meta = (MultiLine = true))
 	TArray<FString> Examples;
@@ -276,3 +488,34 @@ struct LLMCONNECTOR_API FLLMCommandStruct
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command", meta = (AllowAbstract = false))
 	TSubclassOf<UObject> HelperClass;
 };
+
+
+
+/**
+ * Limits the advertised commands to those relevant to a listener
+ * Commands without an actor are global and always included, the rest are taken nearest first
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMCommandScope
+{
+	GENERATED_BODY()
+
+	/** Usually the pawn the LLM speaks for, without it only global commands are advertised */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	TWeakObjectPtr<AActor> Listener;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command", meta = (ClampMin = "1.0"))
+	float MaxDistance = 3000.0f;
+
+	/** Skip commands of actors hidden from the listener eyes by the visibility channel */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	bool bRequireLineOfSight = false;
+
+	/** If set, the command or its actor must have one of these tags */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command")
+	TArray<FName> RequiredTags;
+
+	/** Upper bound of advertised commands, keeps the prompt size independent of the world size */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "LLM|Command", meta = (ClampMin = "1"))
+	int32 MaxCommands = 32;
+};
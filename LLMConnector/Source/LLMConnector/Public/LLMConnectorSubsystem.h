@@ -4,20 +4,67 @@
 #include "CoreMinimal.h"
 #include "LLMCommandHandler.h"
 #include "LLMConnectorStructs.h"
+#include "LLMCommandSpatialIndex.h"
+#include "LLMConversation.h"
+#include "LLMTrafficTrace.h"
+#include "LLMRateLimiter.h"
 #include "Interfaces/IHttpRequest.h"
+#include "Containers/Ticker.h"
 #include "Subsystems/GameInstanceSubsystem.h"
 
 #include "LLMConnectorSubsystem.generated.h"
 
 class ULLMSettings;
+class FLLMEmbeddedBackend;
+class FLLMTokenizer;
+class FLLMContextRegistry;
+class FJsonValue;
+enum class ELLMResponseFormatMode : uint8;
 
 DECLARE_LOG_CATEGORY_EXTERN(LLM, Log, All);
 
 
-DECLARE_MULTICAST_DELEGATE_OneParam(FOnLLMResponseNative, const FLLMResponseBase& /* ResponseParams */);
-DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnLLMResponse, const FLLMResponseBase&, ResponseParams);
-DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnLLMError, ELLMErrorType, ErrorType);
-DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnProceedCommandsResponse, const FLLMResponseBase&, ResponseParams);
+DECLARE_MULTICAST_DELEGATE_TwoParams(FOnLLMRequestCompletedNative, int32 /* RequestId */, const FLLMResponseBase& /* ResponseParams */);
+DECLARE_MULTICAST_DELEGATE_TwoParams(FOnLLMRequestFailedNative, int32 /* RequestId */, ELLMErrorType /* ErrorType */);
+
+
+
+// Entry of the command handler registry
+struct FLLMRegisteredCommandHandler
+{
+	// Kept alive until unregistered; nullptr once the handler was destroyed explicitly
+	ULLMCommandHandlerBase* Handler = nullptr;
+	uint32 Serial = 0;
+	// Set for commands that had an actor at registration
+	TWeakObjectPtr<AActor> Actor;
+	bool bSpatial = false;
+};
+
+
+
+// Request answering every conversation that sent the same payload
+struct FLLMInFlightPayload
+{
+	FHttpRequestPtr Request;
+	// Attached after the first one, not counted against MaxConcurrentRequests
+	TArray<TWeakObjectPtr<ULLMConversation>> Followers;
+};
+
+
+
+// Commands of one response waiting for execution, in order
+struct FLLMCommandBatch
+{
+	FLLMResponseBase Response;
+	int32 NextCommand = 0;
+	int32 Priority = 0;
+	uint64 Sequence = 0;
+	// Tool call id and result, sent when the batch is finished
+	TArray<TPair<FString, FString>> ToolResults;
+	bool bHasToolResultForLLM = false;
+	// Receives the results
+	TWeakObjectPtr<ULLMConversation> Conversation;
+};
 
 
 
@@ -31,9 +78,88 @@ public:
 	static ULLMConnectorSubsystem* GetLLMConnector(const UObject* WorldContextObject);
 
 
+	// New conversation with its own history and command scope, e.g. one per NPC
+	// Requests of all conversations share MaxConcurrentRequests; the caller keeps the conversation alive
+	// SaveId restores the conversation from the loaded save, see ULLMConversation::SetSaveId
+	UFUNCTION(BlueprintCallable, Category = "LLM|Conversation")
+	ULLMConversation* CreateConversation(FName SaveId = NAME_None);
+
+	// Conversation behind the messages, history and scope functions of the subsystem
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	ULLMConversation* GetDefaultConversation() const;
+
+	// Requests in progress, and conversations waiting for a free request slot
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	int32 GetNumActiveRequests() const;
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	int32 GetNumWaitingConversations() const;
+
+	// Provider rate limits left, low values are a hint to use scripted lines instead
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	FLLMRateLimitHeadroom GetRateLimitHeadroom() const;
+
+	// Time of the startup connection, -1 until it is done or without bPreconnectAtStartup
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	float GetPreconnectSeconds() const;
+
+	// Duration of the first request, to compare with and without warm-up
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	float GetFirstResponseSeconds() const;
+
+
+	// Binary histories of the conversations with a save id, e.g. for ULLMConversationSaveGame
+	// Loaded conversations that were not used since the load are copied from the loaded save
+	UFUNCTION(BlueprintCallable, Category = "LLM|Save")
+	void SaveConversations(TArray<uint8>& OutData) const;
+
+	// Reads only the save directory; each conversation is restored when it is next used
+	// Conversations with a save id missing from the save keep their history
+	UFUNCTION(BlueprintCallable, Category = "LLM|Save")
+	bool LoadConversations(const TArray<uint8>& Data);
+
+	UFUNCTION(BlueprintCallable, Category = "LLM|Save")
+	bool SaveConversationsToFile(const FString& FileName) const;
+
+	// Memory-mapped where the platform supports it, the file stays open until the next load
+	UFUNCTION(BlueprintCallable, Category = "LLM|Save")
+	bool LoadConversationsFromFile(const FString& FileName);
+
+
+	// Responses come from the traffic trace, see ULLMSettings::TrafficMode
+	UFUNCTION(BlueprintPure, Category = "LLM|Traffic")
+	bool IsReplayingTraffic() const;
+
+	// Neither a replay nor a local server or model that works without a key
+	bool IsApiKeyRequired() const;
+
+	// Requests are answered in-process, see ELLMBackendProfile::Embedded
+	UFUNCTION(BlueprintPure, Category = "LLM|Utilities")
+	bool IsUsingEmbeddedBackend() const;
+
+	// URL on the server of ApiURL, e.g. "/health"; empty if ApiURL has no "/v1/" path
+	FString GetServerURL(const FString& Path) const;
+
+	// Vocabulary of ULLMSettings::TokenizerFile, nullptr until it is loaded
+	const FLLMTokenizer* GetTokenizer() const;
+
+	// Exact with a loaded tokenizer, otherwise estimated
+	UFUNCTION(BlueprintPure, Category = "LLM|Utilities")
+	int32 CountTokens(const FString& Text) const;
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Utilities")
+	bool HasTokenizer() const;
+
+
 	// Function to send message  ✉-->
+	// Returns the request id passed to OnRequestCompletedNative / OnRequestFailedNative, 0 if it could not be queued
+	// Prompts queued while a request is in progress are answered together by the next response
 	UFUNCTION(BlueprintCallable, Category = "LLM|Communication")
-	void SendLLMPrompt(const FString& Message, ELLMRole Role);
+	int32 SendLLMPrompt(const FString& Message, ELLMRole Role);
+
+	// Same as SendLLMPrompt for C++, the future is set on the game thread with the response to this prompt
+	// Can be called from any thread; chain work with TFuture::Next / Then or co_await it (LLMPromptAwaitable.h)
+	TFuture<FLLMPromptResult> SendPromptAsync(const FString& Message, ELLMRole Role, const FLLMCancellationToken& Token = FLLMCancellationToken());
 
 	// Optionally - to send messages after responding
 	UFUNCTION(BlueprintPure, Category = "LLM|Communication")
@@ -56,7 +182,10 @@ public:
 	void ClearPromptHistory();
 
 	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
-	const TArray<FLLMPromptBase>& GetPromptHistory() const;
+	TArray<FLLMPromptBase> GetPromptHistory() const;
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	int32 GetNumPromptHistory() const;
 
 
 	// Set number of reserved messages at the beginning of history
@@ -68,18 +197,64 @@ public:
 	int32 GetCountReservedMessages() const;
 
 
-	// Registering a command handler
+	// Instead of reserving the whole world description, send only the TopK entries relevant to each user prompt
+	// The registry is read on the game thread when a user prompt is sent, pass nullptr to disable
+	void SetRelevantContext(TSharedPtr<const FLLMContextRegistry> Registry, int32 TopK = 8, ELLMPromptFormat Format = ELLMPromptFormat::Indented);
+
+
+	// Registering a command handler, the same handle is returned if it is already registered
+	// The subsystem keeps the handler alive until UnregisterCommandHandler
 	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
-	void RegisterCommandHandler(ULLMCommandHandlerBase* Handler);
+	FLLMCommandHandlerHandle RegisterCommandHandler(ULLMCommandHandlerBase* Handler);
+
+	// Removes the handler from commands and prompts, safe to call with a stale handle
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	bool UnregisterCommandHandler(FLLMCommandHandlerHandle Handle);
+
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	bool UnregisterCommandHandlerObject(ULLMCommandHandlerBase* Handler);
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
+	int32 GetNumCommandHandlers() const;
 
 	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
 	TArray<FLLMCommandStruct> GetParamsRegisterCommands() const;
 
+	// Advertise only the commands relevant to the listener in prompts, schema and tools
+	// The scope is re-evaluated before each request
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	void SetCommandScope(const FLLMCommandScope& Scope);
+
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	void ClearCommandScope();
+
+	// Re-evaluate the scope now, e.g. before GetContextCommands
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	void UpdateCommandScope();
+
+	// Registered commands, or the commands in the scope if one is set
+	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
+	TArray<FLLMCommandStruct> GetAdvertisedCommands() const;
+
 	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
-	FString GetContextCommands(const FString& InfoText = TEXT("Available Commands")) const;
+	FString GetContextCommands(const FString& InfoText = TEXT("Available Commands"), ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
 
-	// Processing command and trying to send it back ✉-->
+	// Queue the response commands and execute them within the frame budget, results are sent back ✉-->
 	void TryProcessCommand(const FLLMResponseBase& ResponseParams);
+
+	// Commands waiting for the next frames
+	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
+	int32 GetNumQueuedCommands() const;
+
+	// Tool calls mode: answer a tool call with the handler result, optionally requesting a new response ✉-->
+	// Every tool call must be answered before the next request, call it when handling commands yourself
+	UFUNCTION(BlueprintCallable, Category = "LLM|Communication")
+	void SendLLMToolResult(const FString& ToolCallId, const FString& Result, bool bRequestResponse);
+
+	// Data for the LLM from a command handler ✉-->
+	// Results within CommandResultsWindowSeconds are merged into one system message, queued if a request is in progress
+	UFUNCTION(BlueprintCallable, Category = "LLM|Communication")
+	void QueueCommandResult(const FString& Result);
 	
 	// Find a handler that can process this command
 	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
@@ -88,8 +263,9 @@ public:
 	template <class T>
 	T* FindCommandHandlerT(const FLLMResponseBase& ResponseParams)
 	{
-		for(ULLMCommandHandlerBase* Handler : m_CommandHandlers)
+		for(const int32 Slot : m_CommandHandlerOrder)
 		{
+			ULLMCommandHandlerBase* Handler = m_CommandHandlers[Slot].Handler;
 			if(Handler != nullptr && Handler->CanExecuteCommand(ResponseParams))
 			{
 				if(T* TypedHandler = Cast<T>(Handler))
@@ -106,12 +282,19 @@ public:
 	virtual void Initialize(FSubsystemCollectionBase& Collection) override;
 	virtual void Deinitialize() override;
 	//~ End USubsystem Interface
+
+	// Registered handlers are kept alive until UnregisterCommandHandler
+	static void AddReferencedObjects(UObject* InThis, FReferenceCollector& Collector);
 	
-	/* Response delegates */	
+	/* Response delegates of the default conversation */	
 	UPROPERTY(BlueprintAssignable, Category = "LLM|Events")
 	FOnLLMResponse OnResponseReceived;
 	// Delegates for C++ use (non-UObject handlers)
 	FOnLLMResponseNative OnResponseReceivedNative;
+
+	// Per request results of all conversations, for waiters that must not react to other responses
+	FOnLLMRequestCompletedNative OnRequestCompletedNative;
+	FOnLLMRequestFailedNative OnRequestFailedNative;
 	
 	UPROPERTY(BlueprintAssignable, Category = "LLM|Events")
 	FOnLLMError OnError;
@@ -120,6 +303,8 @@ public:
 	FOnProceedCommandsResponse OnHandleProceedCommandsResponse;
 	
 protected:
+	friend class ULLMConversation;
+
 	static FString ConvertLLMRoleToString(ELLMRole Role);
 
 	// Processing the JSON response from LLM  <--✉
@@ -128,25 +313,181 @@ protected:
 	// Finding a suitable handler for the command
 	ELLMErrorType TryParseParamsFromResponse(const FString& Response, FLLMResponseBase& OutResponseParams);
 
-	FLLMPromptNode GetInstructionsForResponseFormat() const;
+	void BroadcastRequestsFailed(const TArray<int32>& RequestIds, ELLMErrorType ErrorType);
+	void CompletePromptWaiter(int32 RequestId, ELLMErrorType ErrorType, const FLLMResponseBase& Response = FLLMResponseBase());
+	bool IsPromptCancelled(int32 RequestId) const;
+
+	// The conversation has prompts to send, it starts its request when a slot is free
+	void ScheduleRequest(ULLMConversation* Conversation);
+
+	// Warm-up of the reserved context, it gets a slot when no conversation waits for one
+	void ScheduleWarmUp(ULLMConversation* Conversation);
+
+	// Start requests of waiting conversations, in arrival order, up to MaxConcurrentRequests
+	void StartScheduledRequests();
+
+	// The provider limits don't allow Tokens now, the scheduled requests start again when they do
+	bool WaitForRateLimit(int32 Tokens);
+
+	// Send a warm-up, unless the same prefix was already warmed
+	void SendWarmUpRequest(FHttpRequestPtr Request, const FString& Payload, int32 Tokens);
+
+	// Queue the response commands and execute them within the frame budget
+	void QueueCommandBatch(ULLMConversation* Conversation, const FLLMResponseBase& ResponseParams);
+
+	// Tool calls of the conversation are still waiting for execution
+	bool HasQueuedToolCalls(const ULLMConversation* Conversation) const;
+
+	// Run queued commands until CommandExecutionBudgetMs of this frame is used
+	void ExecuteQueuedCommands();
+
+	// Answer the tool calls of an executed response
+	void FinishCommandBatch(FLLMCommandBatch& Batch);
+
+	// Settings mode, or JsonObject once the provider has rejected it
+	ELLMResponseFormatMode GetActiveResponseFormatMode() const;
+
+	// Switch every conversation to prompt instructions
+	void OnResponseFormatRejected();
+
+	// Registered commands changed, rebuild schemas and tools on the next request
+	void OnCommandHandlersChanged();
+
+	// Drop the registry entries of handlers destroyed without unregistering, e.g. by MarkAsGarbage
+	void RemoveDestroyedCommandHandlers();
+
+	// Give the conversation its history from the loaded save
+	void AttachLoadedConversation(ULLMConversation* Conversation) const;
+
+	bool OnConversationsLoaded(const TSharedPtr<const FLLMConversationArchive>& Archive);
+
+	// Re-read command actor locations when the index is dirty or old
+	void RefreshCommandSpatialIndex();
+
+	// Convert Parameters once by the ParameterSchema of the matching command
+	void ParseTypedParameters(FLLMResponseBase& ResponseParams);
+
+	// Fill command fields from "tool_calls" of the response message
+	ELLMErrorType TryParseParamsFromToolCalls(const TArray<TSharedPtr<FJsonValue>>& ToolCalls, FLLMResponseBase& OutParams) const;
+
+	// Function name for the command, limited to [a-zA-Z0-9_-]{1,64} and unique; the same in every conversation
+	// Empty if the command name has no usable character
+	FString GetToolName(const FString& CommandName) const;
 	
 
 	void OnHttpResponse(FHttpRequestPtr Request, FHttpResponsePtr Response, bool bSuccess);
 
+	// Response of a live or replayed request, passed to its conversation
+	void OnRequestFinished(FHttpRequestPtr Request, bool bSuccess, int32 ResponseCode, const FString& Content);
+
+	// Settings mode, or the command line for automated runs
+	void OpenTrafficTrace();
+
+	// Answer the prepared request from the trace after the recorded time
+	void ReplayRequest(FHttpRequestPtr Request, const FString& Payload);
+
+	// Generate the response to the prepared request with the embedded model
+	void RunEmbeddedRequest(FHttpRequestPtr Request, const FString& Payload);
+
+	// Server slot for a new conversation, INDEX_NONE if the server chooses
+	int32 AllocateServerSlot();
+
+	// Health request to a local server while no request keeps the connection busy
+	void StartKeepAlive();
+
+	// Request in flight with the same payload, the conversation gets its response too
+	// nullptr if there is none, then Request is registered for the next ones
+	FHttpRequestPtr ShareInFlightRequest(ULLMConversation* Conversation, const FHttpRequestPtr& Request, const FString& Payload);
+
+	// Replays and the embedded model have no provider limits
+	bool IsRateLimited() const;
+
+	// A request really goes out, shared ones don't use the provider limits
+	void ChargeRateLimit(int32 Tokens);
+
+	// Open the connection that the first request reuses, see ULLMSettings::bPreconnectAtStartup
+	void Preconnect();
+
+	// Read the vocabulary on a worker thread, counts are estimated until then
+	void LoadTokenizer();
+
 	
 	/* Variables */
 	UPROPERTY(Transient)
 	const ULLMSettings* m_Settings;
-	
-	TArray<FLLMPromptBase> m_PromptHistory;
 
-	// To "spread" initial context over messages for a better understanding of llm
-	int32 m_ReservedMessages = 0;
+	UPROPERTY(Transient)
+	ULLMConversation* m_DefaultConversation;
+
+	// Every conversation created by this subsystem, for registry changes and shutdown
+	TArray<TWeakObjectPtr<ULLMConversation>> m_Conversations;
 	
-	UPROPERTY()
-	TArray<ULLMCommandHandlerBase*> m_CommandHandlers;
+	// Slots don't move on removal, handles stay valid while handlers come and go
+	TSparseArray<FLLMRegisteredCommandHandler> m_CommandHandlers;
+	TMap<ULLMCommandHandlerBase*, int32> m_CommandHandlerIndices;
+	// Slots in registration order; freed slots are reused, so iterate this for matching and prompts
+	TArray<int32> m_CommandHandlerOrder;
+	uint32 m_NextCommandHandlerSerial = 1;
+	FDelegateHandle m_PostGarbageCollectHandle;
+
+	// Locations of command actors, shared by the scopes of all conversations
+	FLLMCommandSpatialIndex m_CommandSpatialIndex;
+	double m_CommandSpatialIndexTime = 0.0;
+	bool m_bCommandSpatialIndexDirty = true;
 	
-	TSet<FHttpRequestPtr> m_ActiveRequests;
+	// Requests in progress and the conversation each one answers
+	TMap<FHttpRequestPtr, TWeakObjectPtr<ULLMConversation>> m_ActiveRequests;
+
+	// By hash of the payload
+	TMap<uint64, FLLMInFlightPayload> m_InFlightPayloads;
+
+	// Conversations waiting for a free request slot, oldest first
+	TArray<TWeakObjectPtr<ULLMConversation>> m_ScheduledConversations;
+
+	// Warm-ups waiting for a slot nobody else needs, and the ones in flight
+	TArray<TWeakObjectPtr<ULLMConversation>> m_ScheduledWarmUps;
+	TSet<FHttpRequestPtr> m_WarmUpRequests;
+	// Payload hash of each warm-up sent within WarmUpCacheSeconds, and when it was sent
+	TMap<uint64, double> m_WarmUpTimes;
+
+	// Holds the scheduled conversations back while the provider limits are used up
+	FLLMRateLimiter m_RateLimiter;
+	FTSTicker::FDelegateHandle m_RateLimitTickerHandle;
+
+	// Last loaded save, for conversations created after the load
+	TSharedPtr<const FLLMConversationArchive> m_LoadedConversations;
+
+	// Recording or replay of the traffic, nullptr when live
+	TUniquePtr<FLLMTrafficTrace> m_TrafficTrace;
+	float m_ReplaySpeed = 1.0f;
+
+	// Round robin over LocalServerSlots
+	int32 m_NextServerSlot = 0;
+	FTSTicker::FDelegateHandle m_KeepAliveTickerHandle;
+
+	// In-process model of the Embedded profile
+	TSharedPtr<FLLMEmbeddedBackend> m_EmbeddedBackend;
+
+	TSharedPtr<const FLLMTokenizer> m_Tokenizer;
+
+	float m_PreconnectSeconds = -1.0f;
+	float m_FirstResponseSeconds = -1.0f;
+
+	int32 m_NextRequestId = 1;
+	// Futures of SendPromptAsync by request id
+	TMap<int32, FLLMPromptWaiter> m_PromptWaiters;
+
+	// Sorted by priority, then by arrival
+	TArray<FLLMCommandBatch> m_CommandQueue;
+	uint64 m_NextCommandBatchSequence = 0;
+	FTSTicker::FDelegateHandle m_CommandQueueTickerHandle;
+	uint64 m_CommandBudgetFrame = 0;
+	double m_CommandBudgetUsedSeconds = 0.0;
+
+	// Tool function name of each command and back, filled by the tools of every conversation
+	mutable TMap<FString, FString> m_ToolNameToCommand;
+	mutable TMap<FString, FString> m_CommandToToolName;
 
-	FString m_OverrideInstructionsForResponseFormatTitle;
+	// Set once the provider answers "json_schema" or "tools" with a bad request
+	bool m_bResponseFormatRejected = false;
 };
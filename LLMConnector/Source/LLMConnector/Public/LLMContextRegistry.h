@@ -0,0 +1,110 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMContextStructs.h"
+#include "LLMRetrievalIndex.h"
+
+
+
+/**
+ * Keeps rendered prompt fragments of context descriptions between builds
+ * Only entries whose content hash changed are rendered again, the output matches
+ * FContextDescription::ConvertContextMapToNode under a root with the title
+ *
+ * Entries are changed on the game thread (FText is resolved there), rendering is safe from any thread
+ */
+class LLMCONNECTOR_API FLLMContextRegistry
+{
+public:
+	void SetTitle(const FString& InTitle);
+
+	// Returns true if the entry is new or its content has changed
+	bool SetEntry(const FString& Id, const FContextDescription& Description);
+
+	bool RemoveEntry(const FString& Id);
+
+	void Empty();
+
+	int32 Num() const;
+
+	// Entries are keyed by FullName, entries missing from the map are removed
+	template <typename T>
+	void SyncFromMap(const TMap<T, FContextDescription>& Map)
+	{
+		BeginSync();
+		for(const auto& Pair : Map)
+		{
+			SetEntry(Pair.Value.FullName, Pair.Value);
+		}
+		EndSync();
+	}
+
+
+	// Render all entries, or only the given entry indices in the given order
+	void WriteTo(FStringBuilderBase& Out, ELLMPromptFormat Format = ELLMPromptFormat::Indented, TConstArrayView<int32> EntryIndices = {}) const;
+
+	FString ToString(ELLMPromptFormat Format = ELLMPromptFormat::Indented, TConstArrayView<int32> EntryIndices = {}) const;
+
+
+	// BM25 over names, tag and description; indices are in registry order, not by score
+	TArray<int32> FindRelevantEntries(FStringView Query, int32 TopK) const;
+
+	// Only the entries relevant to the query, empty if nothing matches
+	FString ToStringRelevant(FStringView Query, int32 TopK, ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
+
+protected:
+	// FText already converted, so rendering never touches localization
+	struct FEntry
+	{
+		FString Id;
+		FString FullName;
+		FString Description;
+		FString ShortName;
+		FString AlternativeNames;
+		FString Tag;
+
+		uint32 SyncGeneration = 0;
+
+		// Cached render, valid while bDirty is false and the format matches
+		FString Fragment;
+		bool bDirty = true;
+	};
+
+	// Every rendered field equal, SetEntry then keeps the cached fragment
+	static bool HasSameContent(const FEntry& A, const FEntry& B);
+
+	static FString RenderFragment(const FEntry& Entry, ELLMPromptFormat Format);
+
+	// Call with the write lock held
+	void UpdateFragments(ELLMPromptFormat Format) const;
+
+	// Call with any lock held
+	void WriteFragments(FStringBuilderBase& Out, ELLMPromptFormat Format, TConstArrayView<int32> EntryIndices) const;
+
+	void BeginSync();
+	void EndSync();
+
+	void RebuildIdIndex();
+
+	// Call with the write lock held
+	void UpdateRetrievalIndex() const;
+
+
+	mutable FRWLock m_Lock;
+
+	FString m_Title;
+
+	// Insertion order, same as the map it was filled from
+	mutable TArray<FEntry> m_Entries;
+	TMap<FString, int32> m_IdToIndex;
+
+	mutable int32 m_NumDirty = 0;
+	mutable ELLMPromptFormat m_FragmentsFormat = ELLMPromptFormat::Indented;
+
+	uint32 m_SyncGeneration = 0;
+
+	// Rebuilt on the first query after entries change
+	mutable FLLMRetrievalIndex m_RetrievalIndex;
+	mutable bool m_bRetrievalIndexDirty = true;
+};
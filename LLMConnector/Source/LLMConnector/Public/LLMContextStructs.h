@@ -3,6 +3,7 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
 #include "LLMContextStructs.generated.h"
 
 
@@ -60,9 +61,7 @@ struct LLMCONNECTOR_API FContextDescription
 		if(AlternativeNames.Num() > 0)
 		{
 			Result += TEXT("  Alternative Names: ");
-			static TArray<FString> StrNames; StrNames.Reset();
-			Algo::Transform(AlternativeNames, StrNames, [](const FText& Text) { return Text.ToString(); });
-			Result += FString::Join(StrNames, TEXT(", "));
+			Result += GetAlternativeNamesString();
 			Result += TEXT("\n");
 		}
 
@@ -75,6 +74,21 @@ struct LLMCONNECTOR_API FContextDescription
 		return Result;
 	}
 
+	// FText to FString, game thread only for localized texts
+	FString GetAlternativeNamesString() const
+	{
+		TStringBuilder<256> Builder;
+		for(int32 Index = 0; Index < AlternativeNames.Num(); ++Index)
+		{
+			if(Index > 0)
+			{
+				Builder << TEXT(", ");
+			}
+			Builder << AlternativeNames[Index].ToString();
+		}
+		return FString(Builder.Len(), Builder.GetData());
+	}
+
 	FLLMPromptNode ToPromptNode() const
 	{
 		FLLMPromptNode Node;
@@ -90,9 +104,7 @@ struct LLMCONNECTOR_API FContextDescription
 
 		if(AlternativeNames.Num() > 0)
 		{
-			static TArray<FString> StrNames; StrNames.Reset();
-			Algo::Transform(AlternativeNames, StrNames, [](const FText& Text) { return Text.ToString(); });
-			Node.AddChild("Alternative Names", FString::Join(StrNames, TEXT(", ")));
+			Node.AddChild("Alternative Names", GetAlternativeNamesString());
 		}
 
 		if(!Tag.IsEmpty())
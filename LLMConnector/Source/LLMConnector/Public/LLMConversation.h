@@ -0,0 +1,351 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+#include "LLMPromptFuture.h"
+#include "LLMPromptText.h"
+#include "LLMConversationArchive.h"
+#include "Interfaces/IHttpRequest.h"
+#include "Containers/Ticker.h"
+#include "UObject/Object.h"
+
+#include "LLMConversation.generated.h"
+
+class ULLMConnectorSubsystem;
+class ULLMSettings;
+class FLLMContextRegistry;
+class FJsonObject;
+class FJsonValue;
+struct FLLMRegisteredCommandHandler;
+enum class ELLMResponseFormatMode : uint8;
+
+
+DECLARE_MULTICAST_DELEGATE_OneParam(FOnLLMResponseNative, const FLLMResponseBase& /* ResponseParams */);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnLLMResponse, const FLLMResponseBase&, ResponseParams);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnLLMError, ELLMErrorType, ErrorType);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnProceedCommandsResponse, const FLLMResponseBase&, ResponseParams);
+DECLARE_MULTICAST_DELEGATE_OneParam(FOnLLMTokenNative, const FString& /* Text */);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnLLMToken, const FString&, Text);
+
+
+
+// Prompt waiting for the active request to finish, merged handler results have no request id
+struct FLLMQueuedPrompt
+{
+	FLLMPromptBase Prompt;
+	int32 RequestId = 0;
+};
+
+
+
+// Caller of SendPromptAsync waiting for its request
+struct FLLMPromptWaiter
+{
+	TSharedPtr<TPromise<FLLMPromptResult>, ESPMode::ThreadSafe> Promise;
+	FLLMCancellationToken Token;
+};
+
+
+
+/**
+ * One conversation with its own history, reserved messages and command scope, e.g. per NPC
+ * Command handlers are shared; requests of all conversations go through the queue of ULLMConnectorSubsystem
+ * Create it with ULLMConnectorSubsystem::CreateConversation and keep a reference while it is used
+ */
+UCLASS(BlueprintType)
+class LLMCONNECTOR_API ULLMConversation : public UObject
+{
+	GENERATED_BODY()
+	friend class ULLMConnectorSubsystem;
+public:
+	UFUNCTION(BlueprintPure, Category = "LLM|Conversation")
+	ULLMConnectorSubsystem* GetConnector() const;
+
+
+	// Function to send message  ✉-->
+	// Returns the request id passed to OnRequestCompletedNative / OnRequestFailedNative of the connector, 0 if it could not be queued
+	// Prompts queued while a request of this conversation is in progress are answered together by the next response
+	UFUNCTION(BlueprintCallable, Category = "LLM|Communication")
+	int32 SendLLMPrompt(const FString& Message, ELLMRole Role);
+
+	// Same as SendLLMPrompt for C++, the future is set on the game thread with the response to this prompt
+	// Can be called from any thread; chain work with TFuture::Next / Then or co_await it (LLMPromptAwaitable.h)
+	TFuture<FLLMPromptResult> SendPromptAsync(const FString& Message, ELLMRole Role, const FLLMCancellationToken& Token = FLLMCancellationToken());
+
+	// No request of this conversation is in progress or waiting for a free request slot
+	UFUNCTION(BlueprintPure, Category = "LLM|Communication")
+	bool CanSendLLMPrompt() const;
+
+	// Tool calls mode: answer a tool call with the handler result, optionally requesting a new response ✉-->
+	// Every tool call must be answered before the next request, call it when handling commands yourself
+	UFUNCTION(BlueprintCallable, Category = "LLM|Communication")
+	void SendLLMToolResult(const FString& ToolCallId, const FString& Result, bool bRequestResponse);
+
+	// Data for the LLM from a command handler ✉-->
+	// Results within CommandResultsWindowSeconds are merged into one system message, queued if a request is in progress
+	UFUNCTION(BlueprintCallable, Category = "LLM|Communication")
+	void QueueCommandResult(const FString& Result);
+
+	// Queue the response commands on the connector, results come back to this conversation ✉-->
+	void TryProcessCommand(const FLLMResponseBase& ResponseParams);
+
+
+	// Instructions for JSON response Format	
+	UFUNCTION(BlueprintCallable, Category = "LLM|Instructions")
+	void SetOverrideInstructionsForResponseFormatTitle(const FString& Title);
+
+
+	// Prompt History
+	UFUNCTION(BlueprintCallable, Category = "LLM|Messages")
+	void AddPromptHistory(const FLLMPromptBase& Prompt);
+	
+	UFUNCTION(BlueprintCallable, Category = "LLM|Messages")
+	void RemovePromptHistory(const FLLMPromptBase& Prompt);
+	
+	UFUNCTION(BlueprintCallable, Category = "LLM|Messages")
+	void ClearPromptHistory();
+
+	// Copy of the history, messages are stored as shared UTF-8 text
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	TArray<FLLMPromptBase> GetPromptHistory() const;
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	int32 GetNumPromptHistory() const;
+
+	// Bytes of the history text, including buffers shared with other conversations
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	int64 GetPromptHistoryBytes() const;
+
+	// Bytes of the history text no other copy refers to
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	int64 GetUniquePromptHistoryBytes() const;
+
+	// Tokens the history takes in a request, exact with ULLMSettings::TokenizerFile
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	int32 GetPromptHistoryTokens() const;
+
+
+	// Set number of reserved messages at the beginning of history
+	// These messages won't be removed when history gets trimmed
+	UFUNCTION(BlueprintCallable, Category = "LLM|Messages")
+	void SetCountReservedMessages(int32 ReservedNum);
+	
+	UFUNCTION(BlueprintPure, Category = "LLM|Messages")
+	int32 GetCountReservedMessages() const;
+
+	// Send the reserved messages alone with a one token response, so the provider caches them as the prompt prefix
+	// Waits for free request slots and the rate limits like prompts, after them
+	// Called by SetCountReservedMessages with ULLMSettings::bWarmUpReservedContext
+	UFUNCTION(BlueprintCallable, Category = "LLM|Messages")
+	void WarmUpReservedContext();
+
+
+	// Id of the conversation in saves of ULLMConnectorSubsystem::SaveConversations, e.g. the NPC name
+	// A loaded history with this id is restored when the conversation is next used
+	UFUNCTION(BlueprintCallable, Category = "LLM|Save")
+	void SetSaveId(FName SaveId);
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Save")
+	FName GetSaveId() const;
+
+	// The loaded history is not decoded yet
+	UFUNCTION(BlueprintPure, Category = "LLM|Save")
+	bool IsRestorePending() const;
+
+	void SaveState(FLLMSavedConversation& OutState) const;
+	void RestoreState(FLLMSavedConversation&& State);
+
+
+	// Instead of reserving the whole world description, send only the TopK entries relevant to each user prompt
+	// The registry is read on the game thread when a user prompt is sent, pass nullptr to disable
+	void SetRelevantContext(TSharedPtr<const FLLMContextRegistry> Registry, int32 TopK = 8, ELLMPromptFormat Format = ELLMPromptFormat::Indented);
+
+
+	// Advertise only the commands relevant to the listener in prompts, schema and tools
+	// The scope is re-evaluated before each request
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	void SetCommandScope(const FLLMCommandScope& Scope);
+
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	void ClearCommandScope();
+
+	// Re-evaluate the scope now, e.g. before GetContextCommands
+	UFUNCTION(BlueprintCallable, Category = "LLM|Commands")
+	void UpdateCommandScope();
+
+	// Registered commands, or the commands in the scope if one is set
+	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
+	TArray<FLLMCommandStruct> GetAdvertisedCommands() const;
+
+	UFUNCTION(BlueprintPure, Category = "LLM|Commands")
+	FString GetContextCommands(const FString& InfoText = TEXT("Available Commands"), ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
+
+
+	//~ Begin UObject Interface
+	virtual void BeginDestroy() override;
+	//~ End UObject Interface
+
+	/* Response delegates */	
+	UPROPERTY(BlueprintAssignable, Category = "LLM|Events")
+	FOnLLMResponse OnResponseReceived;
+	// Delegates for C++ use (non-UObject handlers)
+	FOnLLMResponseNative OnResponseReceivedNative;
+	
+	UPROPERTY(BlueprintAssignable, Category = "LLM|Events")
+	FOnLLMError OnError;
+	
+	UPROPERTY(BlueprintAssignable, Category = "LLM|Events")
+	FOnProceedCommandsResponse OnHandleProceedCommandsResponse;
+
+	// Embedded backend: raw response text while it is generated, before OnResponseReceived
+	UPROPERTY(BlueprintAssignable, Category = "LLM|Events")
+	FOnLLMToken OnTokenReceived;
+	FOnLLMTokenNative OnTokenReceivedNative;
+
+protected:
+	void Setup(ULLMConnectorSubsystem* Connector);
+
+	// Fail waiting prompts and stop tickers, the connector is going away
+	void Shutdown();
+
+	// The history is decoded from the loaded save on first use
+	void SetPendingRestore(const TSharedPtr<const FLLMConversationArchive>& Archive);
+	void RestorePendingHistory();
+
+	// Queue a prompt and send it, or leave it for the end of the active request
+	int32 SendPromptInternal(const FLLMPromptBase& Prompt, FLLMPromptWaiter* Waiter = nullptr);
+
+	// Ask the connector for a request slot when there is something to send
+	void SendQueuedPrompts();
+
+	// Cancelled prompts never reach the history
+	void RemoveCancelledPrompts();
+
+	// A request slot is free: add all queued prompts to history and answer them with one request
+	void StartRequest();
+
+	// Send the current history as a request  ✉-->
+	void DispatchPromptHistory();
+
+	// POST to ApiURL with the headers of the backend profile
+	TSharedRef<IHttpRequest, ESPMode::ThreadSafe> CreateHttpRequest() const;
+
+	// Request body with the first NumMessages of history, and the tools or response format of FormatMode
+	TSharedPtr<FJsonObject> BuildRequestPayload(ELLMResponseFormatMode FormatMode, int32 NumMessages) const;
+
+	// Send the scheduled warm-up of WarmUpReservedContext
+	void DispatchWarmUp();
+
+	// Response to the request of this conversation  <--✉
+	// Retries stay here, the final answer is passed on to m_SharedFollowers
+	void HandleResponse(bool bSuccess, int32 ResponseCode, const FString& ResponseString);
+
+	// Final answer to the request of another conversation that had the same payload
+	void HandleSharedResponse(bool bSuccess, const FLLMResponseBase& Response);
+
+	// Add the answer to history and tell the waiters; commands run only for the conversation that sent the request
+	void CompleteResponse(const TArray<int32>& RequestIds, bool bSuccess, const FLLMResponseBase& Response, bool bSentRequest);
+
+	void ScheduleCommandResultsFlush();
+	void FlushCommandResults();
+
+	// Broadcast to this conversation, and to the connector delegates for its default conversation
+	void BroadcastResponse(const FLLMResponseBase& Response);
+	void BroadcastError(ELLMErrorType ErrorType);
+	void BroadcastProceedCommands(const FLLMResponseBase& Response);
+	bool IsHandlingCommandsExternally() const;
+	bool IsDefaultConversation() const;
+
+	FLLMPromptNode GetInstructionsForResponseFormat() const;
+
+	// Strict "json_schema" response format built from the advertised commands
+	TSharedPtr<FJsonObject> GetResponseFormatJsonSchema() const;
+
+	// "tools" array built from the advertised commands
+	const TArray<TSharedPtr<FJsonValue>>& GetCommandTools() const;
+
+	// Advertised commands changed, rebuild schema and tools on the next request
+	void ResetCommandFormats();
+
+	bool IsCommandInScopeByTags(const FLLMRegisteredCommandHandler& Entry, const AActor* Actor) const;
+
+	// Replace the format instructions message in history with the current one
+	void UpdateFormatInstructionsMessage(bool bMoveToEnd);
+
+	// Replace the relevant context message in history with entries matching the prompt
+	void UpdateRelevantContextMessage(const FString& Prompt);
+
+	// Remove the oldest messages after the reserved ones over MaxHistoryMessages and MaxHistoryTokens
+	void TrimPromptHistory();
+
+	// Share the buffers of the reserved messages with other conversations that have the same text
+	void InternReservedMessages();
+
+	int32 CountPromptTokens(const FLLMStoredPrompt& Stored) const;
+
+	// History, queued prompts and the response, as providers count them against the tokens per minute
+	int32 EstimateRequestTokens() const;
+	int32 EstimateWarmUpTokens() const;
+
+
+	/* Variables */
+	UPROPERTY(Transient)
+	ULLMConnectorSubsystem* m_Connector;
+
+	UPROPERTY(Transient)
+	const ULLMSettings* m_Settings;
+
+	TArray<FLLMStoredPrompt> m_PromptHistory;
+
+	// To "spread" initial context over messages for a better understanding of llm
+	int32 m_ReservedMessages = 0;
+
+	// Slot of the local server with the KV cache of this conversation
+	int32 m_ServerSlot = INDEX_NONE;
+
+	FName m_SaveId;
+	// Loaded save with the history of m_SaveId, until it is restored
+	TSharedPtr<const FLLMConversationArchive> m_PendingRestore;
+
+	// Prompts waiting for the active request to finish
+	TArray<FLLMQueuedPrompt> m_PromptQueue;
+	// Ids of the prompts answered by the request in progress
+	TArray<int32> m_ActiveRequestIds;
+	FHttpRequestPtr m_ActiveRequest;
+	// In the connector queue, waiting for a free request slot
+	bool m_bWaitingForRequestSlot = false;
+	// Tool results in history are waiting for a response
+	bool m_bFollowUpRequested = false;
+	// The provider answered 429, the same history goes again when the rate limit allows
+	bool m_bResendingRequest = false;
+	int32 m_RateLimitedAttempts = 0;
+	int32 m_FormatRejectedAttempts = 0;
+	// Conversations waiting for the answer to this one's request, kept over its retries
+	TArray<TWeakObjectPtr<ULLMConversation>> m_SharedFollowers;
+	ELLMResponseFormatMode m_ActiveRequestFormatMode{};
+
+	// Handler results collected during the window
+	TArray<FString> m_PendingCommandResults;
+	FTSTicker::FDelegateHandle m_CommandResultsTickerHandle;
+
+	// Command scope and the registry slots it selected, sorted
+	FLLMCommandScope m_CommandScope;
+	bool m_bHasCommandScope = false;
+	TArray<int32> m_ScopedCommandSlots;
+
+	FString m_OverrideInstructionsForResponseFormatTitle;
+
+	// Last format instructions added to history, to replace it on the next turn
+	FLLMPromptText m_FormatInstructionsContent;
+
+	// Retrieval of the world context per user prompt
+	TSharedPtr<const FLLMContextRegistry> m_RelevantContext;
+	int32 m_RelevantContextTopK = 8;
+	ELLMPromptFormat m_RelevantContextFormat = ELLMPromptFormat::Indented;
+	FLLMPromptText m_RelevantContextContent;
+
+	// Rebuilt after the advertised commands change
+	mutable TSharedPtr<FJsonObject> m_CachedResponseFormatSchema;
+	mutable TArray<TSharedPtr<FJsonValue>> m_CachedCommandTools;
+};
@@ -0,0 +1,100 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMPromptText.h"
+#include "GameFramework/SaveGame.h"
+
+#include "LLMConversationArchive.generated.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+
+
+// Saved state of one conversation
+struct LLMCONNECTOR_API FLLMSavedConversation
+{
+	TArray<FLLMStoredPrompt> History;
+	int32 ReservedMessages = 0;
+	// History messages with the format instructions and the relevant context, replaced on the next turn
+	int32 FormatInstructionsIndex = INDEX_NONE;
+	int32 RelevantContextIndex = INDEX_NONE;
+};
+
+
+
+/**
+ * Binary conversations of a save, by save id
+ * Texts of system messages are written once for all conversations
+ * Opening reads only the directory, the history of a conversation is decoded when it is restored
+ */
+class LLMCONNECTOR_API FLLMConversationArchive
+{
+public:
+	~FLLMConversationArchive();
+
+	static void Write(const TMap<FName, FLLMSavedConversation>& Conversations, TArray<uint8>& OutData);
+
+	// nullptr if the data is not a valid archive
+	static TSharedPtr<FLLMConversationArchive> Open(TArray<uint8>&& Data);
+
+	// Maps the file where the platform supports it, otherwise reads it
+	static TSharedPtr<FLLMConversationArchive> OpenFile(const FString& FileName);
+
+	bool Contains(FName SaveId) const
+	{
+		return m_Entries.Contains(SaveId);
+	}
+
+	void GetSaveIds(TArray<FName>& OutSaveIds) const
+	{
+		m_Entries.GetKeys(OutSaveIds);
+	}
+
+	int32 GetNumMessages(FName SaveId) const;
+	int32 GetReservedMessages(FName SaveId) const;
+
+	bool Read(FName SaveId, FLLMSavedConversation& OutConversation) const;
+
+private:
+	struct FEntry
+	{
+		int64 Offset = 0;
+		int32 NumMessages = 0;
+		int32 ReservedMessages = 0;
+	};
+
+	FLLMConversationArchive() = default;
+
+	bool ParseDirectory();
+
+	FLLMPromptText GetSharedText(uint32 Index) const;
+
+	// Owned data or the mapped file region
+	TArray<uint8> m_Data;
+	TUniquePtr<IMappedFileHandle> m_MappedFile;
+	TUniquePtr<IMappedFileRegion> m_MappedRegion;
+	const uint8* m_View = nullptr;
+	int64 m_ViewSize = 0;
+
+	TMap<FName, FEntry> m_Entries;
+	// Texts stay in the data until a conversation uses them
+	TArray<FUtf8StringView> m_SharedTextViews;
+	mutable TArray<FLLMPromptText> m_SharedTexts;
+};
+
+
+
+/**
+ * Save game with the conversations of ULLMConnectorSubsystem::SaveConversations
+ * A save game of the project can keep the same TArray<uint8> instead
+ */
+UCLASS()
+class LLMCONNECTOR_API ULLMConversationSaveGame : public USaveGame
+{
+	GENERATED_BODY()
+public:
+	UPROPERTY(BlueprintReadWrite, Category = "LLM|Save")
+	TArray<uint8> Conversations;
+};
@@ -0,0 +1,22 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+class FJsonObject;
+class FJsonValue;
+
+
+
+/**
+ * One-pass tolerant reader of JSON written by a model, builds FJsonObject straight from the text
+ * Accepts code fences and prose around the object, comments, trailing or missing commas,
+ * single-quoted strings, unquoted keys and words, raw line breaks in strings and Python literals
+ * Nothing is allocated except the resulting values
+ */
+struct LLMCONNECTOR_API FLLMLenientJson
+{
+	// First object in Text, nullptr if there is none or it is not closed
+	// OutError gets the reason and the position
+	static TSharedPtr<FJsonObject> ParseObject(FStringView Text, FString* OutError = nullptr);
+};
@@ -0,0 +1,39 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+
+
+
+/**
+ * FStringView based parsing of command parameters
+ * Nothing here allocates, except StringValue and NameValue of the converted value
+ */
+struct LLMCONNECTOR_API FLLMParameterParser
+{
+	using FViewArray = TArray<FStringView, TInlineAllocator<8>>;
+
+	// Views into Source, Source must outlive them
+	static void Split(FStringView Source, FStringView Delimiter, FViewArray& OutParts, bool bCullEmpty = true);
+
+	// First integer in the text, so "5seconds" and "for 5" both give 5
+	static bool TryParseInt(FStringView Text, int32& OutValue);
+
+	static bool TryParseFloat(FStringView Text, float& OutValue);
+	static bool TryParseDouble(FStringView Text, double& OutValue);
+
+	// true/false, yes/no, on/off, 1/0
+	static bool TryParseBool(FStringView Text, bool& OutValue);
+
+	// "x,y,z", "x y z", "[x,y,z]" or "(X=..,Y=..,Z=..)"
+	static bool TryParseVector(FStringView Text, FVector& OutValue);
+
+	// Case-insensitive index in Values
+	static bool TryParseEnum(FStringView Text, TConstArrayView<FString> Values, int32& OutIndex);
+
+	static FLLMParameterValue ParseValue(FStringView Text, const FLLMCommandParameter& Parameter);
+
+	// One value per schema entry, missing optional parameters stay invalid
+	static bool ParseParameters(const TArray<FLLMCommandParameter>& Schema, TConstArrayView<FString> Parameters, TArray<FLLMParameterValue>& OutValues);
+};
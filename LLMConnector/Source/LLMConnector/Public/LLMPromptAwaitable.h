@@ -0,0 +1,53 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMPromptFuture.h"
+
+// Only with C++20 coroutine support in the including module
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+
+
+
+/**
+ * co_await on the future of SendPromptAsync
+ * The coroutine resumes on the thread that completes the future, which is the game thread
+ */
+struct FLLMPromptAwaiter
+{
+	TFuture<FLLMPromptResult> Future;
+	FLLMPromptResult Result;
+	bool bSuspended = false;
+
+	bool await_ready() const
+	{
+		return Future.IsReady();
+	}
+
+	void await_suspend(std::coroutine_handle<> Handle)
+	{
+		bSuspended = true;
+		// The continuation may run right away, nothing of this awaiter is touched after it
+		TFuture<FLLMPromptResult> Pending = MoveTemp(Future);
+		Pending.Then([this, Handle](TFuture<FLLMPromptResult> Completed)
+		{
+			Result = Completed.Get();
+			Handle.resume();
+		});
+	}
+
+	FLLMPromptResult await_resume()
+	{
+		return bSuspended ? MoveTemp(Result) : Future.Get();
+	}
+};
+
+
+
+inline FLLMPromptAwaiter operator co_await(TFuture<FLLMPromptResult>&& Future)
+{
+	return FLLMPromptAwaiter{MoveTemp(Future)};
+}
+
+#endif
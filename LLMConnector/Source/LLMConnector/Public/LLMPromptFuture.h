@@ -0,0 +1,54 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+#include "Async/Future.h"
+
+
+
+// Result of SendPromptAsync, always set: the error says why the response is missing
+struct FLLMPromptResult
+{
+	int32 RequestId = 0;
+	ELLMErrorType Error = ELLMErrorType::None;
+	FLLMResponseBase Response;
+
+	bool IsSuccess() const
+	{
+		return Error == ELLMErrorType::None;
+	}
+
+	bool IsCancelled() const
+	{
+		return Error == ELLMErrorType::Cancelled;
+	}
+};
+
+
+
+/**
+ * Shared flag for cancelling a prompt from any thread
+ * A prompt still in the queue is dropped before it reaches the history, an answered one completes with Cancelled
+ */
+class FLLMCancellationToken
+{
+public:
+	FLLMCancellationToken()
+		: m_bCancelled(MakeShared<std::atomic<bool>, ESPMode::ThreadSafe>(false))
+	{
+	}
+
+	void Cancel() const
+	{
+		m_bCancelled->store(true, std::memory_order_relaxed);
+	}
+
+	bool IsCancelled() const
+	{
+		return m_bCancelled->load(std::memory_order_relaxed);
+	}
+
+private:
+	TSharedRef<std::atomic<bool>, ESPMode::ThreadSafe> m_bCancelled;
+};
@@ -0,0 +1,95 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+
+
+
+/**
+ * Immutable UTF-8 message text, copies share one reference-counted buffer
+ * Interned texts are shared between all conversations, e.g. the world description and format instructions
+ */
+class LLMCONNECTOR_API FLLMPromptText
+{
+public:
+	FLLMPromptText() = default;
+
+	explicit FLLMPromptText(FStringView Text);
+	explicit FLLMPromptText(FUtf8StringView Text);
+
+	// One buffer for identical text while any history still uses it, safe from any thread
+	static FLLMPromptText Intern(FStringView Text);
+	static FLLMPromptText Intern(FUtf8StringView Text);
+
+	FString ToString() const;
+
+	FUtf8StringView GetView() const
+	{
+		return m_Data.IsValid() ? FUtf8StringView(m_Data->GetData(), m_Data->Num()) : FUtf8StringView();
+	}
+
+	bool IsEmpty() const
+	{
+		return !m_Data.IsValid() || m_Data->IsEmpty();
+	}
+
+	// Bytes of the buffer, the same for every copy
+	int64 GetAllocatedSize() const
+	{
+		return m_Data.IsValid() ? static_cast<int64>(m_Data->GetAllocatedSize()) : 0;
+	}
+
+	// Another copy or the intern table keeps the same buffer
+	bool IsShared() const
+	{
+		return m_Data.IsValid() && m_Data.GetSharedReferenceCount() > 1;
+	}
+
+	bool Equals(FStringView Text) const;
+
+	bool operator==(const FLLMPromptText& Other) const
+	{
+		return m_Data == Other.m_Data || GetView().Equals(Other.GetView(), ESearchCase::CaseSensitive);
+	}
+
+	bool operator!=(const FLLMPromptText& Other) const
+	{
+		return !(*this == Other);
+	}
+
+private:
+	using FBuffer = TArray<UTF8CHAR>;
+
+	explicit FLLMPromptText(TSharedPtr<const FBuffer, ESPMode::ThreadSafe> InData)
+		: m_Data(MoveTemp(InData))
+	{
+	}
+
+	static FLLMPromptText InternBuffer(FBuffer&& Utf8);
+
+	TSharedPtr<const FBuffer, ESPMode::ThreadSafe> m_Data;
+};
+
+
+
+// History entry of a conversation, FLLMPromptBase with shared text
+struct LLMCONNECTOR_API FLLMStoredPrompt
+{
+	ELLMRole Role = ELLMRole::User;
+	FLLMPromptText Text;
+	TArray<FLLMToolCall> ToolCalls;
+	FString ToolCallId;
+
+	FLLMStoredPrompt() = default;
+
+	// Not interned, the conversation interns only the reserved messages
+	explicit FLLMStoredPrompt(const FLLMPromptBase& Prompt);
+
+	FLLMPromptBase ToPrompt() const;
+
+	bool operator==(const FLLMPromptBase& Other) const
+	{
+		return Role == Other.Role && ToolCallId == Other.ToolCallId && Text.Equals(Other.Content);
+	}
+};
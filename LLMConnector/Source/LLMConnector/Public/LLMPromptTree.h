@@ -0,0 +1,99 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+
+
+
+/**
+ * Arena-backed alternative to FLLMPromptNode for large generated context
+ * Nodes live in one array and all text in one character pool, children keep insertion order
+ * Renders exactly like FLLMPromptNode in a single pass
+ */
+class LLMCONNECTOR_API FLLMPromptTree
+{
+public:
+	using FNodeId = int32;
+	static constexpr FNodeId RootId = 0;
+
+	explicit FLLMPromptTree(int32 ExpectedNodes = 0, int32 ExpectedChars = 0);
+
+	// Unlike FLLMPromptNode, always appends - use GetOrAddChild to merge by key
+	FNodeId AddChild(FNodeId Parent, FStringView Key, FStringView Content = FStringView());
+
+	// Copy an existing node with its children
+	FNodeId AddNode(FNodeId Parent, FStringView Key, const FLLMPromptNode& Node);
+
+	FNodeId GetOrAddChild(FNodeId Parent, FStringView Key);
+
+	FNodeId FindChild(FNodeId Parent, FStringView Key) const;
+
+	void SetContent(FNodeId Node, FStringView Content);
+
+	void Reset();
+
+
+	// Render into an existing builder without intermediate strings
+	void WriteTo(FStringBuilderBase& Out, ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
+
+	FString ToString(ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
+
+	int32 NumNodes() const
+	{
+		return Nodes.Num();
+	}
+
+
+	// Read access, used by the writer
+	FStringView GetKey(FNodeId Node) const
+	{
+		return GetText(Nodes[Node].Key);
+	}
+
+	FStringView GetContent(FNodeId Node) const
+	{
+		return GetText(Nodes[Node].Content);
+	}
+
+	int32 NumChildren(FNodeId Node) const
+	{
+		return Nodes[Node].NumChildren;
+	}
+
+	template <typename FuncType>
+	void ForEachChild(FNodeId Node, FuncType&& Func) const
+	{
+		for(FNodeId Child = Nodes[Node].FirstChild; Child != INDEX_NONE; Child = Nodes[Child].NextSibling)
+		{
+			Func(GetKey(Child), Child);
+		}
+	}
+
+private:
+	struct FTextSpan
+	{
+		int32 Offset = 0;
+		int32 Len = 0;
+	};
+
+	struct FNode
+	{
+		FTextSpan Key;
+		FTextSpan Content;
+		FNodeId FirstChild = INDEX_NONE;
+		FNodeId LastChild = INDEX_NONE;
+		FNodeId NextSibling = INDEX_NONE;
+		int32 NumChildren = 0;
+	};
+
+	FTextSpan AddText(FStringView Text);
+
+	FStringView GetText(const FTextSpan& Span) const
+	{
+		return FStringView(TextPool.GetData() + Span.Offset, Span.Len);
+	}
+
+	TArray<FNode> Nodes;
+	TArray<TCHAR> TextPool;
+};
@@ -0,0 +1,84 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "LLMRateLimiter.generated.h"
+
+class IHttpResponse;
+
+
+
+/**
+ * What the provider still allows, for falling back to scripted lines before requests start to wait
+ */
+USTRUCT(BlueprintType)
+struct LLMCONNECTOR_API FLLMRateLimitHeadroom
+{
+	GENERATED_BODY()
+
+	/** Requests that can be sent now, -1 without a known limit */
+	UPROPERTY(BlueprintReadOnly, Category = "LLM|RateLimit")
+	int32 Requests = -1;
+
+	/** Tokens that can be sent now, -1 without a known limit */
+	UPROPERTY(BlueprintReadOnly, Category = "LLM|RateLimit")
+	int32 Tokens = -1;
+
+	/** Left of the tighter limit, from 0 to 1 */
+	UPROPERTY(BlueprintReadOnly, Category = "LLM|RateLimit")
+	float Fraction = 1.0f;
+
+	/** Seconds until the next request may be sent, e.g. after Retry-After */
+	UPROPERTY(BlueprintReadOnly, Category = "LLM|RateLimit")
+	float WaitSeconds = 0.0f;
+};
+
+
+
+/**
+ * Token buckets of requests and tokens per minute
+ * Seeded from the settings and corrected by the x-ratelimit-* and Retry-After headers of every response
+ */
+class LLMCONNECTOR_API FLLMRateLimiter
+{
+public:
+	// 0 leaves the limit to the response headers
+	void Configure(int32 RequestsPerMinute, int32 TokensPerMinute, double Now);
+
+	// Seconds until a request with this many tokens fits, 0 to send it now
+	double GetWaitSeconds(int32 Tokens, double Now) const;
+
+	void OnRequestSent(int32 Tokens, double Now);
+
+	void UpdateFromResponse(const IHttpResponse& Response, double Now);
+
+	FLLMRateLimitHeadroom GetHeadroom(double Now) const;
+
+private:
+	struct FBucket
+	{
+		// Per minute, 0 when unknown
+		double Capacity = 0.0;
+		double Available = 0.0;
+		double Time = 0.0;
+
+		bool IsLimited() const
+		{
+			return Capacity > 0.0;
+		}
+
+		double GetAvailable(double Now) const;
+		double GetWaitSeconds(double Amount, double Now) const;
+		void Take(double Amount, double Now);
+		void SetLimit(double Limit, double Now);
+		void SetRemaining(double Remaining, double Now);
+	};
+
+	// Durations like "1s", "6m0s", "20ms", plain seconds or an epoch time in milliseconds
+	static bool ParseResetSeconds(const FString& Value, double Now, double& OutSeconds);
+
+	FBucket m_Requests;
+	FBucket m_Tokens;
+	double m_BlockedUntil = 0.0;
+};
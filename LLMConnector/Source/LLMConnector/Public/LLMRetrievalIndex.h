@@ -0,0 +1,52 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+
+/**
+ * Small in-memory BM25 index for picking the context entries relevant to a prompt
+ * Terms are lowercased alphanumeric runs stored by 64-bit hash, fields are weighted by repeating their terms
+ * Build once after the documents change, queries don't allocate per term
+ */
+class LLMCONNECTOR_API FLLMRetrievalIndex
+{
+public:
+	// Standard BM25 parameters
+	float K1 = 1.2f;
+	float B = 0.75f;
+
+	void Reset();
+
+	// Documents get sequential ids starting from 0
+	int32 BeginDocument();
+	void AddField(FStringView Text, float Weight = 1.0f);
+	void EndDocument();
+
+	int32 NumDocuments() const
+	{
+		return m_DocLengths.Num();
+	}
+
+	// Best matching document ids, highest score first; documents without any matching term are skipped
+	void Query(FStringView Text, int32 TopK, TArray<int32>& OutDocuments, TArray<float>* OutScores = nullptr) const;
+
+	// Calls Func with the hash of every term of the text
+	static void ForEachTerm(FStringView Text, TFunctionRef<void(uint64)> Func);
+
+private:
+	struct FPosting
+	{
+		int32 Document = 0;
+		float TermFrequency = 0.0f;
+	};
+
+	TMap<uint64, TArray<FPosting>> m_Postings;
+	TArray<float> m_DocLengths;
+	float m_TotalLength = 0.0f;
+
+	// Term frequencies of the document being built
+	TMap<uint64, float> m_CurrentTerms;
+	float m_CurrentLength = 0.0f;
+};
@@ -0,0 +1,61 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LLMConnectorStructs.h"
+
+
+
+/**
+ * Byte pair encoding of a model vocabulary, counts tokens the way the provider does
+ * Loads .tiktoken files (base64 token and rank per line) and tokenizer.json with a BPE model
+ * Text is split into words like cl100k/o200k do, and the count of each word is cached, so game text repeating
+ * the same names and keys is mostly counted by lookups
+ * Counting is safe from any thread
+ */
+class LLMCONNECTOR_API FLLMTokenizer
+{
+public:
+	// Chat formatting added around each message and before the reply
+	static constexpr int32 TokensPerMessage = 3;
+	static constexpr int32 TokensPerReply = 3;
+
+	// nullptr if the file can't be read or has no vocabulary, OutError gets the reason
+	static TSharedPtr<const FLLMTokenizer> LoadFromFile(const FString& FileName, FString* OutError = nullptr);
+
+	int32 CountTokens(FUtf8StringView Text) const;
+	int32 CountTokens(FStringView Text) const;
+
+	// Content, tool calls and the message formatting
+	int32 CountTokens(const FLLMPromptBase& Prompt) const;
+
+	// Messages of a request and the reply priming
+	int32 CountTokens(TConstArrayView<FLLMPromptBase> Messages) const;
+
+	// Rendered node, as it is sent
+	int32 CountTokens(const FLLMPromptNode& Node, ELLMPromptFormat Format = ELLMPromptFormat::Indented) const;
+
+	int32 GetVocabSize() const
+	{
+		return m_Ranks.Num();
+	}
+
+private:
+	FLLMTokenizer() = default;
+
+	bool LoadTikToken(const FString& Text, FString& OutError);
+	bool LoadTokenizerJson(const FString& Text, FString& OutError);
+
+	void AddToken(TConstArrayView<uint8> Bytes, int32 Rank);
+	int32 FindRank(const uint8* Bytes, int32 Num) const;
+
+	// One pre-tokenized word, looked up in the cache first
+	int32 CountWordTokens(const uint8* Bytes, int32 Num) const;
+	int32 MergeWord(const uint8* Bytes, int32 Num) const;
+
+	// 64-bit hash of the token bytes to rank, lower ranks merge first
+	TMap<uint64, int32> m_Ranks;
+
+	mutable FRWLock m_WordCacheLock;
+	mutable TMap<uint64, int32> m_WordCache;
+};
@@ -0,0 +1,69 @@
+﻿
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+
+// One request to the provider and its response
+struct LLMCONNECTOR_API FLLMTrafficEntry
+{
+	FString Request;
+	FString Response;
+	int32 ResponseCode = 0;
+	bool bSuccess = false;
+	// Since the recording started
+	double StartSeconds = 0.0;
+	// From sending the request to the response
+	double ElapsedSeconds = 0.0;
+};
+
+
+
+/**
+ * Trace file of LLM traffic, one JSON object per exchange and line
+ * Recording appends each exchange when its response arrives, replay serves the recorded responses without network
+ */
+class LLMCONNECTOR_API FLLMTrafficTrace
+{
+public:
+	// Starts a new trace file, an existing one is overwritten
+	static TUniquePtr<FLLMTrafficTrace> CreateRecording(const FString& FileName);
+
+	// nullptr if the file can't be read
+	static TUniquePtr<FLLMTrafficTrace> OpenReplay(const FString& FileName);
+
+	bool IsReplay() const
+	{
+		return m_bReplay;
+	}
+
+	const FString& GetFileName() const
+	{
+		return m_FileName;
+	}
+
+	void Record(const FString& Request, bool bSuccess, int32 ResponseCode, const FString& Response, double ElapsedSeconds);
+
+	// Recorded exchange for the request: the first unused one with the same payload, otherwise the next unused in recorded order
+	// nullptr when every exchange was served
+	const FLLMTrafficEntry* TakeReplay(const FString& Request);
+
+	int32 GetNumEntries() const
+	{
+		return m_Entries.Num();
+	}
+
+private:
+	FLLMTrafficTrace() = default;
+
+	FString m_FileName;
+	bool m_bReplay = false;
+	double m_StartSeconds = 0.0;
+
+	TArray<FLLMTrafficEntry> m_Entries;
+	TBitArray<> m_Served;
+	int32 m_FirstUnserved = 0;
+	// Entry indices by the hash of their request
+	TMultiMap<uint32, int32> m_EntriesByRequest;
+};